@@ -0,0 +1,173 @@
+#pragma once
+#include "common/logger.hpp"
+
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <map>
+#include <stdexcept>
+#include <string>
+
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+
+namespace util
+{
+   // Single threaded reactor: level triggered epoll over fds, and timers as
+   // timerfds in the same set, so the loop sleeps until something happens.
+   // Handlers may add and remove fds and timers, their own included.
+   struct event_loop_t : boost::noncopyable
+   {
+      typedef
+         boost::function<void (uint32_t)>
+         handler_t; // gets the epoll events
+
+      typedef
+         boost::function<void ()>
+         timer_handler_t;
+
+      struct error : std::runtime_error
+      {
+         error(std::string const & what)
+            : std::runtime_error(what)
+         {
+         }
+      };
+
+      event_loop_t()
+         : stopped_(false)
+      {
+         epoll_ = ::epoll_create1(EPOLL_CLOEXEC);
+         if(epoll_ == -1)
+            throw error(std::string("epoll_create1 failed: ") + strerror(errno));
+      }
+
+      ~event_loop_t()
+      {
+         for(auto const & t : timers_)
+            ::close(t.first);
+         ::close(epoll_);
+      }
+
+      void add(int fd, uint32_t events, handler_t const & handler)
+      {
+         ctl(EPOLL_CTL_ADD, fd, events);
+         handlers_[fd] = handler;
+      }
+
+      void modify(int fd, uint32_t events)
+      {
+         ctl(EPOLL_CTL_MOD, fd, events);
+      }
+
+      // before the fd is closed
+      void remove(int fd)
+      {
+         if(handlers_.erase(fd))
+            ::epoll_ctl(epoll_, EPOLL_CTL_DEL, fd, NULL);
+      }
+
+      // fires every period secs, the first time after delay (or period);
+      // returns the id for remove_timer
+      int add_timer(double period, timer_handler_t const & handler, double delay = 0)
+      {
+         int fd = ::timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+         if(fd == -1)
+            throw error(std::string("timerfd_create failed: ") + strerror(errno));
+         itimerspec spec;
+         spec.it_interval = to_timespec(period);
+         spec.it_value = to_timespec(delay > 0 ? delay : period);
+         if(::timerfd_settime(fd, 0, &spec, NULL) == -1)
+         {
+            int err = errno;
+            ::close(fd);
+            throw error(std::string("timerfd_settime failed: ") + strerror(err));
+         }
+         timers_[fd] = handler;
+         add(fd, EPOLLIN, [this, fd](uint32_t) { fire(fd); });
+         return fd;
+      }
+
+      void remove_timer(int id)
+      {
+         remove(id);
+         if(timers_.erase(id))
+            ::close(id);
+      }
+
+      // handles whatever is ready, waiting up to timeout_ms for it (-1 for ever)
+      void run_once(int timeout_ms = -1)
+      {
+         epoll_event events[MAX_EVENTS];
+         int n = ::epoll_wait(epoll_, events, MAX_EVENTS, timeout_ms);
+         if(n == -1)
+         {
+            if(errno == EINTR)
+               return;
+            throw error(std::string("epoll_wait failed: ") + strerror(errno));
+         }
+         for(int i = 0; i < n; ++i)
+         {
+            auto it = handlers_.find(events[i].data.fd);
+            if(it == handlers_.end())
+               continue; // removed by an earlier handler
+            handler_t handler = it->second; // it may remove itself
+            handler(events[i].events);
+         }
+      }
+
+      void run()
+      {
+         stopped_ = false;
+         while(!stopped_)
+            run_once();
+      }
+
+      void stop()
+      {
+         stopped_ = true;
+      }
+
+   private:
+      enum { MAX_EVENTS = 32 };
+
+      static timespec to_timespec(double secs)
+      {
+         timespec res;
+         res.tv_sec = (time_t)secs;
+         res.tv_nsec = (long)((secs - res.tv_sec) * 1e9);
+         return res;
+      }
+
+      void ctl(int op, int fd, uint32_t events)
+      {
+         epoll_event ev;
+         ev.events = events;
+         ev.data.u64 = 0;
+         ev.data.fd = fd;
+         if(::epoll_ctl(epoll_, op, fd, &ev) == -1)
+            throw error(std::string("epoll_ctl failed: ") + strerror(errno));
+      }
+
+      void fire(int fd)
+      {
+         uint64_t expirations;
+         if(::read(fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+            return;
+         auto it = timers_.find(fd);
+         if(it == timers_.end())
+            return;
+         timer_handler_t handler = it->second;
+         handler();
+      }
+
+   private:
+      int epoll_;
+      bool stopped_;
+      std::map<int, handler_t> handlers_;
+      std::map<int, timer_handler_t> timers_;
+   };
+}
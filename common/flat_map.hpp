@@ -0,0 +1,271 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <iterator>
+#include <utility>
+#include <vector>
+
+namespace util
+{
+   // Open addressing hash map for small keys: linear probing over one array of
+   // pairs, so a lookup is usually a single cache line and iteration is a scan
+   // instead of a walk over nodes. Erase shifts the rest of the run back
+   // rather than leaving tombstones. Any insert or erase invalidates iterators
+   // and references, and empty slots hold default constructed pairs.
+   template<class K, class V, class Hash>
+   struct flat_map_t
+   {
+      typedef
+         std::pair<K, V>
+         value_type; // K must not be changed through an iterator
+
+      template<class Map, class Value>
+      struct basic_iterator
+      {
+         typedef std::forward_iterator_tag iterator_category;
+         typedef Value value_type;
+         typedef ptrdiff_t difference_type;
+         typedef Value * pointer;
+         typedef Value & reference;
+
+         basic_iterator(Map * map, size_t pos)
+            : map_(map)
+            , pos_(pos)
+         {
+            skip();
+         }
+
+         // iterator to const_iterator
+         template<class OtherMap, class OtherValue>
+         basic_iterator(basic_iterator<OtherMap, OtherValue> const & other)
+            : map_(other.map_)
+            , pos_(other.pos_)
+         {
+         }
+
+         Value & operator*() const
+         {
+            return map_->slots_[pos_];
+         }
+
+         Value * operator->() const
+         {
+            return &map_->slots_[pos_];
+         }
+
+         basic_iterator & operator++()
+         {
+            ++pos_;
+            skip();
+            return *this;
+         }
+
+         bool operator == (basic_iterator const & other) const
+         {
+            return pos_ == other.pos_;
+         }
+
+         bool operator != (basic_iterator const & other) const
+         {
+            return pos_ != other.pos_;
+         }
+
+      private:
+         template<class, class, class> friend struct flat_map_t;
+         template<class, class> friend struct basic_iterator;
+
+         void skip()
+         {
+            while(pos_ < map_->used_.size() && !map_->used_[pos_])
+               ++pos_;
+         }
+
+         Map * map_;
+         size_t pos_;
+      };
+
+      typedef
+         basic_iterator<flat_map_t, value_type>
+         iterator;
+
+      typedef
+         basic_iterator<flat_map_t const, value_type const>
+         const_iterator;
+
+      flat_map_t()
+         : size_(0)
+      {
+      }
+
+      size_t size() const
+      {
+         return size_;
+      }
+
+      bool empty() const
+      {
+         return size_ == 0;
+      }
+
+      iterator begin()
+      {
+         return iterator(this, 0);
+      }
+
+      iterator end()
+      {
+         return iterator(this, used_.size());
+      }
+
+      const_iterator begin() const
+      {
+         return const_iterator(this, 0);
+      }
+
+      const_iterator end() const
+      {
+         return const_iterator(this, used_.size());
+      }
+
+      iterator find(K const & key)
+      {
+         return iterator(this, lookup(key));
+      }
+
+      const_iterator find(K const & key) const
+      {
+         return const_iterator(this, lookup(key));
+      }
+
+      size_t count(K const & key) const
+      {
+         return lookup(key) != used_.size();
+      }
+
+      std::pair<iterator, bool> insert(value_type const & value)
+      {
+         size_t pos = lookup(value.first);
+         if(pos != used_.size())
+            return std::make_pair(iterator(this, pos), false);
+         reserve(size_ + 1);
+         pos = place(value.first);
+         slots_[pos] = value;
+         used_[pos] = true;
+         ++size_;
+         return std::make_pair(iterator(this, pos), true);
+      }
+
+      V & operator[](K const & key)
+      {
+         return insert(value_type(key, V())).first->second;
+      }
+
+      void erase(iterator it)
+      {
+         size_t mask = used_.size() - 1;
+         size_t hole = it.pos_;
+         // pull back whatever the hole would have stopped a lookup from reaching
+         for(size_t pos = (hole + 1) & mask; used_[pos]; pos = (pos + 1) & mask)
+         {
+            size_t home = Hash()(slots_[pos].first) & mask;
+            if(((pos - home) & mask) >= ((pos - hole) & mask))
+            {
+               slots_[hole] = std::move(slots_[pos]);
+               hole = pos;
+            }
+         }
+         slots_[hole] = value_type();
+         used_[hole] = false;
+         --size_;
+      }
+
+      size_t erase(K const & key)
+      {
+         iterator it = find(key);
+         if(it == end())
+            return 0;
+         erase(it);
+         return 1;
+      }
+
+      // erases whatever pred(value) holds for, the way to filter in place as
+      // erase() leaves no iterator valid; entries shifted back get seen again
+      template<class Pred>
+      size_t erase_if(Pred pred)
+      {
+         size_t res = 0;
+         for(size_t pos = 0; pos < used_.size();)
+         {
+            if(used_[pos] && pred(slots_[pos]))
+            {
+               erase(iterator(this, pos));
+               ++res;
+            }
+            else
+               ++pos;
+         }
+         return res;
+      }
+
+      void clear()
+      {
+         slots_.clear();
+         used_.clear();
+         size_ = 0;
+      }
+
+      // room for n without growing, at most 3/4 full
+      void reserve(size_t n)
+      {
+         size_t cap = used_.size();
+         if(n * 4 <= cap * 3)
+            return;
+         if(cap < MIN_CAPACITY)
+            cap = MIN_CAPACITY;
+         while(n * 4 > cap * 3)
+            cap *= 2;
+         std::vector<value_type> slots(cap);
+         std::vector<uint8_t> used(cap);
+         slots.swap(slots_);
+         used.swap(used_);
+         for(size_t i = 0; i < used.size(); ++i)
+         {
+            if(!used[i])
+               continue;
+            size_t pos = place(slots[i].first);
+            slots_[pos] = std::move(slots[i]);
+            used_[pos] = true;
+         }
+      }
+
+   private:
+      enum { MIN_CAPACITY = 16 };
+
+      // slot of key, or used_.size()
+      size_t lookup(K const & key) const
+      {
+         if(size_ == 0)
+            return used_.size();
+         size_t mask = used_.size() - 1;
+         for(size_t pos = Hash()(key) & mask; used_[pos]; pos = (pos + 1) & mask)
+            if(slots_[pos].first == key)
+               return pos;
+         return used_.size();
+      }
+
+      // first free slot on the way of key
+      size_t place(K const & key) const
+      {
+         size_t mask = used_.size() - 1;
+         size_t pos = Hash()(key) & mask;
+         while(used_[pos])
+            pos = (pos + 1) & mask;
+         return pos;
+      }
+
+   private:
+      std::vector<value_type> slots_;
+      std::vector<uint8_t> used_;
+      size_t size_;
+   };
+}
@@ -0,0 +1,100 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <algorithm>
+#include <atomic>
+
+#include <boost/noncopyable.hpp>
+
+namespace util
+{
+   // Log2-bucketed histogram; record() is wait-free, take() drains the window.
+   // Bucket b holds values in [2^(b-1), 2^b), bucket 0 holds zeros.
+   struct histogram_t : boost::noncopyable
+   {
+      enum { BUCKETS = 32 };
+
+      struct snapshot_t
+      {
+         snapshot_t()
+            : count(0)
+            , sum(0)
+            , max(0)
+         {
+            for(size_t i = 0; i < BUCKETS; ++i)
+               buckets[i] = 0;
+         }
+
+         // upper bound of the bucket holding the p-th quantile, p in [0, 1]
+         uint64_t quantile(double p) const
+         {
+            if(count == 0)
+               return 0;
+            uint64_t rank = p * count, seen = 0;
+            for(size_t b = 0; b < BUCKETS; ++b)
+            {
+               seen += buckets[b];
+               if(seen > rank)
+                  return b == 0 ? 0 : std::min<uint64_t>(uint64_t(1) << b, max);
+            }
+            return max;
+         }
+
+         double mean() const
+         {
+            return count ? sum / (double)count : 0;
+         }
+
+         uint64_t count;
+         uint64_t sum;
+         uint64_t max;
+         uint64_t buckets[BUCKETS];
+      };
+
+      histogram_t()
+         : count_(0)
+         , sum_(0)
+         , max_(0)
+      {
+         for(size_t i = 0; i < BUCKETS; ++i)
+            buckets_[i] = 0;
+      }
+
+      void record(uint64_t value)
+      {
+         buckets_[bucket(value)].fetch_add(1, std::memory_order_relaxed);
+         count_.fetch_add(1, std::memory_order_relaxed);
+         sum_.fetch_add(value, std::memory_order_relaxed);
+         uint64_t max = max_.load(std::memory_order_relaxed);
+         while(value > max && !max_.compare_exchange_weak(max, value, std::memory_order_relaxed))
+            ;
+      }
+
+      // counts since the previous take(); fields may straddle a concurrent record()
+      snapshot_t take()
+      {
+         snapshot_t res;
+         for(size_t i = 0; i < BUCKETS; ++i)
+            res.buckets[i] = buckets_[i].exchange(0, std::memory_order_relaxed);
+         res.count = count_.exchange(0, std::memory_order_relaxed);
+         res.sum = sum_.exchange(0, std::memory_order_relaxed);
+         res.max = max_.exchange(0, std::memory_order_relaxed);
+         return res;
+      }
+
+   private:
+      static size_t bucket(uint64_t value)
+      {
+         if(value == 0)
+            return 0;
+         size_t b = 64 - __builtin_clzll(value);
+         return b < BUCKETS ? b : BUCKETS - 1;
+      }
+
+   private:
+      std::atomic<uint64_t> buckets_[BUCKETS];
+      std::atomic<uint64_t> count_;
+      std::atomic<uint64_t> sum_;
+      std::atomic<uint64_t> max_;
+   };
+}
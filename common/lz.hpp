@@ -0,0 +1,157 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+// LZ4 block format, greedy single hash probe: no entropy stage, so both ways
+// run at memory speed and what it buys is the redundancy of repeated fields
+// and addresses in our own payloads. decompress checks every length and
+// offset against both buffers and fails instead of trusting its input.
+namespace util
+{
+namespace lz
+{
+   enum
+   {
+      HASH_BITS = 12,
+      MIN_MATCH = 4,
+      MAX_OFFSET = 65535,
+      LAST_LITERALS = 5, // the format ends on literals ...
+      MFLIMIT = 12,      // ... and no match starts this close to the end
+   };
+
+   // worst case output for n bytes in
+   inline size_t bound(size_t n)
+   {
+      return n + n / 255 + 16;
+   }
+
+   namespace details
+   {
+      inline uint32_t load32(const uint8_t * p)
+      {
+         uint32_t res;
+         memcpy(&res, p, sizeof(res));
+         return res;
+      }
+
+      inline void put_length(std::vector<char> & out, size_t len)
+      {
+         for(; len >= 255; len -= 255)
+            out.push_back((char)255);
+         out.push_back((char)len);
+      }
+
+      // literals, then a match unless it is the last sequence
+      inline void put_sequence(std::vector<char> & out, const uint8_t * lit, size_t lit_len, size_t offset, size_t match_len)
+      {
+         size_t ml = match_len ? match_len - MIN_MATCH : 0;
+         out.push_back((char)(((lit_len < 15 ? lit_len : 15) << 4) | (ml < 15 ? ml : 15)));
+         if(lit_len >= 15)
+            put_length(out, lit_len - 15);
+         out.insert(out.end(), lit, lit + lit_len);
+         if(match_len == 0)
+            return;
+         out.push_back((char)(offset & 0xff));
+         out.push_back((char)(offset >> 8));
+         if(ml >= 15)
+            put_length(out, ml - 15);
+      }
+   }
+
+   // appends the compressed block to out
+   inline void compress(const char * src, size_t n, std::vector<char> & out)
+   {
+      const uint8_t * in = reinterpret_cast<const uint8_t*>(src);
+      std::vector<uint32_t> table(1 << HASH_BITS, 0); // position + 1, 0 for none
+      out.reserve(out.size() + bound(n));
+      size_t anchor = 0;
+      if(n > MFLIMIT)
+      {
+         size_t limit = n - MFLIMIT;
+         size_t i = 0;
+         while(i < limit)
+         {
+            uint32_t seq = details::load32(in + i);
+            uint32_t h = (seq * 2654435761u) >> (32 - HASH_BITS);
+            size_t ref = table[h];
+            table[h] = i + 1;
+            if(ref == 0 || i - (ref - 1) > MAX_OFFSET || details::load32(in + ref - 1) != seq)
+            {
+               ++i;
+               continue;
+            }
+            --ref;
+            size_t len = MIN_MATCH;
+            while(i + len < n - LAST_LITERALS && in[ref + len] == in[i + len])
+               ++len;
+            details::put_sequence(out, in + anchor, i - anchor, i - ref, len);
+            i += len;
+            anchor = i;
+         }
+      }
+      details::put_sequence(out, in + anchor, n - anchor, 0, 0);
+   }
+
+   // size is exactly what was compressed; false on anything malformed
+   inline bool decompress(const char * src, size_t n, char * dst, size_t size)
+   {
+      const uint8_t * in = reinterpret_cast<const uint8_t*>(src);
+      const uint8_t * end = in + n;
+      uint8_t * out = reinterpret_cast<uint8_t*>(dst);
+      uint8_t * out_end = out + size;
+      while(in < end)
+      {
+         unsigned token = *in++;
+         size_t lit = token >> 4;
+         if(lit == 15)
+         {
+            unsigned b;
+            do
+            {
+               if(in == end)
+                  return false;
+               b = *in++;
+               lit += b;
+            }
+            while(b == 255);
+         }
+         if((size_t)(end - in) < lit || (size_t)(out_end - out) < lit)
+            return false;
+         memcpy(out, in, lit);
+         in += lit;
+         out += lit;
+         if(in == end)
+            break; // the last sequence has no match
+
+         if(end - in < 2)
+            return false;
+         size_t offset = in[0] | (in[1] << 8);
+         in += 2;
+         if(offset == 0 || offset > (size_t)(out - reinterpret_cast<uint8_t*>(dst)))
+            return false;
+         size_t len = (token & 15) + MIN_MATCH;
+         if((token & 15) == 15)
+         {
+            unsigned b;
+            do
+            {
+               if(in == end)
+                  return false;
+               b = *in++;
+               len += b;
+            }
+            while(b == 255);
+         }
+         if((size_t)(out_end - out) < len)
+            return false;
+         const uint8_t * from = out - offset;
+         for(size_t k = 0; k < len; ++k) // may overlap, byte by byte on purpose
+            out[k] = from[k];
+         out += len;
+      }
+      return out == out_end;
+   }
+}
+}
@@ -0,0 +1,297 @@
+#pragma once
+#include <stdint.h>
+#include <assert.h>
+#include <atomic>
+#include <memory>
+#include <utility>
+
+#include <boost/noncopyable.hpp>
+
+namespace util
+{
+   // Fixed capacity object pool with reference counted handles. Slots are
+   // recycled through a lock-free free list, so handles may be taken and
+   // dropped on different threads without touching the heap.
+   template<class T>
+   struct pool_t : boost::noncopyable
+   {
+      struct slot_t
+      {
+         T value;
+         std::atomic<uint32_t> refs;
+         std::atomic<uint32_t> next_free;
+         slot_t * next; // intrusive_queue_t link
+         pool_t * pool;
+      };
+
+      struct handle_t
+      {
+         handle_t()
+            : slot_(NULL)
+         {
+         }
+
+         // adopts a reference
+         explicit handle_t(slot_t * slot)
+            : slot_(slot)
+         {
+         }
+
+         handle_t(handle_t const & other)
+            : slot_(other.slot_)
+         {
+            if(slot_)
+               ++slot_->refs;
+         }
+
+         handle_t(handle_t && other)
+            : slot_(other.slot_)
+         {
+            other.slot_ = NULL;
+         }
+
+         handle_t & operator = (handle_t other)
+         {
+            std::swap(slot_, other.slot_);
+            return *this;
+         }
+
+         ~handle_t()
+         {
+            reset();
+         }
+
+         void reset()
+         {
+            if(slot_ && --slot_->refs == 0)
+               slot_->pool->release(slot_);
+            slot_ = NULL;
+         }
+
+         // gives the reference away
+         slot_t * detach()
+         {
+            slot_t * res = slot_;
+            slot_ = NULL;
+            return res;
+         }
+
+         T & operator*() const
+         {
+            assert(slot_);
+            return slot_->value;
+         }
+
+         T * operator->() const
+         {
+            assert(slot_);
+            return &slot_->value;
+         }
+
+         explicit operator bool() const
+         {
+            return slot_ != NULL;
+         }
+
+         bool unique() const
+         {
+            return slot_ && slot_->refs == 1;
+         }
+
+      private:
+         slot_t * slot_;
+      };
+
+      explicit pool_t(size_t capacity)
+         : slots_(new slot_t[capacity])
+         , capacity_(capacity)
+         , available_(capacity)
+      {
+         for(size_t i = 0; i < capacity; ++i)
+         {
+            slots_[i].refs = 0;
+            slots_[i].next_free = i + 1;
+            slots_[i].next = NULL;
+            slots_[i].pool = this;
+         }
+         free_ = 0;
+      }
+
+      ~pool_t()
+      {
+         assert(available_ == capacity_);
+      }
+
+      // empty handle if the pool is exhausted
+      handle_t acquire()
+      {
+         uint64_t head = free_.load();
+         while(true)
+         {
+            uint32_t idx = head & 0xffffffff;
+            if(idx == capacity_)
+               return handle_t();
+            uint64_t next = ((head >> 32) + 1) << 32 | slots_[idx].next_free.load();
+            if(free_.compare_exchange_weak(head, next))
+            {
+               --available_;
+               slots_[idx].refs = 1;
+               slots_[idx].next = NULL;
+               return handle_t(&slots_[idx]);
+            }
+         }
+      }
+
+      size_t capacity() const
+      {
+         return capacity_;
+      }
+
+      size_t available() const
+      {
+         return available_;
+      }
+
+   private:
+      void release(slot_t * slot)
+      {
+         uint32_t idx = slot - slots_.get();
+         uint64_t head = free_.load();
+         while(true)
+         {
+            slot->next_free = head & 0xffffffff;
+            uint64_t next = ((head >> 32) + 1) << 32 | idx; // tag against ABA
+            if(free_.compare_exchange_weak(head, next))
+               break;
+         }
+         ++available_;
+      }
+
+   private:
+      std::unique_ptr<slot_t[]> slots_;
+      uint32_t capacity_;
+      std::atomic<uint64_t> free_;
+      std::atomic<size_t> available_;
+   };
+
+   // FIFO of pooled objects linked through their slots; holds one reference per
+   // element. Single threaded.
+   template<class T>
+   struct intrusive_queue_t : boost::noncopyable
+   {
+      typedef typename pool_t<T>::handle_t handle_t;
+      typedef typename pool_t<T>::slot_t slot_t;
+
+      intrusive_queue_t()
+         : head_(NULL)
+         , tail_(NULL)
+         , size_(0)
+      {
+      }
+
+      ~intrusive_queue_t()
+      {
+         clear();
+      }
+
+      bool empty() const
+      {
+         return head_ == NULL;
+      }
+
+      size_t size() const
+      {
+         return size_;
+      }
+
+      T & front() const
+      {
+         assert(head_);
+         return head_->value;
+      }
+
+      void push_back(handle_t h)
+      {
+         slot_t * s = h.detach();
+         assert(s);
+         s->next = NULL;
+         if(tail_)
+            tail_->next = s;
+         else
+            head_ = s;
+         tail_ = s;
+         ++size_;
+      }
+
+      // before the first element that is not less than *h
+      template<class Less>
+      void insert_sorted(handle_t h, Less const & less)
+      {
+         slot_t * s = h.detach();
+         assert(s);
+         slot_t ** link = &head_;
+         while(*link && less((*link)->value, s->value))
+            link = &(*link)->next;
+         s->next = *link;
+         *link = s;
+         if(s->next == NULL)
+            tail_ = s;
+         ++size_;
+      }
+
+      handle_t pop_front()
+      {
+         assert(head_);
+         slot_t * s = head_;
+         head_ = s->next;
+         if(head_ == NULL)
+            tail_ = NULL;
+         s->next = NULL;
+         --size_;
+         return handle_t(s);
+      }
+
+      template<class Pred>
+      T * find_if(Pred const & pred) const
+      {
+         for(slot_t * s = head_; s != NULL; s = s->next)
+            if(pred(s->value))
+               return &s->value;
+         return NULL;
+      }
+
+      template<class Pred>
+      void remove_if(Pred const & pred)
+      {
+         slot_t ** link = &head_;
+         tail_ = NULL;
+         while(*link)
+         {
+            slot_t * s = *link;
+            if(pred(s->value))
+            {
+               *link = s->next;
+               s->next = NULL;
+               --size_;
+               handle_t drop(s);
+            }
+            else
+            {
+               tail_ = s;
+               link = &s->next;
+            }
+         }
+      }
+
+      void clear()
+      {
+         while(!empty())
+            pop_front();
+      }
+
+   private:
+      slot_t * head_;
+      slot_t * tail_;
+      size_t size_;
+   };
+}
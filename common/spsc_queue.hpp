@@ -0,0 +1,62 @@
+#pragma once
+#include <stddef.h>
+#include <assert.h>
+#include <atomic>
+#include <memory>
+#include <utility>
+
+#include <boost/noncopyable.hpp>
+
+namespace util
+{
+   // Bounded wait-free ring for exactly one producer and one consumer thread.
+   template<class T>
+   struct spsc_queue_t : boost::noncopyable
+   {
+      // capacity is rounded up to a power of two
+      explicit spsc_queue_t(size_t capacity)
+         : head_(0)
+         , tail_(0)
+      {
+         size_ = 1;
+         while(size_ < capacity)
+            size_ <<= 1;
+         buf_.reset(new T[size_]);
+      }
+
+      // producer side; false if full
+      bool push(T value)
+      {
+         size_t tail = tail_.load(std::memory_order_relaxed);
+         if(tail - head_.load(std::memory_order_acquire) == size_)
+            return false;
+         buf_[tail & (size_ - 1)] = std::move(value);
+         tail_.store(tail + 1, std::memory_order_release);
+         return true;
+      }
+
+      // consumer side; false if empty
+      bool pop(T & value)
+      {
+         size_t head = head_.load(std::memory_order_relaxed);
+         if(head == tail_.load(std::memory_order_acquire))
+            return false;
+         value = std::move(buf_[head & (size_ - 1)]);
+         buf_[head & (size_ - 1)] = T();
+         head_.store(head + 1, std::memory_order_release);
+         return true;
+      }
+
+      size_t size() const
+      {
+         return tail_.load(std::memory_order_acquire) - head_.load(std::memory_order_acquire);
+      }
+
+   private:
+      std::unique_ptr<T[]> buf_;
+      size_t size_;
+      std::atomic<size_t> head_;
+      char pad_[64];
+      std::atomic<size_t> tail_;
+   };
+}
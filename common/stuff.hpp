@@ -1,6 +1,8 @@
 #pragma once
 #include <boost/functional/hash.hpp>
 #include <ifaddrs.h>
+#include <stdint.h>
+#include <string.h>
 #include <unordered_map>
 
 bool operator < (in_addr const & a, in_addr const & b)
@@ -84,40 +86,130 @@ namespace util
    }
 
 
+   namespace details
+   {
+      // wyhash (Wang Yi), final version 4
+      const uint64_t wyp[4] = { 0xa0761d6478bd642full, 0xe7037ed1a0b428dbull, 0x8ebc6af09c88c6e3ull, 0x589965cc75374cc3ull };
+
+      inline uint64_t wymix(uint64_t a, uint64_t b)
+      {
+         __uint128_t r = (__uint128_t)a * b;
+         return (uint64_t)r ^ (uint64_t)(r >> 64);
+      }
+
+      inline uint64_t wyr8(const uint8_t * p)
+      {
+         uint64_t v;
+         memcpy(&v, p, sizeof(v));
+         return v;
+      }
+
+      inline uint64_t wyr4(const uint8_t * p)
+      {
+         uint32_t v;
+         memcpy(&v, p, sizeof(v));
+         return v;
+      }
+
+      inline uint64_t wyr3(const uint8_t * p, size_t k)
+      {
+         return ((uint64_t)p[0] << 16) | ((uint64_t)p[k >> 1] << 8) | p[k - 1];
+      }
+   }
+
+   // 64 bit, 8 to 48 bytes per step; chain calls through seed
+   uint64_t hash64(const void * data, size_t size, uint64_t seed = 0)
+   {
+      using namespace details;
+      const uint8_t * p = static_cast<const uint8_t*>(data);
+      seed ^= wymix(seed ^ wyp[0], wyp[1]);
+      uint64_t a, b;
+      if(size <= 16)
+      {
+         if(size >= 4)
+         {
+            a = (wyr4(p) << 32) | wyr4(p + ((size >> 3) << 2));
+            b = (wyr4(p + size - 4) << 32) | wyr4(p + size - 4 - ((size >> 3) << 2));
+         }
+         else if(size > 0)
+         {
+            a = wyr3(p, size);
+            b = 0;
+         }
+         else
+            a = b = 0;
+      }
+      else
+      {
+         size_t i = size;
+         if(i > 48)
+         {
+            // three independent lanes keep the multipliers busy
+            uint64_t see1 = seed, see2 = seed;
+            do
+            {
+               seed = wymix(wyr8(p) ^ wyp[1], wyr8(p + 8) ^ seed);
+               see1 = wymix(wyr8(p + 16) ^ wyp[2], wyr8(p + 24) ^ see1);
+               see2 = wymix(wyr8(p + 32) ^ wyp[3], wyr8(p + 40) ^ see2);
+               p += 48;
+               i -= 48;
+            }
+            while(i > 48);
+            seed ^= see1 ^ see2;
+         }
+         for(; i > 16; i -= 16, p += 16)
+            seed = wymix(wyr8(p) ^ wyp[1], wyr8(p + 8) ^ seed);
+         a = wyr8(p + i - 16);
+         b = wyr8(p + i - 8);
+      }
+      __uint128_t r = (__uint128_t)(a ^ wyp[1]) * (b ^ seed);
+      return wymix((uint64_t)r ^ wyp[0] ^ size, (uint64_t)(r >> 64) ^ wyp[1]);
+   }
+
+   // splitmix64 finalizer, so that sums of hashes don't keep the input's structure
+   uint64_t mix64(uint64_t x)
+   {
+      x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+      x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+      return x ^ (x >> 31);
+   }
+
    template<class T>
-   uint32_t hash(T const & x)
+   uint64_t hash(T const & x)
    {
       return x;
    }
 
-   void hash_combine(uint32_t & h1, uint32_t h2)
+   void hash_combine(uint64_t & h1, uint64_t h2)
    {
-      h1 = ((h1<<1) + 239)^h2;
+      h1 = details::wymix(h1 ^ details::wyp[0], h2 ^ details::wyp[1]);
    }
 
    template<class Iterator>
-   uint32_t hash_range(Iterator b, Iterator e)
+   uint64_t hash_range(Iterator b, Iterator e)
    {
-      uint32_t res = 0;
+      uint64_t res = 0;
       for(; b != e; ++b)
          hash_combine(res, hash(*b));
       return res;
    }
 
-   uint32_t hash(const in_addr &x )
+   // key of every user and room table; a lone wymix would leave the low
+   // (bucket) bits nearly fixed by some address bits, the finalizer reaches them all
+   uint64_t hash(const in_addr &x )
    {
-      return hash_range(reinterpret_cast<const char*>(&x), reinterpret_cast<const char*>(&x) + sizeof(in_addr));
+      return mix64(x.s_addr);
    }
 
-   uint32_t hash(std::string const & str)
+   uint64_t hash(std::string const & str)
    {
-      return hash_range(str.begin(), str.end());
+      return hash64(str.data(), str.size());
    }
 
    template<class T>
    struct hasher
    {
-      uint32_t operator()(T const & t) const
+      size_t operator()(T const & t) const
       {
          return hash(t);
       }
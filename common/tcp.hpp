@@ -2,6 +2,7 @@
 
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <fcntl.h>
 #include <netinet/in.h>
 #include <netdb.h>
 #include <linux/tcp.h>
@@ -40,6 +41,23 @@ namespace tcp
          ::setsockopt(sock_, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
       }
 
+      void set_non_block(bool on)
+      {
+         int flags = ::fcntl(sock_, F_GETFL);
+         if(flags == -1 || ::fcntl(sock_, F_SETFL, on ? flags | O_NONBLOCK : flags & ~O_NONBLOCK) == -1)
+            throw net_error(std::string("Fcntl failed: ") + strerror(errno));
+      }
+
+      // pending error, e.g. how a non blocking connect ended
+      int error() const
+      {
+         int err = 0;
+         socklen_t len = sizeof(err);
+         if(::getsockopt(sock_, SOL_SOCKET, SO_ERROR, &err, &len) == -1)
+            return errno;
+         return err;
+      }
+
       void shutdown(int how)
       {
          int res = ::shutdown(sock_, how);
@@ -61,6 +79,21 @@ namespace tcp
          connect_impl((sockaddr*)&sa, sizeof(sa));
       }
 
+      // non blocking socket: false while in progress, writable once it is done
+      bool connect_async(in_addr const & addr, uint16_t port)
+      {
+         sockaddr_in sa;
+         sa.sin_family = AF_INET;
+         sa.sin_addr = addr;
+         sa.sin_port = htons(port);
+         int res = ::connect(sock_, (sockaddr*)&sa, sizeof(sa));
+         if(res == -1 && errno == EINPROGRESS)
+            return false;
+         if(res == -1)
+            throw net_error(std::string("Connection failed: ") + strerror(errno));
+         return true;
+      }
+
       void connect(std::string const & host, uint16_t port)
       {
          addrinfo hints;
@@ -135,6 +168,8 @@ namespace tcp
       size_t write(const T * data, size_t size, size_t offset)
       {
          int res = ::write(sock_, reinterpret_cast<const char *>(data) + offset, size);
+         if(res == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 0;
          if(res == -1)
             throw net_error(std::string("Write failed: ") + strerror(errno));
          if(res == 0 && size != 0)
@@ -158,6 +193,8 @@ namespace tcp
       size_t read(T * data, size_t size, size_t offset = 0)
       {
          int res = ::read(sock_, reinterpret_cast<char*>(data) + offset, size);
+         if(res == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 0;
          if(res == -1)
             throw net_error(std::string("Read failed: ") + strerror(errno));
          if(res == 0 && size != 0)
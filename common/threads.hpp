@@ -0,0 +1,151 @@
+#pragma once
+#include "common/logger.hpp"
+
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <string.h>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <boost/noncopyable.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
+
+namespace util
+{
+   // what a thread of some role should run with
+   struct thread_policy_t
+   {
+      thread_policy_t()
+         : priority(0)
+      {
+      }
+
+      int priority;          // SCHED_FIFO 1..99, 0 leaves the scheduler alone
+      std::vector<int> cpus; // empty leaves affinity alone
+   };
+
+   // "0,2-3" -> {0, 2, 3}; throws boost::bad_lexical_cast
+   inline std::vector<int> parse_cpus(std::string const & list)
+   {
+      std::vector<int> res;
+      std::stringstream ss(list);
+      std::string item;
+      while(std::getline(ss, item, ','))
+      {
+         size_t dash = item.find('-');
+         int from = boost::lexical_cast<int>(item.substr(0, dash));
+         int to = dash == std::string::npos ? from : boost::lexical_cast<int>(item.substr(dash + 1));
+         for(int cpu = from; cpu <= to; ++cpu)
+            res.push_back(cpu);
+      }
+      return res;
+   }
+
+   // Process wide table of thread roles. Threads name and configure themselves
+   // through configure_thread(); what actually took effect is logged and kept
+   // for report(), since priorities and memory locking are often denied.
+   struct thread_config_t : boost::noncopyable
+   {
+      static thread_config_t & instance()
+      {
+         static thread_config_t config;
+         return config;
+      }
+
+      // before the threads of that role start
+      void set_policy(std::string const & role, thread_policy_t const & policy)
+      {
+         lock_t __(mutex_);
+         policies_[role] = policy;
+      }
+
+      void lock_memory()
+      {
+         std::string res = ::mlockall(MCL_CURRENT | MCL_FUTURE) == 0
+            ? std::string("mlockall: locked")
+            : std::string("mlockall: ") + strerror(errno);
+         record(res);
+      }
+
+      void apply(std::string const & role)
+      {
+         thread_policy_t policy;
+         {
+            lock_t __(mutex_);
+            policy = policies_[role];
+         }
+         std::stringstream ss;
+         ss << role << ":";
+
+         std::string name = ("s2m-" + role).substr(0, 15);
+         int err = ::pthread_setname_np(::pthread_self(), name.c_str());
+         ss << " name " << (err == 0 ? name : strerror(err));
+
+         if(policy.priority != 0)
+         {
+            sched_param sp;
+            sp.sched_priority = policy.priority;
+            err = ::pthread_setschedparam(::pthread_self(), SCHED_FIFO, &sp);
+            ss << ", fifo " << policy.priority << (err == 0 ? "" : std::string(" denied: ") + strerror(err));
+         }
+         int sched;
+         sched_param sp;
+         if(::pthread_getschedparam(::pthread_self(), &sched, &sp) == 0)
+            ss << ", running " << (sched == SCHED_FIFO ? "fifo" : sched == SCHED_RR ? "rr" : "other") << " " << sp.sched_priority;
+
+         if(!policy.cpus.empty())
+         {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            for(int cpu : policy.cpus)
+               CPU_SET(cpu, &set);
+            err = ::pthread_setaffinity_np(::pthread_self(), sizeof(set), &set);
+            ss << ", cpus";
+            for(int cpu : policy.cpus)
+               ss << " " << cpu;
+            if(err != 0)
+               ss << " denied: " << strerror(err);
+         }
+         record(ss.str());
+      }
+
+      std::vector<std::string> report() const
+      {
+         lock_t __(mutex_);
+         return report_;
+      }
+
+   private:
+      typedef
+         boost::unique_lock<boost::mutex>
+         lock_t;
+
+      void record(std::string const & line)
+      {
+         logger::debug() << "thread_config: " << line;
+         lock_t __(mutex_);
+         report_.push_back(line);
+      }
+
+   private:
+      mutable boost::mutex mutex_;
+      std::map<std::string, thread_policy_t> policies_;
+      std::vector<std::string> report_;
+   };
+
+   // cheap enough for every audio callback: only the first call per thread does anything
+   inline void configure_thread(const char * role)
+   {
+      static thread_local const char * configured = NULL;
+      if(configured == role)
+         return;
+      configured = role;
+      thread_config_t::instance().apply(role);
+   }
+}
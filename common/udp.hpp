@@ -4,6 +4,7 @@
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <netdb.h>
 #include <stdexcept>
@@ -26,6 +27,7 @@ namespace udp
    {
       socket_t()
          : connected_(false)
+         , joined_(false)
       {
          sock_ = socket(PF_INET, SOCK_DGRAM, 0);
          if(sock_ == -1)
@@ -71,6 +73,11 @@ namespace udp
          connected_ = true;
       }
 
+      sockaddr_in const & address() const
+      {
+         return address_;
+      }
+
       void bind(boost::optional<uint16_t> const & port = boost::none)
       {
          sockaddr_in addr;
@@ -99,11 +106,26 @@ namespace udp
             throw net_error(std::string("setsockopt(SO_BROADCAST) failed: ") + strerror(errno));
       }
 
+      // with false only groups joined on this socket are delivered, not every group on the port
+      void set_multicast_all(bool all)
+      {
+         int flag = all ? 1 : 0;
+         int res = ::setsockopt(sock_, IPPROTO_IP, IP_MULTICAST_ALL, &flag, sizeof(flag));
+         if(res == -1)
+            throw net_error(std::string("setsockopt(IP_MULTICAST_ALL) failed: ") + strerror(errno));
+      }
+
       void join_group(bool join)
+      {
+         join_group(address_.sin_addr, join);
+         joined_ = join;
+      }
+
+      void join_group(in_addr const & group, bool join)
       {
          ip_mreq mreq;
          bzero(&mreq,sizeof(struct ip_mreq));
-         bcopy(&address_.sin_addr, &mreq.imr_multiaddr.s_addr, sizeof(struct in_addr));
+         bcopy(&group, &mreq.imr_multiaddr.s_addr, sizeof(struct in_addr));
          // set interface
          mreq.imr_interface.s_addr = htonl(INADDR_ANY);
 
@@ -135,6 +157,34 @@ namespace udp
          return sendto(address_.sin_addr, htons(address_.sin_port), buffer, size);
       }
 
+      // gathers iov into one datagram to the connected address
+      size_t sendv(const iovec * iov, size_t cnt)
+      {
+         return sendv(address_, iov, cnt);
+      }
+
+      size_t sendv(in_addr const & addr, uint16_t port, const iovec * iov, size_t cnt)
+      {
+         sockaddr_in saddr = {0};
+         saddr.sin_family = AF_INET;
+         saddr.sin_addr = addr;
+         saddr.sin_port = htons(port);
+         return sendv(saddr, iov, cnt);
+      }
+
+      size_t sendv(sockaddr_in const & saddr, const iovec * iov, size_t cnt)
+      {
+         msghdr msg = {0};
+         msg.msg_name = const_cast<sockaddr_in*>(&saddr);
+         msg.msg_namelen = sizeof(saddr);
+         msg.msg_iov = const_cast<iovec*>(iov);
+         msg.msg_iovlen = cnt;
+         int res = ::sendmsg(sock_, &msg, 0);
+         if(res == -1)
+            throw net_error(std::string("sendmsg failed: ") + strerror(errno));
+         return (size_t)res;
+      }
+
       template<class T>
       size_t recvfrom(in_addr & addr, uint16_t port, T * buffer, size_t size) //return in bytes!
       {
@@ -163,9 +213,46 @@ namespace udp
          return res;
       }
 
+      // like recv, also reports the destination address (the group for multicast) from IP_PKTINFO
+      template<class T>
+      size_t recv(T * buffer, size_t size, in_addr * sender, in_addr * dest) //return in bytes!
+      {
+         iovec iov;
+         iov.iov_base = buffer;
+         iov.iov_len = sizeof(T)*size;
+         return recvv(&iov, 1, sender, dest);
+      }
+
+      // scatters one datagram over iov
+      size_t recvv(const iovec * iov, size_t cnt, in_addr * sender, in_addr * dest) //return in bytes!
+      {
+         sockaddr_in saddr = {0};
+         char control[CMSG_SPACE(sizeof(in_pktinfo))];
+         msghdr msg = {0};
+         msg.msg_name = &saddr;
+         msg.msg_namelen = sizeof(saddr);
+         msg.msg_iov = const_cast<iovec*>(iov);
+         msg.msg_iovlen = cnt;
+         msg.msg_control = control;
+         msg.msg_controllen = sizeof(control);
+         int res = ::recvmsg(sock_, &msg, 0);
+         if(res == -1)
+            throw net_error(std::string("recvmsg failed: ") + strerror(errno));
+         if(sender)
+            *sender = saddr.sin_addr;
+         if(dest)
+         {
+            bzero(dest, sizeof(in_addr));
+            for(cmsghdr * c = CMSG_FIRSTHDR(&msg); c != NULL; c = CMSG_NXTHDR(&msg, c))
+               if(c->cmsg_level == IPPROTO_IP && c->cmsg_type == IP_PKTINFO)
+                  *dest = reinterpret_cast<in_pktinfo*>(CMSG_DATA(c))->ipi_addr;
+         }
+         return res;
+      }
+
       ~socket_t()
       {
-         if(connected_)
+         if(joined_)
             join_group(false);
          ::close(sock_);
       }
@@ -173,6 +260,7 @@ namespace udp
       int sock_;
       sockaddr_in address_;
       bool connected_;
+      bool joined_;
    };
 }
 
@@ -0,0 +1,205 @@
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <boost/lexical_cast.hpp>
+
+#include "sim.hpp"
+
+static void usage(const char * name)
+{
+   std::cerr << "usage: " << name << " [options]\n"
+             << "   -n <nodes>      clients at the start (100)\n"
+             << "   -j <joins>      clients joining later (5)\n"
+             << "   -k <kills>      clients crashing (5)\n"
+             << "   -c <changes>    nick changes (5)\n"
+             << "   -g <seconds>    virtual time between events (60)\n"
+             << "   -l <loss>       share of datagrams lost, 0..1 (0)\n"
+             << "   -d <ms>         one way latency (5)\n"
+             << "   -s <seed>       for the event order, picks and losses (1)\n";
+}
+
+namespace
+{
+   enum { PERIOD_DIVISOR = 10 }; // client_t polls swim ten times a period
+
+   struct outcome_t
+   {
+      outcome_t()
+         : events(0)
+         , converged(0)
+         , total_time(0)
+         , max_time(0)
+         , sessions(0)
+         , bytes(0)
+      {
+      }
+
+      size_t events;
+      size_t converged;
+      double total_time;
+      double max_time;
+      size_t sessions;
+      size_t bytes;
+   };
+
+   in_addr node_ip(size_t i)
+   {
+      in_addr res;
+      res.s_addr = htonl(0x0a000001 + i);
+      return res;
+   }
+
+   // runs until the tables agree or limit passes; secs taken, negative if they never did
+   double converge(sim::world_t & world, double limit, double period)
+   {
+      double start = world.now();
+      while(world.now() < start + limit)
+      {
+         world.run_until(world.now() + period, period);
+         if(world.converged())
+            return world.now() - start;
+      }
+      return -1;
+   }
+
+   void print(std::string const & name, outcome_t const & o)
+   {
+      std::cout << std::setw(8) << name << std::setw(8) << o.events << std::setw(11) << o.converged;
+      if(o.converged)
+         std::cout << std::setw(10) << std::fixed << std::setprecision(1) << o.total_time / o.converged
+                   << std::setw(10) << o.max_time;
+      else
+         std::cout << std::setw(10) << "-" << std::setw(10) << "-";
+      std::cout << std::setw(14) << std::setprecision(1) << (o.events ? o.sessions / (double)o.events : 0)
+                << std::setw(14) << (o.events ? o.bytes / o.events : 0) << "\n";
+   }
+}
+
+int main(int argc, char** argv)
+{
+   logger::set_logger(logger::ERROR,   logger::null_holder());
+   logger::set_logger(logger::WARNING, logger::null_holder());
+   logger::set_logger(logger::DEBUG,   logger::null_holder());
+   logger::set_logger(logger::TRACE,   logger::null_holder());
+
+   size_t nodes = 100, joins = 5, kills = 5, changes = 5;
+   double gap = 60;
+   sim::world_t::options_t opts;
+   try
+   {
+      for(int i = 1; i < argc; ++i)
+      {
+         std::string arg = argv[i];
+         if(i + 1 == argc)
+            throw boost::bad_lexical_cast();
+         else if(arg == "-n")
+            nodes = boost::lexical_cast<size_t>(argv[++i]);
+         else if(arg == "-j")
+            joins = boost::lexical_cast<size_t>(argv[++i]);
+         else if(arg == "-k")
+            kills = boost::lexical_cast<size_t>(argv[++i]);
+         else if(arg == "-c")
+            changes = boost::lexical_cast<size_t>(argv[++i]);
+         else if(arg == "-g")
+            gap = boost::lexical_cast<double>(argv[++i]);
+         else if(arg == "-l")
+            opts.loss = boost::lexical_cast<double>(argv[++i]);
+         else if(arg == "-d")
+            opts.latency = boost::lexical_cast<double>(argv[++i]) / 1000;
+         else if(arg == "-s")
+            opts.seed = boost::lexical_cast<uint32_t>(argv[++i]);
+         else
+            throw boost::bad_lexical_cast();
+      }
+      if(nodes == 0 || kills >= nodes || gap <= 0 || opts.loss < 0 || opts.loss >= 1 || opts.latency <= 0)
+         throw boost::bad_lexical_cast();
+   }
+   catch(boost::bad_lexical_cast &)
+   {
+      usage(argv[0]);
+      return 1;
+   }
+
+   try
+   {
+      sim::world_t world(opts);
+      double period = swim_t::options_t().period / PERIOD_DIVISOR;
+
+      // everybody starts within the first second, like a room full of laptops opening
+      for(size_t i = 0; i < nodes; ++i)
+      {
+         world.run_until(i / (double)nodes, period);
+         world.join(node_ip(i));
+      }
+      sim::stats_t before = world.stats();
+      double took = converge(world, gap * 4, period);
+      std::cout << nodes << " nodes ";
+      if(took < 0)
+         std::cout << "never converged";
+      else
+         std::cout << "converged in " << std::fixed << std::setprecision(1) << took << " s";
+      std::cout << ", " << world.stats().sessions - before.sessions << " sync sessions, "
+                << world.stats().sync_bytes - before.sync_bytes << " sync bytes\n";
+
+      std::vector<char> events;
+      events.insert(events.end(), joins, 'j');
+      events.insert(events.end(), kills, 'k');
+      events.insert(events.end(), changes, 'c');
+      std::shuffle(events.begin(), events.end(), world.random());
+
+      std::map<char, outcome_t> outcomes;
+      size_t next_ip = nodes, renames = 0;
+      before = world.stats();
+      double events_start = world.now();
+      for(char kind : events)
+      {
+         std::vector<in_addr> live = world.live();
+         in_addr pick = live[world.random()() % live.size()];
+         if(kind == 'j')
+            world.join(node_ip(next_ip++));
+         else if(kind == 'k')
+            world.kill(pick);
+         else
+            world.set_nick(pick, "renamed-" + boost::lexical_cast<std::string>(++renames));
+
+         sim::stats_t at = world.stats();
+         double start = world.now();
+         double took = converge(world, gap, period);
+         outcome_t & o = outcomes[kind];
+         ++o.events;
+         o.sessions += world.stats().sessions - at.sessions;
+         o.bytes += world.stats().datagram_bytes - at.datagram_bytes + world.stats().sync_bytes - at.sync_bytes;
+         if(took >= 0)
+         {
+            ++o.converged;
+            o.total_time += took;
+            o.max_time = std::max(o.max_time, took);
+         }
+         world.run_until(start + gap, period);
+      }
+
+      sim::stats_t const & after = world.stats();
+      double secs = world.now() - events_start;
+      std::cout << "\n   event  count  converged  mean, s   max, s  sessions/ev  bytes to conv.\n";
+      print("join", outcomes['j']);
+      print("crash", outcomes['k']);
+      print("nick", outcomes['c']);
+      if(!events.empty() && secs > 0)
+      {
+         size_t live = world.live().size();
+         std::cout << "\nover " << std::setprecision(0) << secs << " s with " << live << " nodes up at the end:\n"
+                   << "   datagrams/node/s " << std::setprecision(2) << (after.datagrams - before.datagrams) / secs / live
+                   << ", bytes/node/s " << (after.datagram_bytes - before.datagram_bytes) / secs / live
+                   << ", lost " << after.lost - before.lost << "\n"
+                   << "   sync sessions " << after.sessions - before.sessions
+                   << " (" << (after.sessions - before.sessions) / (double)events.size() << " per event)"
+                   << ", sync bytes " << after.sync_bytes - before.sync_bytes << "\n";
+      }
+   }
+   catch(std::exception & e)
+   {
+      std::cerr << "Critical error: " << e.what() << std::endl;
+      return 1;
+   }
+   return 0;
+}
@@ -0,0 +1,336 @@
+#pragma once
+#include "common/logger.hpp"
+#include "speak-to-me/directory.hpp"
+
+#include <arpa/inet.h>
+#include <stdint.h>
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <queue>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+
+// Many discovery clients in one process, on virtual time. Every node is the
+// client's own s2m::directory_t; the world stands in for its sockets and
+// clocks. Datagrams arrive after a fixed latency and get lost on request,
+// connections come up after one latency and carry each session payload in one
+// more, and closing one end fails the other, like a reset would.
+namespace sim
+{
+   struct stats_t
+   {
+      stats_t()
+         : datagrams(0)
+         , datagram_bytes(0)
+         , lost(0)
+         , sessions(0)
+         , sync_bytes(0)
+      {
+      }
+
+      size_t datagrams;
+      size_t datagram_bytes;
+      size_t lost;
+      size_t sessions;
+      size_t sync_bytes;
+   };
+
+   struct world_t : boost::noncopyable
+   {
+      struct options_t
+      {
+         options_t()
+            : latency(.005)
+            , loss(0)
+            , seed(1)
+         {
+         }
+
+         double latency; // secs, one way
+         double loss;    // share of datagrams dropped, sessions are reliable
+         uint32_t seed;
+      };
+
+      explicit world_t(options_t const & opts = options_t())
+         : opts_(opts)
+         , now_(0)
+         , expire_at_(0)
+         , seq_(0)
+         , next_conn_(0)
+         , random_(opts.seed)
+      {
+         group_.s_addr = htonl(0xef010101);
+      }
+
+      double now() const
+      {
+         return now_;
+      }
+
+      stats_t const & stats() const
+      {
+         return stats_;
+      }
+
+      std::mt19937 & random()
+      {
+         return random_;
+      }
+
+      s2m::directory_t & join(in_addr const & ip)
+      {
+         s2m::directory_t::callbacks_t cb;
+         cb.send = [this, ip](in_addr const & to, const char * buf, size_t size) { send(ip, to, buf, size); };
+         cb.connect = [this, ip](in_addr const & to) { return connect(ip, to); };
+         cb.close = [this, ip](in_addr const & peer) { close(ip, peer); };
+         cb.now = [this]() { return now_; };
+         cb.time = [this]() { return (uint32_t)(EPOCH + now_); };
+         std::unique_ptr<s2m::directory_t> & node = nodes_[ip];
+         node.reset(new s2m::directory_t(ip, group_, std::string("node-") + inet_ntoa(ip), cb));
+         return *node;
+      }
+
+      // gone without a word, like a crashed client
+      void kill(in_addr const & ip)
+      {
+         nodes_.erase(ip);
+      }
+
+      void set_nick(in_addr const & ip, std::string const & nick)
+      {
+         if(s2m::directory_t * n = find(ip))
+            n->set_nick(nick);
+      }
+
+      std::vector<in_addr> live() const
+      {
+         std::vector<in_addr> res;
+         for(auto const & n : nodes_)
+            res.push_back(n.first);
+         return res;
+      }
+
+      // every node knows exactly the nodes that are up, and agrees on them
+      bool converged() const
+      {
+         if(nodes_.empty())
+            return true;
+         uint64_t hash = nodes_.begin()->second->hash();
+         for(auto const & n : nodes_)
+            if(n.second->hash() != hash || n.second->size() != nodes_.size())
+               return false;
+         return true;
+      }
+
+      // polls every node each period, like the client's timer, delivering in between
+      void run_until(double to, double period)
+      {
+         while(now_ < to)
+         {
+            double next = std::min(to, now_ + period);
+            while(!events_.empty() && events_.top().at <= next)
+            {
+               event_t e = events_.top();
+               events_.pop();
+               now_ = e.at;
+               e.action();
+            }
+            now_ = next;
+            for(auto const & n : nodes_)
+               n.second->poll();
+            if(expire_at_ <= now_)
+            {
+               for(auto const & n : nodes_)
+                  n.second->expire_sessions();
+               expire_at_ = now_ + 1;
+            }
+         }
+      }
+
+   private:
+      enum { EPOCH = 1700000000 }; // wall clock at virtual 0
+
+      struct event_t
+      {
+         double at;
+         uint64_t seq; // keeps events of the same time in order
+         boost::function<void ()> action;
+
+         bool operator < (event_t const & other) const
+         {
+            return at != other.at ? at > other.at : seq > other.seq;
+         }
+      };
+
+      // one tcp connection, from connected to accepted
+      struct conn_t
+      {
+         in_addr from, to;
+         std::shared_ptr<std::vector<char>> digest_from, digest_to, list_from, list_to;
+      };
+
+      typedef
+         std::pair<in_addr, in_addr>
+         end_t; // (node, peer)
+
+      void schedule(double delay, boost::function<void ()> const & action)
+      {
+         event_t e = { now_ + delay, seq_++, action };
+         events_.push(e);
+      }
+
+      s2m::directory_t * find(in_addr const & ip)
+      {
+         auto it = nodes_.find(ip);
+         return it == nodes_.end() ? NULL : it->second.get();
+      }
+
+      void send(in_addr const & from, in_addr const & to, const char * buf, size_t size)
+      {
+         ++stats_.datagrams;
+         stats_.datagram_bytes += size;
+         std::vector<in_addr> dests;
+         if(to == group_)
+         {
+            for(auto const & n : nodes_)
+               if(!(n.first == from))
+                  dests.push_back(n.first);
+         }
+         else
+            dests.push_back(to);
+         std::shared_ptr<std::vector<char>> data = std::make_shared<std::vector<char>>(buf, buf + size);
+         for(auto const & ip : dests)
+         {
+            if(std::uniform_real_distribution<double>(0, 1)(random_) < opts_.loss)
+            {
+               ++stats_.lost;
+               continue;
+            }
+            schedule(opts_.latency, [this, ip, data]()
+            {
+               if(s2m::directory_t * n = find(ip))
+                  n->handle(&(*data)[0], data->size());
+            });
+         }
+      }
+
+      bool connect(in_addr const & from, in_addr const & to)
+      {
+         uint64_t id = next_conn_++;
+         conn_t c;
+         c.from = from;
+         c.to = to;
+         conns_[id] = c;
+         ends_[end_t(from, to)] = id;
+         schedule(opts_.latency, [this, id]() { establish(id); });
+         return true;
+      }
+
+      // this end of the connection went away, the other learns a latency later
+      void close(in_addr const & node, in_addr const & peer)
+      {
+         auto it = ends_.find(end_t(node, peer));
+         if(it == ends_.end())
+            return;
+         uint64_t id = it->second;
+         ends_.erase(it);
+         conns_.erase(id);
+         schedule(opts_.latency, [this, peer, node, id]() { fail(peer, node, id); });
+      }
+
+      void fail(in_addr const & node, in_addr const & peer, uint64_t id)
+      {
+         auto it = ends_.find(end_t(node, peer));
+         if(it == ends_.end() || it->second != id)
+            return;
+         ends_.erase(it);
+         conns_.erase(id);
+         if(s2m::directory_t * n = find(node))
+            n->session_failed(peer);
+      }
+
+      bool alive(uint64_t id)
+      {
+         auto it = conns_.find(id);
+         if(it == conns_.end())
+            return false;
+         in_addr from = it->second.from, to = it->second.to;
+         if(find(from) && find(to))
+            return true;
+         // a crashed end never says so, the survivor finds out
+         if(find(from))
+            schedule(0, [this, from, to, id]() { fail(from, to, id); });
+         if(find(to))
+            schedule(0, [this, from, to, id]() { fail(to, from, id); });
+         return false;
+      }
+
+      void establish(uint64_t id)
+      {
+         auto it = conns_.find(id);
+         if(it == conns_.end())
+            return;
+         conn_t & c = it->second;
+         s2m::directory_t * to = find(c.to);
+         if(!to || !to->accept_session(c.from))
+         {
+            in_addr from = c.from, peer = c.to;
+            schedule(opts_.latency, [this, from, peer, id]() { fail(from, peer, id); });
+            return;
+         }
+         ends_[end_t(c.to, c.from)] = id;
+         ++stats_.sessions;
+         c.digest_from = std::make_shared<std::vector<char>>();
+         c.digest_to = std::make_shared<std::vector<char>>();
+         find(c.from)->session_digest(*c.digest_from);
+         to->session_digest(*c.digest_to);
+         stats_.sync_bytes += c.digest_from->size() + c.digest_to->size();
+         schedule(opts_.latency, [this, id]() { reply(id); });
+      }
+
+      void reply(uint64_t id)
+      {
+         if(!alive(id))
+            return;
+         conn_t & c = conns_[id];
+         c.list_from = std::make_shared<std::vector<char>>();
+         c.list_to = std::make_shared<std::vector<char>>();
+         find(c.from)->session_reply(c.to, *c.digest_to, *c.list_from);
+         find(c.to)->session_reply(c.from, *c.digest_from, *c.list_to);
+         stats_.sync_bytes += c.list_from->size() + c.list_to->size();
+         schedule(opts_.latency, [this, id]() { done(id); });
+      }
+
+      void done(uint64_t id)
+      {
+         if(!alive(id))
+            return;
+         conn_t c = conns_[id];
+         conns_.erase(id);
+         ends_.erase(end_t(c.from, c.to));
+         ends_.erase(end_t(c.to, c.from));
+         find(c.from)->session_done(c.to, *c.list_to);
+         find(c.to)->session_done(c.from, *c.list_from);
+      }
+
+   private:
+      options_t opts_;
+      in_addr group_;
+      double now_;
+      double expire_at_;
+      uint64_t seq_;
+      uint64_t next_conn_;
+      std::mt19937 random_;
+      std::map<in_addr, std::unique_ptr<s2m::directory_t>> nodes_;
+      std::map<uint64_t, conn_t> conns_;
+      std::map<end_t, uint64_t> ends_; // the connection each node holds per peer
+      std::priority_queue<event_t> events_;
+      stats_t stats_;
+   };
+}
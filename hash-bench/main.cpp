@@ -0,0 +1,274 @@
+#include <math.h>
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+#include <boost/lexical_cast.hpp>
+
+#include <arpa/inet.h>
+#include "common/logger.hpp"
+#include "common/stuff.hpp"
+
+// Speed of the util hashing primitives, and checks of their quality where the
+// client leans on it: table buckets come from the low bits of hash(in_addr),
+// and the directory's table hash is a sum of hash64 chains, so equal sums for
+// different tables would hide a divergence.
+namespace
+{
+   typedef
+      std::chrono::steady_clock
+      steady_t;
+
+   // what util::hash_range did before hash64, for comparison
+   uint32_t legacy_hash(const void * data, size_t size)
+   {
+      const uint8_t * p = static_cast<const uint8_t*>(data);
+      uint32_t h = 0;
+      for(size_t i = 0; i < size; ++i)
+         h = ((h << 1) + 239) ^ p[i];
+      return h;
+   }
+
+   template<class F>
+   double ns_per_call(F const & f)
+   {
+      size_t rounds = 0, batch = 1 << 16;
+      uint64_t sink = 0;
+      steady_t::time_point start = steady_t::now();
+      double secs = 0;
+      do
+      {
+         for(size_t i = 0; i < batch; ++i)
+            sink += f(i);
+         rounds += batch;
+         secs = std::chrono::duration<double>(steady_t::now() - start).count();
+      } while(secs < .3);
+      if(sink == 42)
+         std::cout << "";
+      return secs / rounds * 1e9;
+   }
+
+   void speed()
+   {
+      std::vector<char> buf(1 << 16);
+      std::mt19937 random(1);
+      for(auto & c : buf)
+         c = (char)random();
+
+      double ns = ns_per_call([](size_t i) { in_addr a; a.s_addr = i; return util::hash(a); });
+      std::cout << "hash(in_addr): " << ns << " ns" << std::endl;
+      for(size_t size : {4, 8, 16, 32, 64, 256, 4096, 65536})
+      {
+         size_t mask = buf.size() - size;
+         double fast = ns_per_call([&](size_t i) { return util::hash64(&buf[i & mask & ~7], size); });
+         double old = ns_per_call([&](size_t i) { return legacy_hash(&buf[i & mask & ~7], size); });
+         std::cout << "hash64 " << size << " bytes: " << fast << " ns, " << size / fast << " GB/s"
+                   << " (byte fold " << old << " ns, " << size / old << " GB/s)" << std::endl;
+      }
+   }
+
+   struct checks_t
+   {
+      checks_t()
+         : failed(0)
+      {
+      }
+
+      void report(std::string const & what, bool ok, std::string const & detail)
+      {
+         std::cout << (ok ? "ok     " : "FAILED ") << what << ": " << detail << std::endl;
+         failed += !ok;
+      }
+
+      // every key hashed apart, and the low bits spread them over buckets
+      // as evenly as chance would: chi-square against uniform, as a z-score
+      void spread(std::string const & what, std::vector<uint64_t> hashes, size_t bucket_bits)
+      {
+         std::vector<size_t> buckets(size_t(1) << bucket_bits);
+         for(uint64_t h : hashes)
+            ++buckets[h & (buckets.size() - 1)];
+         double expected = (double)hashes.size() / buckets.size();
+         double chi2 = 0;
+         for(size_t b : buckets)
+            chi2 += (b - expected) * (b - expected) / expected;
+         double dof = buckets.size() - 1;
+         double z = (chi2 - dof) / sqrt(2 * dof);
+
+         std::sort(hashes.begin(), hashes.end());
+         size_t same = hashes.size() - (std::unique(hashes.begin(), hashes.end()) - hashes.begin());
+         report(what, same == 0 && fabs(z) < 6, boost::lexical_cast<std::string>(same) + " collisions, bucket z "
+                + boost::lexical_cast<std::string>(z));
+      }
+
+      size_t failed;
+   };
+
+   std::vector<uint64_t> addresses(size_t n, uint32_t first, uint32_t step)
+   {
+      std::vector<uint64_t> res(n);
+      for(size_t i = 0; i < n; ++i)
+      {
+         in_addr a;
+         a.s_addr = htonl(first + i * step);
+         res[i] = util::hash(a);
+      }
+      return res;
+   }
+
+   // share of output bits that flip with each input bit, worst over all pairs
+   template<class F>
+   double avalanche(size_t size, size_t samples, F const & f)
+   {
+      std::mt19937_64 random(size);
+      std::vector<size_t> flips(size * 8 * 64);
+      std::vector<uint8_t> key(size);
+      for(size_t s = 0; s < samples; ++s)
+      {
+         for(auto & b : key)
+            b = (uint8_t)random();
+         uint64_t h = f(&key[0], size);
+         for(size_t bit = 0; bit < size * 8; ++bit)
+         {
+            key[bit / 8] ^= 1 << (bit % 8);
+            uint64_t d = h ^ f(&key[0], size);
+            key[bit / 8] ^= 1 << (bit % 8);
+            for(size_t o = 0; o < 64; ++o)
+               flips[bit * 64 + o] += (d >> o) & 1;
+         }
+      }
+      double worst = 0;
+      for(size_t c : flips)
+         worst = std::max(worst, fabs((double)c / samples - .5));
+      return worst;
+   }
+
+   struct entry_t
+   {
+      in_addr ip;
+      std::string nick;
+      uint32_t version;
+   };
+
+   // how directory_t hashes an entry: fields chained through the seed, then mixed
+   uint64_t entry_hash(entry_t const & e)
+   {
+      uint16_t nlen = e.nick.size();
+      uint64_t res = util::hash64(&e.ip, sizeof(e.ip));
+      res = util::hash64(&nlen, sizeof(nlen), res);
+      res = util::hash64(e.nick.data(), e.nick.size(), res);
+      res = util::hash64(&e.version, sizeof(e.version), res);
+      return util::mix64(res);
+   }
+
+   int quality()
+   {
+      checks_t checks;
+      const size_t N = 1 << 20;
+
+      checks.spread("consecutive addresses", addresses(N, 0x0a000000, 1), 16);
+      checks.spread("addresses a /24 apart", addresses(N, 0x0a000001, 256), 16);
+      checks.spread("addresses 2^16 apart", addresses(1 << 16, 0x00000001, 1 << 16), 12);
+      checks.spread("consecutive addresses, small table", addresses(12000, 0xc0a80000, 1), 10);
+
+      std::vector<uint64_t> nicks(N);
+      for(size_t i = 0; i < N; ++i)
+         nicks[i] = util::hash("user-" + boost::lexical_cast<std::string>(i));
+      checks.spread("numbered nicks", nicks, 16);
+
+      std::vector<uint64_t> shorts;
+      std::string s;
+      for(size_t len = 0; len <= 3; ++len)
+         for(size_t i = 0, n = pow(26, len); i < n; ++i)
+         {
+            s.assign(len, 'a');
+            for(size_t j = 0, x = i; j < len; ++j, x /= 26)
+               s[j] = 'a' + x % 26;
+            shorts.push_back(util::hash(s));
+         }
+      std::vector<uint8_t> zeros(64);
+      for(size_t len = 4; len <= zeros.size(); ++len)
+         shorts.push_back(util::hash64(&zeros[0], len));
+      checks.spread("strings up to 3 letters, runs of zeros", shorts, 10);
+
+      for(size_t size : {4, 8, 16, 32, 64})
+      {
+         double worst = avalanche(size, 20000, [](const uint8_t * p, size_t n) { return util::hash64(p, n); });
+         checks.report("hash64 avalanche, " + boost::lexical_cast<std::string>(size) + " bytes", worst < .02,
+                       "worst bit bias " + boost::lexical_cast<std::string>(worst));
+      }
+      double worst = avalanche(4, 200000, [](const uint8_t * p, size_t) { in_addr a; memcpy(&a, p, 4); return util::hash(a); });
+      checks.report("hash(in_addr) avalanche", worst < .01, "worst bit bias " + boost::lexical_cast<std::string>(worst));
+
+      // one changed field anywhere in a table must change the sum
+      std::mt19937 random(1);
+      std::vector<entry_t> table(1000);
+      uint64_t sum = 0;
+      for(size_t i = 0; i < table.size(); ++i)
+      {
+         table[i].ip.s_addr = htonl(0x0a000000 + i);
+         table[i].nick = "user-" + boost::lexical_cast<std::string>(i);
+         table[i].version = i;
+         sum += entry_hash(table[i]);
+      }
+      size_t masked = 0, trials = 200000;
+      for(size_t t = 0; t < trials; ++t)
+      {
+         entry_t e = table[random() % table.size()];
+         uint64_t old = entry_hash(e);
+         switch(t % 3)
+         {
+         case 0:
+            e.version += 1 + random() % 3;
+            break;
+         case 1:
+            e.nick[random() % e.nick.size()] ^= 1 << (random() % 7);
+            break;
+         case 2:
+            e.ip.s_addr ^= htonl(1 << (random() % 32));
+            break;
+         }
+         masked += sum - old + entry_hash(e) == sum;
+      }
+      checks.report("table sum after one changed field", masked == 0,
+                    boost::lexical_cast<std::string>(masked) + " of " + boost::lexical_cast<std::string>(trials) + " unchanged");
+
+      // two entries trading nicks keep every field value, but not the sum
+      masked = 0;
+      for(size_t t = 0; t < trials / 10; ++t)
+      {
+         entry_t a = table[random() % table.size()], b = table[random() % table.size()];
+         if(a.nick == b.nick)
+            continue;
+         uint64_t before = entry_hash(a) + entry_hash(b);
+         std::swap(a.nick, b.nick);
+         masked += entry_hash(a) + entry_hash(b) == before;
+      }
+      checks.report("table sum after swapped nicks", masked == 0, boost::lexical_cast<std::string>(masked) + " unchanged");
+
+      std::cout << (checks.failed ? "FAILED " : "passed ") << checks.failed << " failed" << std::endl;
+      return checks.failed ? 1 : 0;
+   }
+
+   void usage(const char * name)
+   {
+      std::cerr << "usage: " << name << " speed     ns per hash and GB/s, against the old byte fold\n"
+                << "       " << name << " quality   collisions, bucket spread, avalanche; fails with 1\n";
+   }
+}
+
+int main(int argc, char** argv)
+{
+   std::string mode = argc > 1 ? argv[1] : "";
+   if(mode == "speed")
+      speed();
+   else if(mode == "quality")
+      return quality();
+   else
+   {
+      usage(argv[0]);
+      return 1;
+   }
+   return 0;
+}
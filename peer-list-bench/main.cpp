@@ -0,0 +1,353 @@
+#include <dirent.h>
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+#include <boost/lexical_cast.hpp>
+
+#include "speak-to-me/peer_list.hpp"
+
+// Encode/decode throughput of the sync payloads, what packing them costs
+// against the bytes it saves, and a fuzz run over a corpus
+// of them: every file and mutations of it must either be refused with
+// peer_list::error or read back entries that lie inside the buffer. Build
+// with -fsanitize=address,undefined for the fuzz run to mean much.
+namespace
+{
+   typedef
+      std::chrono::steady_clock
+      steady_t;
+
+   struct user_t
+   {
+      in_addr ip;
+      uint32_t version;
+      std::string nick;
+   };
+
+   std::vector<user_t> make_users(size_t n, std::mt19937 & random)
+   {
+      std::vector<user_t> res(n);
+      for(size_t i = 0; i < n; ++i)
+      {
+         res[i].ip.s_addr = htonl(0x0a000000 + i);
+         res[i].version = random() % 1000;
+         res[i].nick = "user-" + boost::lexical_cast<std::string>(random() % 100000);
+      }
+      return res;
+   }
+
+   void write_list(std::vector<user_t> const & users, std::vector<char> & data)
+   {
+      in_addr room;
+      room.s_addr = htonl(0xef010101);
+      peer_list::writer_t w(data, peer_list::LIST);
+      for(auto const & u : users)
+         w.user(u.ip, u.version, 3, room, 7000, u.nick);
+   }
+
+   void write_digest(std::vector<user_t> const & users, std::vector<char> & data)
+   {
+      peer_list::writer_t w(data, peer_list::DIGEST);
+      for(size_t i = 0; i < users.size(); ++i)
+         w.digest(users[i].ip, users[i].version, i == 0 ? peer_list::CAN_UNPACK : 0);
+   }
+
+   // what a reader does with every entry, so the decode can't be optimized away
+   size_t read(const char * data, size_t size, peer_list::kind_t kind)
+   {
+      peer_list::view_t view(data, size, kind);
+      size_t res = 0;
+      peer_list::entry_t e = peer_list::entry_t();
+      while(view.next(e))
+      {
+         res += e.ip.s_addr ^ e.version;
+         if(kind == peer_list::LIST)
+            res += e.nick_len + e.room_port;
+      }
+      return res;
+   }
+
+   void bench(size_t entries)
+   {
+      std::mt19937 random(1);
+      std::vector<user_t> users = make_users(entries, random);
+      std::vector<char> data;
+      size_t rounds = 0;
+      steady_t::time_point start = steady_t::now();
+      double secs = 0;
+      do
+      {
+         data.clear();
+         write_list(users, data);
+         ++rounds;
+         secs = std::chrono::duration<double>(steady_t::now() - start).count();
+      } while(secs < .5);
+      std::cout << "encode: " << entries << " entries, " << data.size() << " bytes, "
+                << (size_t)(rounds * entries / secs) << " entries/s, " << secs / rounds * 1e6 << " us per list" << std::endl;
+
+      size_t sum = 0;
+      rounds = 0;
+      start = steady_t::now();
+      do
+      {
+         sum += read(&data[0], data.size(), peer_list::LIST);
+         ++rounds;
+         secs = std::chrono::duration<double>(steady_t::now() - start).count();
+      } while(secs < .5);
+      std::cout << "decode: " << (size_t)(rounds * entries / secs) << " entries/s, "
+                << secs / rounds * 1e6 << " us per list (" << (sum & 1) << ")" << std::endl;
+   }
+
+   // the link speed below which packing a list pays: the bytes it saves take
+   // longer to send than both ends spend on pack() and unpack()
+   void bench_pack(size_t entries)
+   {
+      std::mt19937 random(1);
+      std::vector<char> data;
+      write_list(make_users(entries, random), data);
+      std::vector<char> packed = data;
+      peer_list::pack(packed);
+
+      size_t rounds = 0;
+      steady_t::time_point start = steady_t::now();
+      double secs = 0;
+      do
+      {
+         std::vector<char> p = data;
+         peer_list::pack(p);
+         ++rounds;
+         secs = std::chrono::duration<double>(steady_t::now() - start).count();
+      } while(secs < .5);
+      double pack_us = secs / rounds * 1e6;
+
+      std::vector<char> scratch;
+      rounds = 0;
+      start = steady_t::now();
+      do
+      {
+         peer_list::unpack(packed, scratch);
+         ++rounds;
+         secs = std::chrono::duration<double>(steady_t::now() - start).count();
+      } while(secs < .5);
+      double unpack_us = secs / rounds * 1e6;
+
+      std::cout << "pack: " << entries << " entries, " << data.size() << " -> " << packed.size() << " bytes ("
+                << 100 * packed.size() / data.size() << "%), pack " << pack_us << " us, unpack " << unpack_us << " us";
+      if(packed.size() < data.size())
+         std::cout << ", pays below " << (data.size() - packed.size()) * 8 / (pack_us + unpack_us) << " Mbit/s";
+      std::cout << std::endl;
+   }
+
+   void save(std::string const & path, std::vector<char> const & data)
+   {
+      std::ofstream out(path.c_str(), std::ios::binary);
+      out.write(data.empty() ? NULL : &data[0], data.size());
+      if(!out)
+         throw std::runtime_error("can't write " + path);
+   }
+
+   // valid payloads of both kinds, plus the edges a reader must refuse
+   void seed(std::string const & dir)
+   {
+      std::mt19937 random(1);
+      std::vector<user_t> users = make_users(40, random);
+      users[1].nick.clear();
+      users[2].nick = std::string(255, 'n');
+      users[3].nick = "\xd0\xbf\xd1\x80\xd0\xb8\xd0\xb2\xd0\xb5\xd1\x82";
+      std::vector<char> data;
+
+      write_list(std::vector<user_t>(), data);
+      save(dir + "/list-empty", data);
+      data.clear();
+      write_list(std::vector<user_t>(users.begin(), users.begin() + 5), data);
+      save(dir + "/list-small", data);
+      std::vector<char> small = data;
+      data.clear();
+      write_list(users, data);
+      save(dir + "/list", data);
+      peer_list::pack(data);
+      save(dir + "/list-packed", data);
+      data.clear();
+      write_digest(users, data);
+      save(dir + "/digest", data);
+
+      // an entry longer than this version writes, as a newer sender's would be
+      data = small;
+      char * first = &data[sizeof(peer_list::header_t)];
+      uint16_t size = peer_list::load<uint16_t>(first);
+      peer_list::store(first, (uint16_t)(size + 6));
+      data.insert(data.begin() + sizeof(peer_list::header_t) + size, 6, 'x');
+      save(dir + "/list-longer-entry", data);
+
+      data = small;
+      data[offsetof(peer_list::header_t, version)] = peer_list::VERSION + 1;
+      save(dir + "/list-newer-version", data);
+      data = small;
+      data.resize(data.size() - 3);
+      save(dir + "/list-truncated", data);
+      data = small;
+      data.push_back(0);
+      save(dir + "/list-trailing", data);
+   }
+
+   std::vector<std::string> corpus(std::string const & dir)
+   {
+      std::vector<std::string> res;
+      DIR * d = ::opendir(dir.c_str());
+      if(!d)
+         throw std::runtime_error("can't open " + dir);
+      while(dirent * e = ::readdir(d))
+         if(e->d_name[0] != '.')
+            res.push_back(dir + "/" + e->d_name);
+      ::closedir(d);
+      std::sort(res.begin(), res.end());
+      return res;
+   }
+
+   // true if taken, false if refused; anything else is a bug
+   bool check(std::vector<char> const & input)
+   {
+      std::vector<char> scratch;
+      std::pair<const char *, size_t> payload;
+      try
+      {
+         payload = peer_list::unpack(input, scratch);
+      }
+      catch(peer_list::error &)
+      {
+         return false;
+      }
+      // exact size copy, so reading past the end is caught by the sanitizer
+      std::unique_ptr<char[]> data(new char[payload.second]);
+      std::copy(payload.first, payload.first + payload.second, data.get());
+      bool taken = false;
+      for(peer_list::kind_t kind : {peer_list::DIGEST, peer_list::LIST})
+         try
+         {
+            peer_list::view_t view(data.get(), payload.second, kind);
+            size_t count = view.size(), seen = 0;
+            peer_list::entry_t e = peer_list::entry_t();
+            while(view.next(e))
+            {
+               ++seen;
+               if(kind == peer_list::LIST && (e.nick < data.get() || e.nick + e.nick_len > data.get() + payload.second))
+                  throw std::logic_error("nick outside the buffer");
+            }
+            if(seen != count)
+               throw std::logic_error("entry count mismatch");
+            taken = true;
+         }
+         catch(peer_list::error &)
+         {
+         }
+      return taken;
+   }
+
+   void mutate(std::vector<char> & data, std::mt19937 & random)
+   {
+      size_t edits = 1 + random() % 4;
+      for(size_t i = 0; i < edits; ++i)
+      {
+         size_t at = data.empty() ? 0 : random() % data.size();
+         switch(random() % 5)
+         {
+         case 0:
+            if(!data.empty())
+               data[at] ^= 1 << (random() % 8);
+            break;
+         case 1:
+            if(!data.empty())
+               data[at] = (char)random();
+            break;
+         case 2:
+            data.resize(at);
+            break;
+         case 3:
+            data.insert(data.begin() + at, (char)random());
+            break;
+         case 4: // sizes and counts are where the reader can go wrong
+            if(at + 2 <= data.size())
+            {
+               uint16_t v = peer_list::load<uint16_t>(&data[at]) + (int)(random() % 9) - 4;
+               peer_list::store(&data[at], v);
+            }
+            break;
+         }
+      }
+   }
+
+   int fuzz(std::string const & dir, size_t mutations)
+   {
+      std::mt19937 random(1);
+      size_t runs = 0, taken = 0;
+      for(auto const & path : corpus(dir))
+      {
+         std::ifstream in(path.c_str(), std::ios::binary);
+         std::vector<char> input((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+         std::cout << path << ": " << input.size() << " bytes, " << (check(input) ? "taken" : "refused") << std::endl;
+         for(size_t i = 0; i < mutations; ++i)
+         {
+            std::vector<char> m = input;
+            mutate(m, random);
+            taken += check(m);
+            ++runs;
+         }
+      }
+      std::cout << runs << " mutations, " << taken << " taken, " << runs - taken << " refused" << std::endl;
+      return 0;
+   }
+
+   void usage(const char * name)
+   {
+      std::cerr << "usage: " << name << " bench [entries]          encode/decode rate (3000)\n"
+                << "       " << name << " pack [entries...]        pack/unpack cost and ratio (30 300 3000 30000)\n"
+                << "       " << name << " seed <dir>               write the seed corpus\n"
+                << "       " << name << " fuzz <dir> [mutations]   corpus and mutations of each file (10000)\n";
+   }
+}
+
+int main(int argc, char** argv)
+{
+   std::string mode = argc > 1 ? argv[1] : "";
+   try
+   {
+      if(mode == "bench")
+         bench(argc > 2 ? boost::lexical_cast<size_t>(argv[2]) : 3000);
+      else if(mode == "pack")
+      {
+         std::vector<size_t> sizes = {30, 300, 3000, 30000};
+         if(argc > 2)
+            sizes.clear();
+         for(int i = 2; i < argc; ++i)
+            sizes.push_back(boost::lexical_cast<size_t>(argv[i]));
+         for(size_t n : sizes)
+            bench_pack(n);
+      }
+      else if(mode == "seed" && argc > 2)
+         seed(argv[2]);
+      else if(mode == "fuzz" && argc > 2)
+         return fuzz(argv[2], argc > 3 ? boost::lexical_cast<size_t>(argv[3]) : 10000);
+      else
+      {
+         usage(argv[0]);
+         return 1;
+      }
+   }
+   catch(boost::bad_lexical_cast &)
+   {
+      usage(argv[0]);
+      return 1;
+   }
+   catch(std::exception & e)
+   {
+      std::cerr << "Critical error: " << e.what() << std::endl;
+      return 1;
+   }
+   return 0;
+}
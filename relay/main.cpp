@@ -0,0 +1,65 @@
+#include <signal.h>
+#include <iostream>
+#include <boost/lexical_cast.hpp>
+
+#include "relay.hpp"
+
+namespace
+{
+   relay::server_t * running = NULL;
+
+   // stop() only flips an atomic flag, fine from a handler
+   void on_signal(int)
+   {
+      if(running)
+         running->stop();
+   }
+
+   void handle_signals()
+   {
+      struct sigaction sa;
+      memset(&sa, 0, sizeof(sa));
+      sa.sa_handler = on_signal;
+      sigemptyset(&sa.sa_mask);
+      ::sigaction(SIGINT, &sa, NULL);
+      ::sigaction(SIGTERM, &sa, NULL);
+   }
+}
+
+int main(int argc, char** argv)
+{
+   logger::set_logger(logger::TRACE, logger::null_holder());
+
+   uint16_t port = s2m::relay_proto::DEFAULT_PORT;
+   size_t shards = boost::thread::hardware_concurrency();
+   try
+   {
+      if(argc > 1)
+         port = boost::lexical_cast<uint16_t>(argv[1]);
+      if(argc > 2)
+         shards = boost::lexical_cast<size_t>(argv[2]);
+   }
+   catch(boost::bad_lexical_cast &)
+   {
+      std::cerr << "usage: " << argv[0] << " [port] [shards]" << std::endl;
+      return 1;
+   }
+   if(shards == 0)
+      shards = 1;
+
+   try
+   {
+      relay::server_t server(port, shards);
+      running = &server;
+      handle_signals();
+      server.run();
+      running = NULL;
+      logger::debug() << "relay: stopped";
+   }
+   catch(std::exception & e)
+   {
+      std::cerr << "Critical error: " << e.what() << std::endl;
+      return 1;
+   }
+   return 0;
+}
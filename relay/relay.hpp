@@ -0,0 +1,394 @@
+#pragma once
+#include "common/udp.hpp"
+#include "common/logger.hpp"
+#include "common/stuff.hpp"
+#include "speak-to-me/relay_proto.hpp"
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <unordered_map>
+
+#include <boost/noncopyable.hpp>
+#include <boost/thread.hpp>
+
+// Selective forwarding relay: members JOIN a room (multicast address + port
+// used as a plain key) and every DATA datagram is fanned out to the others,
+// behind a forward_t naming the member it came from.
+namespace relay
+{
+   namespace proto = s2m::relay_proto;
+
+   struct room_key_t
+   {
+      in_addr address;
+      uint16_t port;
+
+      bool operator == (room_key_t const & other) const
+      {
+         return address == other.address && port == other.port;
+      }
+   };
+
+   inline uint64_t hash(room_key_t const & key)
+   {
+      uint64_t res = util::hash(key.address);
+      util::hash_combine(res, key.port);
+      return res;
+   }
+
+   inline bool same_peer(sockaddr_in const & a, sockaddr_in const & b)
+   {
+      return a.sin_addr == b.sin_addr && a.sin_port == b.sin_port;
+   }
+
+   struct subscriber_t
+   {
+      sockaddr_in addr;
+      time_t last_seen;
+   };
+
+   // per-room subscriber tables, split into buckets so shards rarely contend
+   struct room_table_t
+   {
+      enum { BUCKETS = 16 };
+
+      void join(room_key_t const & key, sockaddr_in const & addr, time_t now)
+      {
+         bucket_t & b = bucket(key);
+         boost::unique_lock<boost::shared_mutex> __(b.mutex);
+         std::vector<subscriber_t> & room = b.rooms[key];
+         for(auto & s : room)
+            if(same_peer(s.addr, addr))
+            {
+               s.last_seen = now;
+               return;
+            }
+         subscriber_t s = {addr, now};
+         room.push_back(s);
+         logger::debug() << "relay::join: " << inet_ntoa(addr.sin_addr) << ":" << ntohs(addr.sin_port)
+                         << " -> " << inet_ntoa(key.address) << ":" << key.port << " members: " << room.size();
+      }
+
+      void leave(room_key_t const & key, sockaddr_in const & addr)
+      {
+         bucket_t & b = bucket(key);
+         boost::unique_lock<boost::shared_mutex> __(b.mutex);
+         auto it = b.rooms.find(key);
+         if(it == b.rooms.end())
+            return;
+         std::vector<subscriber_t> & room = it->second;
+         for(size_t i = 0; i < room.size(); ++i)
+            if(same_peer(room[i].addr, addr))
+            {
+               room[i] = room.back();
+               room.pop_back();
+               break;
+            }
+         if(room.empty())
+            b.rooms.erase(it);
+         logger::debug() << "relay::leave: " << inet_ntoa(addr.sin_addr) << ":" << ntohs(addr.sin_port);
+      }
+
+      // appends every member but `sender` to `out`; nothing if sender never joined
+      void peers(room_key_t const & key, sockaddr_in const & sender, std::vector<sockaddr_in> & out)
+      {
+         bucket_t & b = bucket(key);
+         boost::shared_lock<boost::shared_mutex> __(b.mutex);
+         auto it = b.rooms.find(key);
+         if(it == b.rooms.end())
+            return;
+         size_t first = out.size();
+         bool member = false;
+         for(auto const & s : it->second)
+            if(same_peer(s.addr, sender))
+               member = true;
+            else
+               out.push_back(s.addr);
+         if(!member)
+            out.resize(first);
+      }
+
+      size_t expire(time_t now)
+      {
+         size_t removed = 0;
+         for(auto & b : buckets_)
+         {
+            boost::unique_lock<boost::shared_mutex> __(b.mutex);
+            for(auto it = b.rooms.begin(); it != b.rooms.end(); )
+            {
+               std::vector<subscriber_t> & room = it->second;
+               for(size_t i = 0; i < room.size(); )
+                  if(room[i].last_seen + proto::SUBSCRIBER_TIMEOUT < now)
+                  {
+                     room[i] = room.back();
+                     room.pop_back();
+                     ++removed;
+                  }
+                  else
+                     ++i;
+               if(room.empty())
+                  it = b.rooms.erase(it);
+               else
+                  ++it;
+            }
+         }
+         return removed;
+      }
+
+   private:
+      struct bucket_t
+      {
+         boost::shared_mutex mutex;
+         std::unordered_map<room_key_t, std::vector<subscriber_t>, util::hasher<room_key_t>> rooms;
+      };
+
+      bucket_t & bucket(room_key_t const & key)
+      {
+         return buckets_[hash(key) % BUCKETS];
+      }
+
+   private:
+      bucket_t buckets_[BUCKETS];
+   };
+
+   // one SO_REUSEPORT socket and thread; the kernel spreads senders over shards
+   struct shard_t : boost::noncopyable
+   {
+      enum
+      {
+         RECV_BATCH = 32,
+         SEND_BATCH = 256,
+      };
+
+      shard_t(uint16_t port, room_table_t & rooms)
+         : rooms_(rooms)
+         , received_(0)
+         , sent_(0)
+      {
+         sock_ = ::socket(PF_INET, SOCK_DGRAM, 0);
+         if(sock_ == -1)
+            throw udp::net_error(std::string("Socket creation failure: ") + strerror(errno));
+         int one = 1;
+         ::setsockopt(sock_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+         if(::setsockopt(sock_, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) == -1)
+            throw udp::net_error(std::string("setsockopt(SO_REUSEPORT) failed: ") + strerror(errno));
+         timeval tv = {1, 0}; // lets run() notice stop requests
+         ::setsockopt(sock_, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+         sockaddr_in addr;
+         util::nullize(addr);
+         addr.sin_family = AF_INET;
+         addr.sin_addr.s_addr = INADDR_ANY;
+         addr.sin_port = htons(port);
+         if(::bind(sock_, (sockaddr*)&addr, sizeof(addr)) == -1)
+            throw udp::net_error(std::string("Bind failed: ") + strerror(errno));
+
+         buffers_.resize(RECV_BATCH * proto::MAX_DATAGRAM);
+         for(size_t i = 0; i < RECV_BATCH; ++i)
+         {
+            util::nullize(in_[i]);
+            in_iov_[i].iov_base = &buffers_[i * proto::MAX_DATAGRAM];
+            in_iov_[i].iov_len = proto::MAX_DATAGRAM;
+            in_[i].msg_hdr.msg_iov = &in_iov_[i];
+            in_[i].msg_hdr.msg_iovlen = 1;
+            in_[i].msg_hdr.msg_name = &from_[i];
+         }
+         dests_.reserve(SEND_BATCH);
+         pending_.reserve(SEND_BATCH);
+      }
+
+      ~shard_t()
+      {
+         ::close(sock_);
+      }
+
+      void run(std::atomic<bool> const & stop)
+      {
+         while(!stop)
+         {
+            for(size_t i = 0; i < RECV_BATCH; ++i)
+               in_[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+            int n = ::recvmmsg(sock_, in_, RECV_BATCH, MSG_WAITFORONE, NULL);
+            if(n == -1)
+            {
+               if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                  logger::error() << "relay::shard: recvmmsg failed: " << strerror(errno);
+               continue;
+            }
+            received_ += n;
+            time_t now = ::time(NULL);
+            for(int i = 0; i < n; ++i)
+               handle(i, now);
+            flush();
+         }
+      }
+
+      size_t received() const
+      {
+         return received_;
+      }
+
+      size_t sent() const
+      {
+         return sent_;
+      }
+
+   private:
+      struct pending_t
+      {
+         size_t slot;
+         size_t dest;
+      };
+
+      void handle(size_t slot, time_t now)
+      {
+         size_t len = in_[slot].msg_len;
+         proto::header_t h;
+         if(len < sizeof(h))
+            return;
+         memcpy(&h, in_iov_[slot].iov_base, sizeof(h));
+         if(!proto::check_header(h))
+            return;
+         room_key_t key = {h.room_address, ntohs(h.room_port)};
+         sockaddr_in const & from = from_[slot];
+         forward_[slot].source = from.sin_addr;
+         forward_[slot].source_port = from.sin_port;
+         switch(h.cmd)
+         {
+         case proto::JOIN:
+            rooms_.join(key, from, now);
+            break;
+         case proto::LEAVE:
+            rooms_.leave(key, from);
+            break;
+         case proto::DATA:
+         {
+            size_t first = dests_.size();
+            rooms_.peers(key, from, dests_);
+            for(size_t d = first; d < dests_.size(); ++d)
+            {
+               pending_t p = {slot, d};
+               pending_.push_back(p);
+            }
+            if(pending_.size() >= SEND_BATCH)
+               flush();
+            break;
+         }
+         }
+      }
+
+      void flush()
+      {
+         size_t done = 0;
+         while(done < pending_.size())
+         {
+            size_t cnt = util::min(pending_.size() - done, (size_t)SEND_BATCH);
+            for(size_t i = 0; i < cnt; ++i)
+            {
+               pending_t const & p = pending_[done + i];
+               util::nullize(out_[i]);
+               out_iov_[i][0].iov_base = &forward_[p.slot];
+               out_iov_[i][0].iov_len = sizeof(proto::forward_t);
+               out_iov_[i][1].iov_base = (char*)in_iov_[p.slot].iov_base + sizeof(proto::header_t);
+               out_iov_[i][1].iov_len = in_[p.slot].msg_len - sizeof(proto::header_t);
+               out_[i].msg_hdr.msg_iov = out_iov_[i];
+               out_[i].msg_hdr.msg_iovlen = 2;
+               out_[i].msg_hdr.msg_name = &dests_[p.dest];
+               out_[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+            }
+            int res = ::sendmmsg(sock_, out_, cnt, 0);
+            if(res == -1)
+            {
+               // first message failed (unreachable member etc.), skip it
+               logger::warning() << "relay::shard: sendmmsg failed: " << strerror(errno);
+               res = 1;
+            }
+            else
+               sent_ += res;
+            done += res;
+         }
+         pending_.clear();
+         dests_.clear();
+      }
+
+   private:
+      int sock_;
+      room_table_t & rooms_;
+
+      std::vector<char> buffers_;
+      mmsghdr in_[RECV_BATCH];
+      iovec in_iov_[RECV_BATCH];
+      sockaddr_in from_[RECV_BATCH];
+      proto::forward_t forward_[RECV_BATCH]; // goes in front of slot's payload
+
+      std::vector<sockaddr_in> dests_;
+      std::vector<pending_t> pending_;
+      mmsghdr out_[SEND_BATCH];
+      iovec out_iov_[SEND_BATCH][2];
+
+      std::atomic<size_t> received_;
+      std::atomic<size_t> sent_;
+   };
+
+   struct server_t : boost::noncopyable
+   {
+      static const size_t STATS_PERIOD = 10; // secs
+
+      server_t(uint16_t port, size_t shards)
+         : stop_(false)
+      {
+         for(size_t i = 0; i < shards; ++i)
+            shards_.emplace_back(new shard_t(port, rooms_));
+         logger::debug() << "relay::server: listening on " << port << " with " << shards << " shards";
+      }
+
+      ~server_t()
+      {
+         stop_ = true;
+         threads_.join_all();
+      }
+
+      void run()
+      {
+         for(auto & s : shards_)
+            threads_.create_thread(boost::bind(&shard_t::run, s.get(), boost::cref(stop_)));
+
+         time_t next_stats = ::time(NULL) + STATS_PERIOD;
+         while(!stop_)
+         {
+            sleep(1);
+            time_t now = ::time(NULL);
+            size_t expired = rooms_.expire(now);
+            if(expired)
+               logger::debug() << "relay::server: expired " << expired << " members";
+            if(now >= next_stats)
+            {
+               size_t in = 0, out = 0;
+               for(auto const & s : shards_)
+               {
+                  in += s->received();
+                  out += s->sent();
+               }
+               logger::debug() << "relay::server: datagrams in: " << in << " out: " << out;
+               next_stats = now + STATS_PERIOD;
+            }
+         }
+      }
+
+      void stop()
+      {
+         stop_ = true;
+      }
+
+   private:
+      room_table_t rooms_;
+      std::vector<std::unique_ptr<shard_t>> shards_;
+      boost::thread_group threads_;
+      std::atomic<bool> stop_;
+   };
+}
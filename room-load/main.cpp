@@ -0,0 +1,109 @@
+#include <iostream>
+#include <string>
+#include <boost/lexical_cast.hpp>
+
+#include "speak-to-me/synth.hpp"
+
+static void usage(const char * name)
+{
+   std::cerr << "usage: " << name << " <group> <port> [options]\n"
+             << "   -n <speakers>         number of synthetic speakers (1)\n"
+             << "   -s tone[:hz]|noise|<file.wav>\n"
+             << "                         audio source (tone:440)\n"
+             << "   -r <rate>             samples per second per speaker (6300)\n"
+             << "   -t <seconds>          stop after this long (run forever)\n"
+             << "   -R <ip[:port]>        send through a relay instead of multicast\n"
+             << "   -p                    RTP framing\n"
+             << "   -b                    burst all speakers at once instead of staggering\n"
+             << "   -T                    stamp frames with send time, for receivers' latency stats\n";
+}
+
+int main(int argc, char** argv)
+{
+   logger::set_logger(logger::TRACE, logger::null_holder());
+
+   if(argc < 3)
+   {
+      usage(argv[0]);
+      return 1;
+   }
+
+   synth::speakers_t::options_t opts;
+   std::string source = "tone";
+   double seconds = 0;
+   in_addr group;
+   uint16_t port;
+   try
+   {
+      if(!inet_aton(argv[1], &group))
+         throw boost::bad_lexical_cast();
+      port = boost::lexical_cast<uint16_t>(argv[2]);
+      for(int i = 3; i < argc; ++i)
+      {
+         std::string arg = argv[i];
+         bool has_value = i + 1 < argc;
+         if(arg == "-p")
+            opts.rtp = true;
+         else if(arg == "-b")
+            opts.stagger = false;
+         else if(arg == "-T")
+            opts.timestamps = true;
+         else if(!has_value)
+            throw boost::bad_lexical_cast();
+         else if(arg == "-n")
+            opts.speakers = boost::lexical_cast<size_t>(argv[++i]);
+         else if(arg == "-s")
+            source = argv[++i];
+         else if(arg == "-r")
+            opts.rate = boost::lexical_cast<double>(argv[++i]);
+         else if(arg == "-t")
+            seconds = boost::lexical_cast<double>(argv[++i]);
+         else if(arg == "-R")
+         {
+            std::string relay = argv[++i];
+            size_t colon = relay.find(':');
+            sockaddr_in addr;
+            util::nullize(addr);
+            addr.sin_family = AF_INET;
+            addr.sin_port = htons(colon == std::string::npos ? s2m::relay_proto::DEFAULT_PORT
+                                                             : boost::lexical_cast<uint16_t>(relay.substr(colon + 1)));
+            if(!inet_aton(relay.substr(0, colon).c_str(), &addr.sin_addr))
+               throw boost::bad_lexical_cast();
+            opts.relay = addr;
+         }
+         else
+            throw boost::bad_lexical_cast();
+      }
+      if(opts.speakers == 0 || opts.rate <= 0)
+         throw boost::bad_lexical_cast();
+   }
+   catch(boost::bad_lexical_cast &)
+   {
+      usage(argv[0]);
+      return 1;
+   }
+
+   try
+   {
+      std::unique_ptr<synth::source_t> src;
+      if(source == "noise")
+         src.reset(new synth::source_t(synth::source_t::NOISE, opts.rate));
+      else if(source.compare(0, 4, "tone") == 0 && (source.size() == 4 || source[4] == ':'))
+      {
+         double freq = source.size() > 5 ? boost::lexical_cast<double>(source.substr(5)) : 440;
+         src.reset(new synth::source_t(synth::source_t::TONE, opts.rate, freq));
+      }
+      else
+         src.reset(new synth::source_t(synth::source_t::from_wav(source, opts.rate)));
+
+      synth::speakers_t speakers(group, port, *src, opts);
+      speakers.run(seconds);
+      std::cout << "sent " << speakers.sent() << " frames, late ticks " << speakers.late() << std::endl;
+   }
+   catch(std::exception & e)
+   {
+      std::cerr << "Critical error: " << e.what() << std::endl;
+      return 1;
+   }
+   return 0;
+}
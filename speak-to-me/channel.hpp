@@ -0,0 +1,179 @@
+#pragma once
+#include "common/udp.hpp"
+#include "common/stuff.hpp"
+#include "relay_proto.hpp"
+
+#include <time.h>
+#include <boost/noncopyable.hpp>
+
+// Datagram endpoint for rooms: either one multicast socket per port shared by
+// every room on that port (demultiplexed by destination group), or, where
+// multicast is not routable, a relay link carrying a single room.
+struct channel_t : boost::noncopyable
+{
+   // multicast on `port`, rooms are added with join()
+   explicit channel_t(uint16_t port)
+      : port_(port)
+      , relay_(false)
+      , echo_(true)
+      , next_keepalive_(0)
+   {
+      util::nullize(group_);
+      in_addr any;
+      any.s_addr = INADDR_ANY;
+      sock_.connect(any, port);
+      sock_.set_multicast_all(false);
+      sock_.set_echo(echo_);
+      sock_.bind();
+   }
+
+   channel_t(in_addr const & group, uint16_t port, sockaddr_in const & relay)
+      : group_(group)
+      , port_(port)
+      , relay_(true)
+      , echo_(false)
+      , next_keepalive_(0)
+   {
+      sock_.connect(relay.sin_addr, ntohs(relay.sin_port));
+      sock_.bind(uint16_t(0));
+      keepalive();
+   }
+
+   ~channel_t()
+   {
+      if(relay_)
+         try
+         {
+            send_command(s2m::relay_proto::LEAVE);
+         }
+         catch(udp::net_error & e)
+         {
+            logger::warning() << "channel::~channel: " << e.what();
+         }
+   }
+
+   int operator*() const
+   {
+      return *sock_;
+   }
+
+   bool relayed() const
+   {
+      return relay_;
+   }
+
+   uint16_t port() const
+   {
+      return port_;
+   }
+
+   // multicast loopback of what we send; same-host peers may get it another way
+   void set_echo(bool echo)
+   {
+      if(relay_ || echo == echo_)
+         return;
+      sock_.set_echo(echo);
+      echo_ = echo;
+   }
+
+   void join(in_addr const & group)
+   {
+      if(!relay_)
+         sock_.join_group(group, true);
+   }
+
+   void leave(in_addr const & group)
+   {
+      if(!relay_)
+         sock_.join_group(group, false);
+   }
+
+   size_t send(in_addr const & group, const void * buf, size_t size)
+   {
+      iovec iov;
+      iov.iov_base = const_cast<void*>(buf);
+      iov.iov_len = size;
+      return send(group, &iov, 1);
+   }
+
+   enum { MAX_IOV = 4 };
+
+   // one datagram gathered from iov, without copying
+   size_t send(in_addr const & group, const iovec * iov, size_t cnt)
+   {
+      if(!relay_)
+         return sock_.sendv(group, port_, iov, cnt);
+
+      assert(cnt < MAX_IOV);
+      s2m::relay_proto::header_t h;
+      s2m::relay_proto::make_header(h, s2m::relay_proto::DATA, group_, port_);
+      iovec relayed[MAX_IOV];
+      relayed[0].iov_base = &h;
+      relayed[0].iov_len = sizeof(h);
+      std::copy(iov, iov + cnt, relayed + 1);
+      return sock_.sendv(relayed, cnt + 1) - sizeof(h);
+   }
+
+   size_t recv(void * buf, size_t size, in_addr * sender, in_addr & group) //return in bytes!
+   {
+      iovec iov;
+      iov.iov_base = buf;
+      iov.iov_len = size;
+      return recv(&iov, 1, sender, group);
+   }
+
+   // scatters one datagram over iov, `group` tells which room it belongs to;
+   // relayed ones report the member that sent them, not the relay
+   size_t recv(const iovec * iov, size_t cnt, in_addr * sender, in_addr & group) //return in bytes!
+   {
+      in_addr dest;
+      if(!relay_)
+      {
+         size_t res = sock_.recvv(iov, cnt, sender, &dest);
+         group = dest;
+         return res;
+      }
+
+      assert(cnt < MAX_IOV);
+      s2m::relay_proto::forward_t f;
+      iovec relayed[MAX_IOV];
+      relayed[0].iov_base = &f;
+      relayed[0].iov_len = sizeof(f);
+      std::copy(iov, iov + cnt, relayed + 1);
+      size_t res = sock_.recvv(relayed, cnt + 1, NULL, &dest);
+      group = group_;
+      if(res < sizeof(f))
+         return 0;
+      if(sender)
+         *sender = f.source;
+      return res - sizeof(f);
+   }
+
+   // relay forgets silent members, so listeners have to refresh their JOIN
+   void keepalive()
+   {
+      if(!relay_)
+         return;
+      time_t now = ::time(NULL);
+      if(now < next_keepalive_)
+         return;
+      send_command(s2m::relay_proto::JOIN);
+      next_keepalive_ = now + s2m::relay_proto::KEEPALIVE_PERIOD;
+   }
+
+private:
+   void send_command(s2m::relay_proto::command_t cmd)
+   {
+      s2m::relay_proto::header_t h;
+      s2m::relay_proto::make_header(h, cmd, group_, port_);
+      sock_.send(reinterpret_cast<const char*>(&h), sizeof(h));
+   }
+
+private:
+   udp::socket_t sock_;
+   in_addr group_;
+   uint16_t port_;
+   bool relay_;
+   bool echo_;
+   time_t next_keepalive_;
+};
@@ -3,6 +3,8 @@
 #include "common/tcp.hpp"
 #include "common/logger.hpp"
 #include "common/stuff.hpp"
+#include "common/event_loop.hpp"
+#include "directory.hpp"
 #include "streamer.hpp"
 
 #include <poll.h>
@@ -10,25 +12,31 @@
 #include <boost/function.hpp>
 #include <boost/thread.hpp>
 #include <ifaddrs.h>
-#include <unordered_map>
+#include <map>
+#include <memory>
 
 namespace s2m
 {
    uint16_t SERVE_UDP_PORT = 12121;
    uint16_t SERVE_TCP_PORT = 12121;
 
-   uint32_t USER_TIMEOUT = 10; // user is dead if no activity for N secs
-   uint32_t PROCESS_PERIOD = 3;
+   uint32_t PROCESS_PERIOD = 3; // stats export period, secs
+   uint32_t EXPIRY_PERIOD = 1;
+   std::string PEER_CACHE = "peers.cache";
+   uint32_t SAVE_PERIOD = 10; // peer cache is rewritten at most this often, secs
 
+// directory_t over real sockets, driven by the event loop, plus the streamer
 struct client_t
 {
    client_t(std::string const & host, in_addr const & local_ip)
       : host_(host)
       , local_ip_(local_ip)
-      , nick_("default")
       , input_device_(0)
       , output_device_(0)
       , api_(0)
+      , framing_(streamer_t::NATIVE_FRAMING)
+      , timestamps_(false)
+      , loop_(NULL)
    {
       udp_sock_.connect(host, SERVE_UDP_PORT);
 //      udp_sock_.set_broadcast(true);
@@ -39,50 +47,47 @@ struct client_t
       tcp_server_sock_.bind(SERVE_TCP_PORT);
       tcp_server_sock_.listen();
 
-      users_.insert(std::make_pair(local_ip_, user_t(local_ip_, nick_)));
-      stuff_hash_ = compute_hash();
+      directory_t::callbacks_t cb;
+      cb.send = [this](in_addr const & to, const char * buf, size_t size)
+      {
+         try
+         {
+            udp_sock_.sendto(to, SERVE_UDP_PORT, buf, size);
+         }
+         catch(udp::net_error & e)
+         {
+            logger::warning() << "client::send: " << e.what();
+         }
+      };
+      cb.connect = [this](in_addr const & ip) { return connect(ip); };
+      cb.close = [this](in_addr const & ip)
+      {
+         auto it = sessions_.find(ip);
+         if(it != sessions_.end())
+            drop_session(it);
+      };
+      cb.now = &swim_t::now;
+      cb.time = []() { return (uint32_t)::time(NULL); };
+      directory_ = boost::in_place(local_ip_, udp_sock_.address().sin_addr, "default", cb);
+      directory_->load_cache(PEER_CACHE);
    }
 
-   typedef
-      boost::unique_lock<boost::recursive_mutex>
-      lock_t;
-
-   struct user_t
+   ~client_t()
    {
-      user_t()
-         : room_port(0)
-         , timestamp(0)
-      {
-         util::nullize(room_address);
-         util::nullize(ip);
-      }
-      user_t(in_addr const & ip, std::string const& nick)
-         : ip(ip)
-         , nick(nick)
-         , room_port(0)
-         , timestamp(0)
-      {
-         util::nullize(room_address);
-      }
+      directory_->save_cache(PEER_CACHE);
+   }
 
-      in_addr ip;
-      std::string nick;
-      in_addr room_address;
-      uint16_t room_port;
-      uint32_t timestamp;
-   };
+   typedef
+      directory_t::user_t
+      user_t;
 
    typedef
-      std::unordered_map<in_addr, user_t, util::hasher<in_addr>>
-      users_map_t;
+      directory_t::snapshot_t
+      snapshot_t;
 
    void set_nick(std::string const & nick)
    {
-      lock_t __(users_mutex_);
-
-      nick_ = nick;
-      users_[local_ip_].nick = nick;
-      stuff_hash_ = compute_hash();
+      directory_->set_nick(nick);
    }
 
    void set_devices(int api, int inp, int outp)
@@ -92,72 +97,133 @@ struct client_t
       output_device_ = outp;
    }
 
+   // applies to the next set_room
+   void set_framing(streamer_t::framing_t framing)
+   {
+      framing_ = framing;
+   }
+
+   streamer_t::framing_t framing() const
+   {
+      return framing_;
+   }
+
+   // capture/send stamps on our frames, so listeners can break latency down
+   void set_timestamps(bool on)
+   {
+      timestamps_ = on;
+      if(streamer_)
+         streamer_->set_timestamps(on);
+   }
+
+   bool timestamps() const
+   {
+      return timestamps_;
+   }
+
+   // applies to the next set_room, none means plain multicast
+   void set_relay(boost::optional<sockaddr_in> const & relay)
+   {
+      relay_ = relay;
+   }
+
    bool has_room() const
    {
       return !!streamer_;
    }
 
+   bool talking() const
+   {
+      return streamer_ && streamer_->talking();
+   }
+
    void disconnect()
    {
       streamer_.reset();
-      {
-         lock_t __(users_mutex_);
-
-         auto & me = users_[local_ip_];
-         me.room_port = 0;
-         util::nullize(me.room_address);
-         stuff_hash_ = compute_hash();
-      }
+      in_addr none;
+      util::nullize(none);
+      directory_->set_room(none, 0);
    }
 
    void set_room(in_addr const & addr, uint16_t port)
    {
-      {
-         lock_t __(users_mutex_);
+      directory_->set_room(addr, port);
+      start_streamer();
+      streamer_->join_room(addr, port, true, relay_);
+   }
 
-         auto & me = users_[local_ip_];
-         me.room_port = port;
-         me.room_address = addr;
-         stuff_hash_ = compute_hash();
-      }
-      streamer_ = boost::in_place(addr, port);
+   // listen only, rooms share the audio devices of the talk room
+   void monitor_room(in_addr const & addr, uint16_t port)
+   {
+      start_streamer();
+      streamer_->join_room(addr, port, false, relay_);
+   }
+
+   void start_recording(bool per_source)
+   {
+      if(!streamer_)
+         return;
+      recorder_t::options_t opts;
+      opts.per_source = per_source;
+      streamer_->start_recording(opts);
+   }
+
+   void stop_recording()
+   {
+      if(streamer_)
+         streamer_->stop_recording();
+   }
+
+   bool recording() const
+   {
+      return streamer_ && streamer_->recording();
+   }
+
+   void start_streamer()
+   {
+      if(streamer_)
+         return;
+      streamer_ = boost::in_place(framing_);
+      streamer_->set_timestamps(timestamps_);
       streamer_->init(api_);
       streamer_->run(input_device_, output_device_);
    }
 
-   void remove_dead_users()
+   // discovery and sync are driven by the loop from now on
+   void attach(util::event_loop_t & loop)
    {
-      lock_t __(users_mutex_);
-      uint32_t cur_time = ::time(NULL);
-      bool removed = false;
-      for(auto it = users_.begin(); it != users_.end(); )
-         if(!(it->first == local_ip_) && it->second.timestamp + USER_TIMEOUT < cur_time)
-         {
-            it = users_.erase(it);
-            removed = true;
-         }
-         else
-            ++it;
-      if(removed)
-         stuff_hash_ = compute_hash();
+      loop_ = &loop;
+      loop.add(*udp_sock_, EPOLLIN, [this](uint32_t) { recv_discovery(); });
+      loop.add(*tcp_server_sock_, EPOLLIN, [this](uint32_t) { accept(); });
+      loop.add_timer(swim_t::options_t().period / 10, [this]() { directory_->poll(); }, 0.001);
+      loop.add_timer(PROCESS_PERIOD, [this]()
+      {
+         if(streamer_)
+            streamer_->export_stats();
+      });
+      loop.add_timer(EXPIRY_PERIOD, [this]() { directory_->expire_sessions(); });
+      loop.add_timer(SAVE_PERIOD, [this]() { directory_->save_cache(PEER_CACHE); });
    }
 
    void run()
    {
-      while(true)
-      {
-         do_stuff();
-         sleep(PROCESS_PERIOD);
-      }
+      util::event_loop_t loop;
+      attach(loop);
+      loop.run();
+   }
+
+   snapshot_t users() const
+   {
+      return directory_->users();
    }
 
-#pragma pack(push, 1)
-   struct hash_struct
+private:
+   // a directory_t session over tcp: digests first, then the deltas
+   enum sync_phase_t
    {
-      in_addr ip;
-      uint32_t hash;
+      SYNC_DIGEST,
+      SYNC_DELTA,
    };
-#pragma pack(pop)
 
    struct data_t
    {
@@ -203,8 +269,14 @@ struct client_t
                return false;
             len = tmp_len;
             logger::trace() << "read_non_block: readed len = " << *len;
-            if(!tmp_len > 0)
+            // the peer's word, capped before it sizes anything
+            if(tmp_len < 0 || tmp_len > peer_list::MAX_UNPACKED)
+               throw tcp::net_error("read_non_block: bad length " + std::to_string(tmp_len));
+            if(tmp_len == 0)
+            {
+               ready = true;
                return true;
+            }
             data.resize(tmp_len);
             fd.revents = 0;
             int res = ::poll(&fd, 1, 0);
@@ -285,271 +357,180 @@ struct client_t
       bool read_str;
    };
 
-   void sync_data()
+   // non blocking throughout, the loop thread never waits on a peer
+   struct session_t : boost::noncopyable
    {
-      assert(tcp_sock_);
-      read_struct_->read_non_block(*tcp_sock_);
-      write_struct_->write_non_block(*tcp_sock_);
-      if(read_struct_->ready && write_struct_->ready)
+      // connecting
+      session_t()
+         : read(true)
+         , write(false)
+         , phase(SYNC_DIGEST)
+         , connecting(true)
       {
-         std::vector<user_t> info;
-         parse_list(read_struct_->data, info);
-         {
-            lock_t __(users_mutex_);
-            for(user_t const & user : info)
-            {
-               auto it = users_.find(user.ip);
-               if(it == users_.end())
-               {
-                  users_.insert(std::make_pair(user.ip, user));
-                  continue;
-               }
-               if(it->second.timestamp > user.timestamp)
-                  continue;
-               it->second = user;
-            }
-            stuff_hash_ = compute_hash();
-         }
-         reset_tcp();
-         logger::trace() << "sync_data: sync completed";
+         sock.set_non_block(true);
       }
-   }
 
-   void sendhash()
-   {
-      hash_struct h;
-      h.hash = stuff_hash_;
+      // accepted
+      session_t(int fd)
+         : sock(fd)
+         , read(true)
+         , write(false)
+         , phase(SYNC_DIGEST)
+         , connecting(false)
+      {
+         sock.set_non_block(true);
+      }
 
-      h.ip = local_ip_;
+      tcp::socket_t sock;
+      data_t read, write;
+      sync_phase_t phase;
+      bool connecting; // until the socket turns writable
+   };
 
-      udp_sock_.send(&h, 1);
-      logger::debug() << "Hash sended " << h.hash;
-   }
+   typedef
+      std::map<in_addr, std::unique_ptr<session_t>>
+      sessions_t;
 
-   void recvhash()
+   void watch_session(in_addr const & ip, std::unique_ptr<session_t> session)
    {
-      hash_struct h[10];
-
-      size_t n = udp_sock_.recv(h, 10);
-      assert(n % sizeof(hash_struct) == 0);
-      n /= sizeof(hash_struct);
-      logger::debug() << "Hash recieved(" << n << ") from " << inet_ntoa(h[0].ip) <<": " << h[0].hash;
-
-      uint32_t cur_time = ::time(NULL);
-      for(size_t i = 0; i < n; ++i)
-         if(h[i].hash != stuff_hash_)
-         {
-            start_syncing(h[i].ip);
-            break;
-         }
-         else
-         {
-            lock_t __(users_mutex_);
-            auto it = users_.find(h[i].ip);
-            if(it != users_.end())
-               it->second.timestamp = cur_time;
-         }
+      int fd = *session->sock;
+      sessions_[ip] = std::move(session);
+      loop_->add(fd, EPOLLIN | EPOLLOUT, [this, ip](uint32_t events) { on_session(ip, events); });
    }
 
-   void reset_tcp()
+   sessions_t::iterator drop_session(sessions_t::iterator it)
    {
-      logger::trace() << "client::reset_tcp";
-      tcp_sock_.reset();
-      read_struct_.reset();
-      write_struct_.reset();
+      loop_->remove(*it->second->sock);
+      return sessions_.erase(it);
    }
 
-   void start_syncing(in_addr const & ip)
+   void on_session(in_addr const & ip, uint32_t events)
    {
-      if(tcp_sock_)
+      auto it = sessions_.find(ip);
+      if(it == sessions_.end())
          return;
+      session_t & session = *it->second;
+      bool done = false;
       try
       {
-         logger::trace() << "client::start_syncing: syncing " << inet_ntoa(ip);
-         tcp_sock_ = boost::in_place();
-         assert(tcp_sock_);
-         tcp_sock_->connect(ip, SERVE_TCP_PORT);
-         tcp_addr_ = ip;
-         read_struct_ = data_t(true);
-         write_struct_ = data_t(false);
-         generate_list(write_struct_->data);
+         if(session.connecting)
+         {
+            if(!(events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+               return;
+            if(int err = session.sock.error())
+               throw tcp::net_error(std::string("Connection failed: ") + strerror(err));
+            session.connecting = false;
+         }
+         done = sync_session(ip, session);
       }
       catch(tcp::net_error & e)
       {
-         logger::warning() << "client::start_syncing: " << e.what();
-         reset_tcp();
+         logger::warning() << "client::on_session: with " << inet_ntoa(ip) << ": " << e.what();
+         directory_->session_failed(ip);
+         done = true;
       }
+      catch(peer_list::error & e)
+      {
+         logger::warning() << "client::on_session: from " << inet_ntoa(ip) << ": " << e.what();
+         directory_->session_failed(ip);
+         done = true;
+      }
+      catch(std::bad_alloc &)
+      {
+         logger::warning() << "client::on_session: with " << inet_ntoa(ip) << ": out of memory";
+         directory_->session_failed(ip);
+         done = true;
+      }
+      if(done)
+         drop_session(it);
+      else // nothing to write until the next round, don't spin on POLLOUT
+         loop_->modify(*session.sock, session.write.ready ? EPOLLIN : EPOLLIN | EPOLLOUT);
    }
 
-   void generate_list(std::vector<char> & data) const
+   // true once the session is complete
+   bool sync_session(in_addr const & ip, session_t & session)
    {
-      lock_t __(users_mutex_);
-      uint32_t cur_time = ::time(NULL);
-      auto it = std::back_inserter(data);
-      for(auto const & user : users_)
+      session.read.read_non_block(session.sock);
+      session.write.write_non_block(session.sock);
+      if(!session.read.ready || !session.write.ready)
+         return false;
+      if(session.phase == SYNC_DIGEST)
       {
-         it = std::copy(reinterpret_cast<const char*>(&user.second.ip), reinterpret_cast<const char*>(&user.second.ip) + sizeof(user.second.ip), it);
-         *it = user.second.nick.size();
-         ++it;
-         it = std::copy(user.second.nick.begin(), user.second.nick.end(), it);
-         uint32_t ts = user.second.timestamp - cur_time;
-         if(user.second.ip == local_ip_)
-            ts = 0;
-         it = std::copy(reinterpret_cast<const char*>(&ts), reinterpret_cast<const char*>(&ts) + sizeof(ts), it);
-         it = std::copy(reinterpret_cast<const char*>(&user.second.room_address), reinterpret_cast<const char*>(&user.second.room_address) + sizeof(user.second.room_address), it);
-         it = std::copy(reinterpret_cast<const char*>(&user.second.room_port), reinterpret_cast<const char*>(&user.second.room_port) + sizeof(user.second.room_port), it);
+         std::vector<char> digest;
+         digest.swap(session.read.data);
+         session.read = data_t(true);
+         session.write = data_t(false);
+         directory_->session_reply(ip, digest, session.write.data);
+         session.phase = SYNC_DELTA;
+         return false;
       }
+      directory_->session_done(ip, session.read.data);
+      return true;
    }
 
-   void parse_list(std::vector<char> const & data, std::vector<user_t> & res) const
+   void recv_discovery()
    {
-      size_t offset = 0;
-      uint32_t cur_time = ::time(NULL);
-      while(offset < data.size())
-      {
-         user_t user;
-         if(offset + sizeof(user.ip) > data.size())
-            throw tcp::net_error("invalid format");
-         user.ip = *reinterpret_cast<const in_addr*>(&data[offset]);
-         offset += sizeof(user.ip);
-
-         if(offset + 1 > data.size())
-            throw tcp::net_error("invalid format");
-         size_t nlen = data[offset];
-         offset += 1;
-
-         if(offset + nlen > data.size())
-            throw tcp::net_error("invalid format");
-         user.nick = std::string(data.begin() + offset, data.begin() + offset + nlen);
-         offset += nlen;
-
-         if(offset + sizeof(user.timestamp) > data.size())
-            throw tcp::net_error("invalid format");
-         user.timestamp = *reinterpret_cast<const uint32_t*>(&data[offset]);
-         user.timestamp += cur_time;
-         offset += sizeof(user.timestamp);
-
-         if(offset + sizeof(user.room_address) > data.size())
-            throw tcp::net_error("invalid format");
-         user.room_address = *reinterpret_cast<const in_addr*>(&data[offset]);
-         offset += sizeof(user.room_address);
-
-         if(offset + sizeof(user.room_port) > data.size())
-            throw tcp::net_error("invalid format");
-         user.room_port = *reinterpret_cast<const uint16_t*>(&data[offset]);
-         offset += sizeof(user.room_port);
-
-         if(!(user.ip == local_ip_))
-            res.push_back(user);
-      }
+      char buf[1500];
+      size_t n = udp_sock_.recv(buf, sizeof(buf));
+      if(!directory_->handle(buf, n))
+         logger::trace() << "client::recv_discovery: not a swim datagram, " << n << " bytes";
    }
 
-   uint32_t compute_hash() const
+   bool connect(in_addr const & ip)
    {
-      lock_t __(users_mutex_);
-      uint32_t res = 0;
-      for(auto const & user : users_)
+      try
+      {
+         std::unique_ptr<session_t> session(new session_t());
+         session->connecting = !session->sock.connect_async(ip, SERVE_TCP_PORT);
+         directory_->session_digest(session->write.data);
+         watch_session(ip, std::move(session));
+         return true;
+      }
+      catch(tcp::net_error & e)
       {
-         util::hash_combine(res, util::hash(user.second.ip));
-         util::hash_combine(res, util::hash(user.second.nick));
-         util::hash_combine(res, util::hash(user.second.room_address));
-         util::hash_combine(res, util::hash(user.second.room_port));
+         logger::warning() << "client::connect: " << e.what();
+         return false;
       }
-      logger::trace() << "client_t::compute_hash";
-      return res;
    }
 
-   void do_stuff()
+   void accept()
    {
-      pollfd fds[2];
-      fds[0].fd = *udp_sock_;
-      fds[0].events = POLLIN | POLLOUT;
-      fds[1].fd = *tcp_server_sock_;
-      fds[1].events = POLLIN;
-
-      int res = ::poll(fds, 2, 0);
-      if(res < 0)
-         throw std::runtime_error(std::string("Poll failed: ") + strerror(errno));
-      if(res == 0)
-         return;
-      if((fds[0].revents & POLLOUT) != 0 && !tcp_sock_)
-         sendhash();
-      if(fds[0].revents & POLLIN)
-         recvhash();
-
-      remove_dead_users();
-
-      if((fds[1].revents & POLLIN))
-      {
-         sockaddr_in tmp;
-         socklen_t tmp_len = sizeof(sockaddr_in);
-         int res = ::accept(*tcp_server_sock_, (sockaddr*)&tmp, &tmp_len);
-         if(res == -1)
-//            throw tcp::net_error(std::string("Accept failed: ") + strerror(errno));
-            logger::warning() << (std::string("Accept failed: ") + strerror(errno));
-         else if(!tcp_sock_ || (tcp_addr_ == tmp.sin_addr && local_ip_ < tcp_addr_))
-         {
-            if(tcp_sock_)
-            {
-               logger::trace() << "client::do_stuff: already connected but i will be rejected";
-               reset_tcp();
-            }
-            read_struct_ = data_t(true);
-            write_struct_ = data_t(false);
-            generate_list(write_struct_->data);
-            tcp_sock_ = boost::in_place(res);
-            tcp_addr_ = tmp.sin_addr;
-            logger::trace() << "client::do_stuff: serving " << inet_ntoa(tmp.sin_addr);
-         }
-         else
-         {
-            ::close(res);
-            //tcp::socket_t(res);//it is really closing =)
-            logger::trace() << "client::do_stuff: rejecting " << inet_ntoa(tmp.sin_addr);
-         }
-      }
-      if(tcp_sock_)
+      sockaddr_in tmp;
+      socklen_t tmp_len = sizeof(sockaddr_in);
+      int res = ::accept(*tcp_server_sock_, (sockaddr*)&tmp, &tmp_len);
+      if(res == -1)
+         logger::warning() << (std::string("Accept failed: ") + strerror(errno));
+      else if(!directory_->accept_session(tmp.sin_addr))
+         ::close(res);
+      else
       {
          try
          {
-            sync_data();
+            std::unique_ptr<session_t> session(new session_t(res));
+            directory_->session_digest(session->write.data);
+            watch_session(tmp.sin_addr, std::move(session));
          }
          catch(tcp::net_error & e)
          {
-            logger::warning() << "client::do_stuff: while syncing " << e.what();
-            reset_tcp();
+            logger::warning() << "client::accept: " << e.what();
+            directory_->session_failed(tmp.sin_addr);
          }
       }
    }
 
-   void get_users(std::vector<user_t> & res) const
-   {
-      lock_t __(users_mutex_);
-      res.resize(users_.size());
-      auto it = res.begin();
-      for(auto const & u : users_)
-      {
-         *it = u.second;
-         ++it;
-      }
-   }
-
-private:
    udp::socket_t udp_sock_;
    tcp::socket_t tcp_server_sock_;
-   boost::optional<tcp::socket_t> tcp_sock_;
-   in_addr tcp_addr_;
-   boost::optional<data_t> read_struct_, write_struct_;
+   sessions_t sessions_;
    std::string host_;
    in_addr local_ip_;
    boost::optional<streamer_t> streamer_;
 
-   std::string nick_;
-   users_map_t users_;
-   size_t stuff_hash_;
-   mutable boost::recursive_mutex users_mutex_;
-
    int input_device_, output_device_, api_;
+   streamer_t::framing_t framing_;
+   bool timestamps_;
+   boost::optional<sockaddr_in> relay_;
+   boost::optional<directory_t> directory_;
+   util::event_loop_t * loop_;
 };
 
 }
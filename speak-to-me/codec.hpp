@@ -0,0 +1,113 @@
+#pragma once
+#include "frame.hpp"
+
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+
+// Reduced encodings for congested links. A frame always covers DATA_SIZE
+// samples at the streamer's clock rate; on the wire it may be decimated
+// (box filtered), requantized to 4 bits and packed several to a datagram.
+// Receivers expand back to full frames, so the jitter buffer and mixer
+// never see the difference.
+namespace codec
+{
+   struct encoding_t
+   {
+      uint8_t decimation; // 1, 2 or 4
+      uint8_t bits;       // 8 or 4 per sample
+      uint8_t frames;     // per datagram
+
+      bool legacy() const
+      {
+         return decimation == 1 && bits == 8 && frames == 1;
+      }
+
+      size_t payload_size() const
+      {
+         return frame_t::DATA_SIZE / decimation * bits / 8;
+      }
+
+      bool operator == (encoding_t const & other) const
+      {
+         return decimation == other.decimation && bits == other.bits && frames == other.frames;
+      }
+
+      bool valid() const
+      {
+         return (decimation == 1 || decimation == 2 || decimation == 4) && (bits == 8 || bits == 4)
+            && frames != 0 && frames <= MAX_FRAMES;
+      }
+
+      enum { MAX_FRAMES = 2 };
+   };
+
+   enum flags_t
+   {
+      TIMED = 1, // a frame_t::timing_t follows every syn
+   };
+
+#pragma pack(push, 1)
+   // native framing: header, then `frames` times syn [timing] payload
+   struct packed_header_t
+   {
+      frame_t::ftype type; // frame_t::SOUND_PACKED, where frame_t keeps its type
+      uint8_t decimation;
+      uint8_t bits;
+      uint8_t frames;
+      uint8_t flags;
+   };
+
+   // RTP framing, payload type PACKED_PAYLOAD_TYPE: this, then the payloads of
+   // consecutive frames starting at the RTP timestamp
+   struct rtp_header_t
+   {
+      uint8_t decimation;
+      uint8_t bits;
+      uint8_t frames;
+      uint8_t reserved;
+   };
+#pragma pack(pop)
+
+   inline void encode(encoding_t const & enc, const char * in, char * out)
+   {
+      size_t n = frame_t::DATA_SIZE / enc.decimation;
+      if(enc.bits == 4)
+         memset(out, 0, n / 2);
+      for(size_t i = 0; i < n; ++i)
+      {
+         int sum = 0;
+         for(size_t j = 0; j < enc.decimation; ++j)
+            sum += in[i * enc.decimation + j];
+         int sample = sum / (int)enc.decimation;
+         if(enc.bits == 8)
+            out[i] = sample;
+         else
+         {
+            int nibble = std::max(-8, std::min((sample + 8) >> 4, 7));
+            out[i / 2] |= (nibble & 0xf) << (i % 2 ? 4 : 0);
+         }
+      }
+   }
+
+   inline int sample_at(encoding_t const & enc, const char * in, size_t i)
+   {
+      if(enc.bits == 8)
+         return in[i];
+      int nibble = (in[i / 2] >> (i % 2 ? 4 : 0)) & 0xf;
+      return (int8_t)(nibble << 4);
+   }
+
+   // linear interpolation back up to DATA_SIZE samples
+   inline void decode(encoding_t const & enc, const char * in, char * out)
+   {
+      size_t n = frame_t::DATA_SIZE / enc.decimation;
+      for(size_t i = 0; i < n; ++i)
+      {
+         int from = sample_at(enc, in, i);
+         int to = i + 1 < n ? sample_at(enc, in, i + 1) : from;
+         for(size_t j = 0; j < enc.decimation; ++j)
+            out[i * enc.decimation + j] = from + (to - from) * (int)j / (int)enc.decimation;
+      }
+   }
+}
@@ -0,0 +1,687 @@
+#pragma once
+#include "common/logger.hpp"
+#include "common/flat_map.hpp"
+#include "membership.hpp"
+#include "peer_cache.hpp"
+#include "peer_list.hpp"
+
+#include <arpa/inet.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/optional.hpp>
+#include <boost/utility/in_place_factory.hpp>
+#include <boost/thread/recursive_mutex.hpp>
+#include <boost/thread/locks.hpp>
+
+namespace s2m
+{
+   uint32_t SYNC_TIMEOUT = 30; // sync session is dropped if not done in N secs
+   size_t MAX_SYNC_SESSIONS = 4;
+   size_t MAX_CHANGES = 4; // user entries piggybacked per swim datagram
+   size_t PACK_THRESHOLD = 1024; // bytes, smaller sync payloads go as they are
+
+// The user table and how it spreads: swim membership, entry changes riding on
+// its datagrams, and digest/delta sync sessions when table hashes disagree.
+// It owns no sockets and reads no clock, both come through callbacks_t, so
+// client_t runs one over udp and tcp and discovery-sim runs many on virtual
+// time. A sync session is two rounds over one connection, both sides writing
+// and reading at once: first session_digest(), then session_reply() with
+// whatever entries the other side lacks or has older, which the other side
+// hands to session_done(). The bytes follow the rate of change rather than
+// the size of the table.
+struct directory_t : boost::noncopyable
+{
+   struct user_t
+   {
+      enum { MAX_NICK = 255 }; // bytes, all change_t has room for
+
+      user_t()
+         : room_port(0)
+         , timestamp(0)
+         , version(0)
+         , stale(false)
+      {
+         util::nullize(room_address);
+         util::nullize(ip);
+      }
+      user_t(in_addr const & ip, std::string const& nick)
+         : ip(ip)
+         , nick(clip_nick(nick))
+         , room_port(0)
+         , timestamp(0)
+         , version(0)
+         , stale(false)
+      {
+         util::nullize(room_address);
+      }
+
+      // every copy of an entry must hash the same, so the nick is cut where
+      // it enters, and not mid character
+      static std::string clip_nick(std::string const & nick)
+      {
+         size_t len = nick.size();
+         if(len <= MAX_NICK)
+            return nick;
+         for(len = MAX_NICK; len > 0 && (nick[len] & 0xc0) == 0x80; --len)
+            ;
+         return nick.substr(0, len);
+      }
+
+      in_addr ip;
+      std::string nick;
+      in_addr room_address;
+      uint16_t room_port;
+      uint32_t timestamp;
+      uint32_t version; // bumped by the owner on every change of its entry
+      bool stale;       // from the peer cache, nobody vouched for it yet
+   };
+
+   typedef
+      util::flat_map_t<in_addr, user_t, util::hasher<in_addr>>
+      users_map_t;
+
+   // ip -> version of every entry a peer knows
+   typedef
+      std::unordered_map<in_addr, uint32_t, util::hasher<in_addr>>
+      digest_t;
+
+   typedef
+      std::shared_ptr<const std::vector<user_t>>
+      snapshot_t;
+
+   struct callbacks_t
+   {
+      boost::function<void (in_addr const &, const char *, size_t)> send; // swim datagram, to a member or the group
+      boost::function<bool (in_addr const &)> connect; // opens a session, session_digest() goes first
+      boost::function<void (in_addr const &)> close;   // drops a session's connection
+      boost::function<double ()> now;                  // secs, monotonic
+      boost::function<uint32_t ()> time;               // secs, wall clock
+   };
+
+   directory_t(in_addr const & local_ip, in_addr const & group, std::string const & nick, callbacks_t const & callbacks)
+      : local_ip_(local_ip)
+      , cb_(callbacks)
+      , stuff_hash_(0)
+      , stale_(0)
+      , synced_(false)
+      , dirty_(false)
+   {
+      swim_t::callbacks_t cb;
+      cb.send = cb_.send;
+      cb.hash = [this]() { return stuff_hash_; };
+      cb.on_heard = [this](in_addr const & ip, uint64_t hash) { heard(ip, hash); };
+      cb.on_state = [this](in_addr const & ip, swim_t::state_t state)
+      {
+         if(state == swim_t::DEAD)
+            remove_user(ip);
+      };
+      cb.fill = [this](char * buf, size_t size) { return fill_changes(buf, size); };
+      cb.on_payload = [this](in_addr const &, const char * buf, size_t size) { apply_changes(buf, size); };
+      swim_ = boost::in_place(local_ip_, group, cb);
+
+      user_t me(local_ip_, nick);
+      me.version = next_version(0);
+      insert_user(me);
+      publish();
+   }
+
+   void set_nick(std::string const & nick)
+   {
+      lock_t __(users_mutex_);
+      user_t me = users_[local_ip_];
+      me.nick = user_t::clip_nick(nick);
+      me.version = next_version(me.version);
+      assign_user(users_[local_ip_], me);
+      publish();
+   }
+
+   // port 0 for none
+   void set_room(in_addr const & addr, uint16_t port)
+   {
+      lock_t __(users_mutex_);
+      user_t me = users_[local_ip_];
+      me.room_port = port;
+      me.room_address = addr;
+      me.version = next_version(me.version);
+      assign_user(users_[local_ip_], me);
+      publish();
+   }
+
+   // false if it isn't a swim datagram
+   bool handle(const char * buf, size_t size)
+   {
+      bool res = swim_->handle(buf, size, cb_.now());
+      publish();
+      return res;
+   }
+
+   // often, a tenth of the swim period
+   void poll()
+   {
+      swim_->poll(cb_.now());
+      publish();
+   }
+
+   void expire_sessions()
+   {
+      double now = cb_.now();
+      for(auto it = sessions_.begin(); it != sessions_.end(); )
+         if(it->second.started + SYNC_TIMEOUT < now)
+         {
+            logger::warning() << "directory::expire_sessions: with " << inet_ntoa(it->first) << ": timed out";
+            in_addr ip = it->first;
+            it = sessions_.erase(it);
+            cb_.close(ip);
+         }
+         else
+            ++it;
+   }
+
+   // A peer that connected to us has already paid for the session, so it is
+   // preferred: with the table full it takes the place of our oldest outgoing
+   // one. Two peers syncing each other keep the connection of the lower ip.
+   bool accept_session(in_addr const & ip)
+   {
+      auto it = sessions_.find(ip);
+      if(it != sessions_.end())
+      {
+         if(!(local_ip_ < ip))
+         {
+            logger::trace() << "directory::accept_session: already syncing, rejecting " << inet_ntoa(ip);
+            return false;
+         }
+         logger::trace() << "directory::accept_session: already connected but i will be rejected";
+         sessions_.erase(it);
+         cb_.close(ip);
+      }
+      else if(sessions_.size() >= MAX_SYNC_SESSIONS)
+      {
+         auto oldest = sessions_.end();
+         for(auto it = sessions_.begin(); it != sessions_.end(); ++it)
+            if(it->second.outgoing && (oldest == sessions_.end() || it->second.started < oldest->second.started))
+               oldest = it;
+         if(oldest == sessions_.end())
+         {
+            logger::trace() << "directory::accept_session: full, rejecting " << inet_ntoa(ip);
+            return false;
+         }
+         logger::trace() << "directory::accept_session: dropping outgoing " << inet_ntoa(oldest->first);
+         in_addr dropped = oldest->first;
+         sessions_.erase(oldest);
+         cb_.close(dropped);
+      }
+      session_t s = { false, cb_.now() };
+      sessions_[ip] = s;
+      logger::trace() << "directory::accept_session: serving " << inet_ntoa(ip);
+      return true;
+   }
+
+   void session_digest(std::vector<char> & data) const
+   {
+      lock_t __(users_mutex_);
+      data.reserve(sizeof(peer_list::header_t) + sizeof(uint32_t) + users_.size() * peer_list::fixed_size(peer_list::DIGEST));
+      peer_list::writer_t w(data, peer_list::DIGEST);
+      for(auto const & user : users_)
+         w.digest(user.second.ip, user.second.version, user.second.ip == local_ip_ ? peer_list::CAN_UNPACK : 0);
+   }
+
+   // the peer's digest in, what it lacks out; throws peer_list::error
+   void session_reply(in_addr const & ip, std::vector<char> const & peer_digest, std::vector<char> & data)
+   {
+      digest_t digest;
+      uint32_t flags = parse_digest(peer_digest, digest);
+      if(stale_ != 0)
+         confirm_cached(digest);
+      size_t sent = generate_list(data, &digest);
+      size_t size = data.size();
+      if((flags & peer_list::CAN_UNPACK) && size > PACK_THRESHOLD)
+         peer_list::pack(data);
+      logger::trace() << "directory::session_reply: " << inet_ntoa(ip) << " knows " << digest.size() << " users, sending " << sent
+                      << " in " << data.size() << "/" << size << " bytes";
+   }
+
+   // the peer's list in, the session is over either way; throws peer_list::error
+   void session_done(in_addr const & ip, std::vector<char> const & peer_list_data)
+   {
+      sessions_.erase(ip);
+      synced_ = true;
+      std::vector<char> scratch;
+      auto payload = peer_list::unpack(peer_list_data, scratch);
+      peer_list::view_t list(payload.first, payload.second, peer_list::LIST);
+      size_t received = list.size();
+      uint32_t cur_time = cb_.time();
+      peer_list::entry_t e;
+      while(list.next(e))
+         if(!(e.ip == local_ip_))
+            merge_entry(e, cur_time);
+      publish();
+      logger::trace() << "directory::session_done: with " << inet_ntoa(ip) << ", " << received << " users received";
+   }
+
+   // the connection broke or never came up
+   void session_failed(in_addr const & ip)
+   {
+      sessions_.erase(ip);
+   }
+
+   // RCU style: readers take the current snapshot without locking and keep it
+   // as long as they like, writers publish a new one per batch of changes
+   snapshot_t users() const
+   {
+      return std::atomic_load(&snapshot_);
+   }
+
+   uint64_t hash() const
+   {
+      return stuff_hash_;
+   }
+
+   size_t size() const
+   {
+      lock_t __(users_mutex_);
+      return users_.size();
+   }
+
+   // Last run's table, shown at once but stale: swim probes every entry like
+   // any other member, so the gone ones die off, and the first digest from a
+   // peer confirms the rest wholesale, leaving only real changes to send.
+   void load_cache(std::string const & path)
+   {
+      peer_cache_t cache(path);
+      if(cache.empty())
+         return;
+      try
+      {
+         lock_t __(users_mutex_);
+         peer_list::view_t list(cache.data(), cache.size(), peer_list::LIST);
+         users_.reserve(users_.size() + list.size());
+         peer_list::entry_t e;
+         size_t loaded = 0;
+         while(list.next(e))
+         {
+            if(e.ip == local_ip_ || users_.count(e.ip))
+               continue;
+            user_t user(e.ip, std::string(e.nick, e.nick_len));
+            user.version = e.version;
+            user.timestamp = cache.saved() - e.age;
+            user.room_address = e.room_address;
+            user.room_port = e.room_port;
+            user.stale = true;
+            insert_user(user);
+            ++loaded;
+         }
+         publish();
+         logger::debug() << "directory::load_cache: " << loaded << " users from " << path;
+      }
+      catch(peer_list::error & e)
+      {
+         logger::warning() << "directory::load_cache: " << e.what();
+      }
+   }
+
+   // from the snapshot, so it takes no lock; skipped while nothing changed
+   void save_cache(std::string const & path)
+   {
+      snapshot_t users = this->users();
+      if(users == saved_)
+         return;
+      uint32_t cur_time = cb_.time();
+      std::vector<char> data;
+      peer_list::writer_t w(data, peer_list::LIST);
+      for(auto const & user : *users)
+      {
+         int32_t age = user.ip == local_ip_ ? 0 : cur_time - user.timestamp;
+         w.user(user.ip, user.version, age, user.room_address, user.room_port, user.nick);
+      }
+      if(peer_cache_t::save(path, data))
+         saved_ = users;
+   }
+
+private:
+   typedef
+      boost::unique_lock<boost::recursive_mutex>
+      lock_t;
+
+#pragma pack(push, 1)
+   // a user entry riding on swim traffic, the nick follows
+   struct change_t
+   {
+      in_addr ip;
+      uint32_t version;
+      in_addr room_address;
+      uint16_t room_port;
+      uint8_t nick_len;
+   };
+#pragma pack(pop)
+
+   // a peer's table hash differing from ours, as of since
+   struct mismatch_t
+   {
+      uint64_t ours;
+      uint64_t theirs;
+      double since;
+   };
+
+   // one peer being reconciled with, several run at once
+   struct session_t
+   {
+      bool outgoing;
+      double started;
+   };
+
+   // swim found it dead; published once the batch it came in is done
+   void remove_user(in_addr const & ip)
+   {
+      lock_t __(users_mutex_);
+      auto it = users_.find(ip);
+      if(it != users_.end() && !(ip == local_ip_))
+         erase_user(it);
+      mismatches_.erase(ip);
+   }
+
+   // any swim datagram: the sender is alive, and its table may differ
+   void heard(in_addr const & ip, uint64_t hash)
+   {
+      {
+         lock_t __(users_mutex_);
+         auto it = users_.find(ip);
+         if(it != users_.end())
+         {
+            it->second.timestamp = cb_.time();
+            confirm(it->second);
+         }
+      }
+      if(hash == stuff_hash_)
+      {
+         mismatches_.erase(ip);
+         return;
+      }
+      // while either table still moves, changes retold on swim traffic most
+      // likely explain the difference; a session is for a difference that
+      // stays put past that, for a newcomer yet to get a whole table, or for
+      // a sender whose own entry never reached us
+      double now = cb_.now();
+      mismatch_t & m = mismatches_[ip];
+      if(m.ours != stuff_hash_ || m.theirs != hash)
+      {
+         mismatch_t fresh = { stuff_hash_, hash, now };
+         m = fresh;
+      }
+      if(now - m.since >= gossip_window() || !synced_ || !users_.count(ip))
+         start_syncing(ip);
+   }
+
+   // secs a change keeps riding on our datagrams, there is at least one a period
+   double gossip_window() const
+   {
+      return swim_t::RETRANSMIT * ceil(log2(users_.size() + 2.)) * swim_->options().period;
+   }
+
+   void start_syncing(in_addr const & ip)
+   {
+      if(sessions_.count(ip) || sessions_.size() >= MAX_SYNC_SESSIONS)
+         return;
+      logger::trace() << "directory::start_syncing: syncing " << inet_ntoa(ip);
+      session_t s = { true, cb_.now() };
+      sessions_[ip] = s;
+      if(!cb_.connect(ip))
+         sessions_.erase(ip);
+   }
+
+   // returns the peer's peer_list::flags_t, off its own entry
+   uint32_t parse_digest(std::vector<char> const & data, digest_t & res) const
+   {
+      peer_list::view_t digest(data.empty() ? NULL : &data[0], data.size(), peer_list::DIGEST);
+      res.reserve(digest.size());
+      uint32_t flags = 0;
+      peer_list::entry_t e;
+      while(digest.next(e))
+      {
+         res[e.ip] = e.version;
+         flags |= e.flags;
+      }
+      return flags;
+   }
+
+   // entries the peer lacks or has older; ours always goes, it tells we are alive
+   size_t generate_list(std::vector<char> & data, digest_t const * peer = NULL) const
+   {
+      lock_t __(users_mutex_);
+      uint32_t cur_time = cb_.time();
+      peer_list::writer_t w(data, peer_list::LIST);
+      for(auto const & user : users_)
+      {
+         if(user.second.stale)
+            continue; // we can't vouch for it
+         if(peer && !(user.second.ip == local_ip_))
+         {
+            auto known = peer->find(user.second.ip);
+            if(known != peer->end() && known->second >= user.second.version)
+               continue;
+         }
+         int32_t age = user.second.ip == local_ip_ ? 0 : cur_time - user.second.timestamp;
+         w.user(user.second.ip, user.second.version, age, user.second.room_address, user.second.room_port, user.second.nick);
+      }
+      return w.count();
+   }
+
+   // straight from a received list, most entries are no news
+   void merge_entry(peer_list::entry_t const & e, uint32_t cur_time)
+   {
+      lock_t __(users_mutex_);
+      auto it = users_.find(e.ip);
+      if(it != users_.end() && it->second.version > e.version)
+         return;
+      user_t user(e.ip, std::string(e.nick, e.nick_len));
+      user.version = e.version;
+      user.timestamp = cur_time - e.age;
+      user.room_address = e.room_address;
+      user.room_port = e.room_port;
+      merge_user(user);
+   }
+
+   void merge_user(user_t const & user)
+   {
+      lock_t __(users_mutex_);
+      if(swim_->dead(user.ip))
+         return; // the peer hasn't heard yet
+      auto it = users_.find(user.ip);
+      if(it == users_.end())
+         insert_user(user);
+      else if(it->second.version < user.version)
+         assign_user(it->second, user);
+      else if(it->second.version == user.version)
+      {
+         confirm(it->second);
+         if(it->second.timestamp < user.timestamp)
+            it->second.timestamp = user.timestamp; // not hashed
+      }
+   }
+
+   // Every change to users_ is retold on the next few swim datagrams, so most
+   // of them spread without a sync session; the hashes still catch the rest.
+   void note_change(in_addr const & ip)
+   {
+      changes_[ip] = swim_t::RETRANSMIT * (size_t)ceil(log2(users_.size() + 2.));
+   }
+
+   size_t fill_changes(char * buf, size_t size)
+   {
+      lock_t __(users_mutex_);
+      std::vector<std::pair<in_addr, size_t>> pending(changes_.begin(), changes_.end());
+      std::sort(pending.begin(), pending.end(),
+         [](std::pair<in_addr, size_t> const & a, std::pair<in_addr, size_t> const & b) { return a.second > b.second; });
+      size_t res = 0, n = 0;
+      for(auto const & p : pending)
+      {
+         auto it = users_.find(p.first);
+         if(it == users_.end())
+         {
+            changes_.erase(p.first);
+            continue;
+         }
+         user_t const & user = it->second;
+         change_t c;
+         c.ip = user.ip;
+         c.version = user.version;
+         c.room_address = user.room_address;
+         c.room_port = user.room_port;
+         c.nick_len = user.nick.size();
+         if(n == MAX_CHANGES || res + sizeof(c) + c.nick_len > size)
+            break;
+         memcpy(buf + res, &c, sizeof(c));
+         memcpy(buf + res + sizeof(c), user.nick.data(), c.nick_len);
+         res += sizeof(c) + c.nick_len;
+         ++n;
+         if(--changes_[p.first] == 0)
+            changes_.erase(p.first);
+      }
+      return res;
+   }
+
+   void apply_changes(const char * buf, size_t size)
+   {
+      size_t offset = 0;
+      while(offset + sizeof(change_t) <= size)
+      {
+         change_t c;
+         memcpy(&c, buf + offset, sizeof(c));
+         offset += sizeof(c);
+         if(offset + c.nick_len > size)
+            break;
+         user_t user(c.ip, std::string(buf + offset, c.nick_len));
+         offset += c.nick_len;
+         user.version = c.version;
+         user.room_address = c.room_address;
+         user.room_port = c.room_port;
+         user.timestamp = cb_.time();
+         if(!(user.ip == local_ip_))
+            merge_user(user);
+      }
+   }
+
+   // What peers have to agree on, timestamps are local. The table hash is the
+   // wrapping sum of these, so it doesn't depend on bucket order and every
+   // change to users_ adjusts it in O(1) through the helpers below. Stale
+   // entries are left out until confirmed, peers don't know them as ours.
+   static uint64_t entry_hash(user_t const & user)
+   {
+      uint8_t nlen = user.nick.size();
+      uint64_t res = util::hash64(&user.ip, sizeof(user.ip));
+      res = util::hash64(&nlen, sizeof(nlen), res);
+      res = util::hash64(user.nick.data(), user.nick.size(), res);
+      res = util::hash64(&user.room_address, sizeof(user.room_address), res);
+      res = util::hash64(&user.room_port, sizeof(user.room_port), res);
+      res = util::hash64(&user.version, sizeof(user.version), res);
+      return util::mix64(res);
+   }
+
+   void insert_user(user_t const & user)
+   {
+      lock_t __(users_mutex_);
+      users_.insert(std::make_pair(user.ip, user));
+      swim_->add(user.ip, cb_.now());
+      if(user.stale)
+         ++stale_;
+      else
+      {
+         stuff_hash_ += entry_hash(user);
+         note_change(user.ip);
+      }
+      dirty_ = true;
+   }
+
+   void assign_user(user_t & user, user_t const & value)
+   {
+      lock_t __(users_mutex_);
+      if(user.stale)
+         --stale_;
+      else
+         stuff_hash_ -= entry_hash(user);
+      user = value;
+      stuff_hash_ += entry_hash(user);
+      note_change(user.ip);
+      dirty_ = true;
+   }
+
+   void erase_user(users_map_t::iterator it)
+   {
+      lock_t __(users_mutex_);
+      if(it->second.stale)
+         --stale_;
+      else
+         stuff_hash_ -= entry_hash(it->second);
+      dirty_ = true;
+      users_.erase(it);
+   }
+
+   // swim heard from it or a peer holds the same version: it joins the table proper
+   void confirm(user_t & user)
+   {
+      if(!user.stale)
+         return;
+      user.stale = false;
+      --stale_;
+      stuff_hash_ += entry_hash(user);
+      dirty_ = true;
+   }
+
+   void confirm_cached(digest_t const & digest)
+   {
+      lock_t __(users_mutex_);
+      for(auto const & d : digest)
+      {
+         auto it = users_.find(d.first);
+         if(it != users_.end() && it->second.version == d.second)
+            confirm(it->second);
+      }
+   }
+
+   // wall clock seeded, so a restarted client still outranks what peers remember of it
+   uint32_t next_version(uint32_t version) const
+   {
+      return std::max<uint32_t>(version + 1, cb_.time());
+   }
+
+   void publish()
+   {
+      lock_t __(users_mutex_);
+      if(!dirty_)
+         return;
+      dirty_ = false;
+      std::shared_ptr<std::vector<user_t>> next = std::make_shared<std::vector<user_t>>();
+      next->reserve(users_.size());
+      for(auto const & u : users_)
+         next->push_back(u.second);
+      std::atomic_store(&snapshot_, snapshot_t(std::move(next)));
+   }
+
+private:
+   in_addr local_ip_;
+   callbacks_t cb_;
+   users_map_t users_;
+   uint64_t stuff_hash_; // sum of entry_hash over users_
+   size_t stale_;        // users_ still unconfirmed from the peer cache
+   std::unordered_map<in_addr, size_t, util::hasher<in_addr>> changes_; // ip -> times still to tell
+   std::map<in_addr, session_t> sessions_;
+   bool synced_;          // a session completed since we started
+   std::unordered_map<in_addr, mismatch_t, util::hasher<in_addr>> mismatches_;
+   bool dirty_;           // users_ changed since the last snapshot
+   snapshot_t snapshot_;  // only through atomic_load/atomic_store
+   snapshot_t saved_;     // what the peer cache holds
+   mutable boost::recursive_mutex users_mutex_;
+   boost::optional<swim_t> swim_;
+};
+
+}
@@ -0,0 +1,55 @@
+#pragma once
+#include "common/pool.hpp"
+
+#include <stdint.h>
+#include <stddef.h>
+#include <netinet/in.h>
+
+#pragma pack (push, 1)
+struct frame_t
+{
+   bool operator < (frame_t const & other) const
+   {
+      return syn < other.syn;
+   }
+
+   enum ftype
+   {
+      SOUND,
+      SOUND_TIMED, // timing goes on the wire too
+      SOUND_PACKED, // several reduced frames per datagram, see codec.hpp
+   };
+   enum {DATA_SIZE = 1024};
+
+   // sender's wall clock, us
+   struct timing_t
+   {
+      uint64_t capture; // first sample left the ADC
+      uint64_t sent;
+   };
+
+   // native framing sends this much of the frame
+   size_t wire_size() const
+   {
+      return type == SOUND_TIMED ? sizeof(frame_t) : offsetof(frame_t, timing);
+   }
+
+   ftype type;
+   uint32_t syn;
+   in_addr source;
+   char data[DATA_SIZE];
+   timing_t timing;
+};
+#pragma pack (pop)
+
+typedef
+   util::pool_t<frame_t>
+   frame_pool_t;
+
+typedef
+   frame_pool_t::handle_t
+   frame_ptr;
+
+typedef
+   util::intrusive_queue_t<frame_t>
+   frame_queue_t;
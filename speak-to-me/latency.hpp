@@ -0,0 +1,218 @@
+#pragma once
+#include "frame.hpp"
+#include "common/histogram.hpp"
+#include "common/logger.hpp"
+#include "common/stuff.hpp"
+#include "common/flat_map.hpp"
+
+#include <stdint.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+#include <memory>
+#include <vector>
+
+#include <boost/noncopyable.hpp>
+
+// Capture-to-playout latency per source, from the timing senders put in their
+// frames. Remote stamps are on the sender's wall clock: the offset to ours is
+// taken from RTCP (SR send time against its arrival, less half the round trip)
+// when we have both, otherwise from the smallest transit seen, in which case
+// the network stage reads as queueing above the path's floor. Sources are keyed
+// by SSRC under RTP framing, so speakers behind one relay or NAT stay apart,
+// and by sender address otherwise. The table is sized up front, as it fills
+// on the output thread; sources past MAX_SOURCES aren't measured.
+struct latency_t : boost::noncopyable
+{
+   enum { MAX_SOURCES = 256 };
+
+   enum stage_t
+   {
+      PACKETIZATION, // capture to send, on the sender
+      NETWORK,
+      JITTER_BUFFER, // arrival to playout
+      DEVICE,        // output stream latency
+      TOTAL,
+      STAGES,
+   };
+
+   struct report_t
+   {
+      uint32_t source;
+      in_addr address; // last one its frames came from
+      int64_t offset; // us, our clock minus theirs
+      bool rtcp;      // offset from RTCP rather than the transit floor
+      util::histogram_t::snapshot_t stages[STAGES];
+   };
+
+   latency_t()
+      : slots_(new source_t[MAX_SOURCES])
+   {
+      index_.reserve(MAX_SOURCES);
+      free_.reserve(MAX_SOURCES);
+      for(size_t i = MAX_SOURCES; i > 0; --i)
+         free_.push_back(i - 1);
+   }
+
+   static uint64_t now() // us, wall clock
+   {
+      timeval tv;
+      ::gettimeofday(&tv, NULL);
+      return tv.tv_sec * 1000000ull + tv.tv_usec;
+   }
+
+   // an SR `source` stamped at `sent` on its clock arrived at `arrived` on ours
+   void on_sender_report(uint32_t source, uint64_t sent, uint64_t arrived)
+   {
+      source_t * s = find(source, arrived);
+      if(!s)
+         return;
+      s->sr_transit = (int64_t)(arrived - sent);
+      s->has_sr = true;
+   }
+
+   void on_rtt(uint32_t source, double rtt)
+   {
+      if(source_t * s = find(source, now()))
+         s->rtt = rtt * 1e6;
+   }
+
+   // `buffered`: how long the frame waits for playout
+   void on_frame(uint32_t source, in_addr const & address, frame_t::timing_t const & t, uint64_t arrived, int64_t buffered,
+                 uint64_t device)
+   {
+      source_t * found = find(source, arrived);
+      if(!found)
+         return;
+      source_t & s = *found;
+      s.address = address;
+      int64_t transit = (int64_t)(arrived - t.sent);
+      if(!s.seen || transit < s.min_transit)
+         s.min_transit = transit;
+      s.seen = true;
+
+      int64_t packetization = (int64_t)(t.sent - t.capture);
+      int64_t network = transit - offset(s);
+      record(s, PACKETIZATION, packetization);
+      record(s, NETWORK, network);
+      record(s, JITTER_BUFFER, buffered);
+      record(s, DEVICE, device);
+      record(s, TOTAL, packetization + network + buffered + device);
+   }
+
+   // drains every source's window; cheap, meant to be called under the streamer's lock
+   void take(std::vector<report_t> & res)
+   {
+      for(auto const & e : index_)
+      {
+         source_t & s = slots_[e.second];
+         res.push_back(report_t());
+         report_t & r = res.back();
+         r.source = e.first;
+         r.address = s.address;
+         r.offset = offset(s);
+         r.rtcp = rtcp_synced(s);
+         for(size_t i = 0; i < STAGES; ++i)
+            r.stages[i] = s.stages[i].take();
+         if(r.stages[TOTAL].count == 0)
+            res.pop_back();
+      }
+   }
+
+   // forgets sources not heard from since `before`, as now() has it
+   void expire(uint64_t before)
+   {
+      index_.erase_if([this, before](std::pair<uint32_t, uint32_t> const & e)->bool
+      {
+         if(slots_[e.second].last_seen >= before)
+            return false;
+         free_.push_back(e.second);
+         return true;
+      });
+   }
+
+   static void log(report_t const & r)
+   {
+      static const char * names[STAGES] = {"packetization", "network", "jitter buffer", "device", "total"};
+      logger::debug() << "latency: " << r.source << " (" << inet_ntoa(r.address) << ") frames " << r.stages[TOTAL].count
+                      << " offset " << r.offset << "us (" << (r.rtcp ? "rtcp" : "transit floor") << ")";
+      for(size_t i = 0; i < STAGES; ++i)
+         logger::debug() << "latency: " << r.source << " " << names[i]
+                         << " mean " << (int64_t)r.stages[i].mean() << " p50<" << r.stages[i].quantile(.5)
+                         << " p99<" << r.stages[i].quantile(.99) << " max " << r.stages[i].max << "us";
+   }
+
+private:
+   struct source_t
+   {
+      source_t()
+      {
+         reset();
+      }
+
+      // for a slot taken by a new source
+      void reset()
+      {
+         seen = false;
+         min_transit = 0;
+         has_sr = false;
+         sr_transit = 0;
+         rtt = 0;
+         last_seen = 0;
+         address.s_addr = INADDR_ANY;
+         for(size_t i = 0; i < STAGES; ++i)
+            stages[i].take();
+      }
+
+      bool seen;
+      int64_t min_transit;
+      bool has_sr;
+      int64_t sr_transit;
+      int64_t rtt;
+      uint64_t last_seen;
+      in_addr address;
+      util::histogram_t stages[STAGES]; // us
+   };
+
+   // slot of `source`, a free one if it's new; NULL once they're all taken
+   source_t * find(uint32_t source, uint64_t now)
+   {
+      source_t * res;
+      auto it = index_.find(source);
+      if(it != index_.end())
+         res = &slots_[it->second];
+      else if(free_.empty())
+         return NULL;
+      else
+      {
+         uint32_t slot = free_.back();
+         free_.pop_back();
+         res = &slots_[slot];
+         res->reset();
+         index_.insert(std::make_pair(source, slot));
+      }
+      res->last_seen = now;
+      return res;
+   }
+
+   static bool rtcp_synced(source_t const & s)
+   {
+      return s.has_sr && s.rtt > 0;
+   }
+
+   static int64_t offset(source_t const & s)
+   {
+      return rtcp_synced(s) ? s.sr_transit - s.rtt / 2 : s.min_transit;
+   }
+
+   // clock error can push a stage below zero; it counts as zero rather than wrapping
+   static void record(source_t & s, stage_t stage, int64_t us)
+   {
+      s.stages[stage].record(us > 0 ? us : 0);
+   }
+
+private:
+   // output thread, or under the streamer's lock
+   std::unique_ptr<source_t[]> slots_; // histograms can't move, so sources stay put
+   util::flat_map_t<uint32_t, uint32_t, util::hasher<uint32_t>> index_; // source to slot
+   std::vector<uint32_t> free_;
+};
@@ -0,0 +1,235 @@
+#pragma once
+#include "frame.hpp"
+#include "common/logger.hpp"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <atomic>
+#include <sstream>
+#include <stdexcept>
+
+#include <boost/noncopyable.hpp>
+
+// Same-host path between instances in one multicast room. A POSIX shm object
+// per room holds a broadcast ring per member: the writer never waits, readers
+// poll from the output callback like they poll sockets, and skip whatever they
+// were too slow for. An all-zero segment is valid and empty, so whoever
+// creates it has nothing to set up.
+struct local_link_t : boost::noncopyable
+{
+   enum
+   {
+      MAX_MEMBERS = 16,
+      RING_SIZE = 16,     // frames per member, ~2.6s of audio
+      LAYOUT = 0x73326d01, // magic and version
+      LIVE_SECS = 3,      // heartbeat age that still counts as a peer
+      STALE_SECS = 10,    // ... after which the slot may be taken over
+   };
+
+   struct error : std::runtime_error
+   {
+      error(std::string const & what)
+         : std::runtime_error(what)
+      {
+      }
+   };
+
+   local_link_t(in_addr const & group, uint16_t port)
+      : seg_(NULL)
+      , self_(MAX_MEMBERS)
+      , pid_(::getpid())
+      , scan_(0)
+   {
+      std::stringstream ss;
+      ss << "/s2m-" << inet_ntoa(group) << "-" << port;
+      name_ = ss.str();
+      map();
+      claim();
+      for(size_t i = 0; i < MAX_MEMBERS; ++i)
+      {
+         seen_pid_[i] = 0;
+         next_[i] = 0;
+      }
+      logger::debug() << "local_link: " << name_ << " member " << self_;
+   }
+
+   ~local_link_t()
+   {
+      int32_t pid = pid_;
+      seg_->members[self_].pid.compare_exchange_strong(pid, 0);
+      ::munmap(seg_, sizeof(segment_t));
+   }
+
+   // members that showed signs of life recently, not counting us; no syscalls
+   size_t peers() const
+   {
+      uint64_t now = monotonic_secs();
+      size_t res = 0;
+      for(size_t i = 0; i < MAX_MEMBERS; ++i)
+         if(i != self_ && live(seg_->members[i], now))
+            ++res;
+      return res;
+   }
+
+   void keepalive()
+   {
+      seg_->members[self_].heartbeat.store(monotonic_secs(), std::memory_order_relaxed);
+   }
+
+   void send(frame_t const & frame)
+   {
+      member_t & m = seg_->members[self_];
+      uint64_t n = m.written.load(std::memory_order_relaxed); // we are the only writer
+      cell_t & cell = m.ring[n % RING_SIZE];
+      cell.seq.store(2 * n + 1, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_release);
+      memcpy(&cell.frame, &frame, sizeof(frame_t));
+      cell.seq.store(2 * n + 2, std::memory_order_release);
+      m.written.store(n + 1, std::memory_order_release);
+   }
+
+   // next frame any other member wrote; false once all are drained
+   bool recv(frame_t & frame, size_t & member)
+   {
+      for(; scan_ < MAX_MEMBERS; ++scan_)
+      {
+         if(scan_ == self_)
+            continue;
+         member_t & m = seg_->members[scan_];
+         int32_t pid = m.pid.load(std::memory_order_acquire);
+         uint64_t written = m.written.load(std::memory_order_acquire);
+         if(pid != seen_pid_[scan_])
+         {
+            // new member in the slot: start from what it writes next
+            seen_pid_[scan_] = pid;
+            next_[scan_] = written;
+         }
+         if(pid == 0)
+            continue;
+         if(written - next_[scan_] >= RING_SIZE)
+            next_[scan_] = written - (RING_SIZE - 1); // lapped, the oldest cell may be in rewrite
+         while(next_[scan_] < written)
+         {
+            uint64_t n = next_[scan_]++;
+            cell_t & cell = m.ring[n % RING_SIZE];
+            uint64_t seq = cell.seq.load(std::memory_order_acquire);
+            if(seq != 2 * n + 2)
+               continue;
+            memcpy(&frame, &cell.frame, sizeof(frame_t));
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if(cell.seq.load(std::memory_order_relaxed) != seq)
+               continue; // torn by the writer
+            member = scan_;
+            return true;
+         }
+      }
+      scan_ = 0;
+      return false;
+   }
+
+   // how readers see a member as a frame_t::source
+   static in_addr source(size_t member)
+   {
+      in_addr res;
+      res.s_addr = htonl(INADDR_LOOPBACK + member + 1);
+      return res;
+   }
+
+private:
+   struct cell_t
+   {
+      std::atomic<uint64_t> seq; // 2n + 2 once frame n is in, odd while being written
+      frame_t frame;
+   };
+
+   struct member_t
+   {
+      std::atomic<int32_t> pid; // 0 for a free slot
+      std::atomic<uint64_t> heartbeat;
+      std::atomic<uint64_t> written;
+      cell_t ring[RING_SIZE];
+   };
+
+   struct segment_t
+   {
+      std::atomic<uint32_t> layout;
+      member_t members[MAX_MEMBERS];
+   };
+
+   static uint64_t monotonic_secs() // comparable across processes on one host
+   {
+      timespec ts;
+      ::clock_gettime(CLOCK_MONOTONIC, &ts);
+      return ts.tv_sec;
+   }
+
+   static bool live(member_t const & m, uint64_t now)
+   {
+      return m.pid.load(std::memory_order_relaxed) != 0 && now - m.heartbeat.load(std::memory_order_relaxed) < LIVE_SECS;
+   }
+
+   void map()
+   {
+      int fd = ::shm_open(name_.c_str(), O_RDWR | O_CREAT, 0600);
+      if(fd == -1)
+         throw error("shm_open " + name_ + ": " + strerror(errno));
+      struct stat st;
+      if(::fstat(fd, &st) == -1 || (st.st_size == 0 && ::ftruncate(fd, sizeof(segment_t)) == -1))
+      {
+         ::close(fd);
+         throw error("Can't size " + name_ + ": " + strerror(errno));
+      }
+      if(st.st_size != 0 && (size_t)st.st_size != sizeof(segment_t))
+      {
+         ::close(fd);
+         throw error(name_ + " has a different layout");
+      }
+      void * p = ::mmap(NULL, sizeof(segment_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      ::close(fd);
+      if(p == MAP_FAILED)
+         throw error("mmap " + name_ + ": " + strerror(errno));
+      seg_ = static_cast<segment_t*>(p);
+
+      uint32_t layout = 0;
+      if(!seg_->layout.compare_exchange_strong(layout, LAYOUT) && layout != LAYOUT)
+      {
+         ::munmap(seg_, sizeof(segment_t));
+         throw error(name_ + " has a different layout");
+      }
+   }
+
+   void claim()
+   {
+      uint64_t now = monotonic_secs();
+      for(size_t i = 0; i < MAX_MEMBERS; ++i)
+      {
+         member_t & m = seg_->members[i];
+         int32_t pid = m.pid.load();
+         bool stale = pid != 0 && now - m.heartbeat.load() >= STALE_SECS && ::kill(pid, 0) == -1 && errno == ESRCH;
+         if((pid == 0 || stale) && m.pid.compare_exchange_strong(pid, pid_))
+         {
+            m.heartbeat = now;
+            self_ = i;
+            return;
+         }
+      }
+      ::munmap(seg_, sizeof(segment_t));
+      throw error(name_ + " is full");
+   }
+
+private:
+   std::string name_;
+   segment_t * seg_;
+   size_t self_;
+   int32_t pid_;
+   size_t scan_;
+   int32_t seen_pid_[MAX_MEMBERS]; // reader side, output thread
+   uint64_t next_[MAX_MEMBERS];
+};
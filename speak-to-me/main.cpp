@@ -1,19 +1,67 @@
 #include "common/udp.hpp"
+#include "common/threads.hpp"
 #include <iostream>
 #include <fstream>
+#include <boost/lexical_cast.hpp>
 
 #include "client.hpp"
 #include "streamer.hpp"
 #include "tui.hpp"
 
+static void usage(const char * name)
+{
+   std::cerr << "usage: " << name << " [-p <priority>] [-a <cpus>] [-o <cpus>] [-m]\n"
+             << "   -p <priority>   SCHED_FIFO priority for the audio threads\n"
+             << "   -a <cpus>       pin the audio threads, e.g. 2,3 or 2-3\n"
+             << "   -o <cpus>       pin everything else (ui, sync, recorder)\n"
+             << "   -m              lock memory (mlockall)\n";
+}
+
 int main(int argc, char** argv)
 {
+   util::thread_policy_t audio, other;
+   bool lock_memory = false;
+   try
+   {
+      for(int i = 1; i < argc; ++i)
+      {
+         std::string arg = argv[i];
+         if(arg == "-m")
+            lock_memory = true;
+         else if(i + 1 == argc)
+            throw boost::bad_lexical_cast();
+         else if(arg == "-p")
+            audio.priority = boost::lexical_cast<int>(argv[++i]);
+         else if(arg == "-a")
+            audio.cpus = util::parse_cpus(argv[++i]);
+         else if(arg == "-o")
+            other.cpus = util::parse_cpus(argv[++i]);
+         else
+            throw boost::bad_lexical_cast();
+      }
+   }
+   catch(boost::bad_lexical_cast &)
+   {
+      usage(argv[0]);
+      return 1;
+   }
+
    std::ofstream logf("log.txt");
    logger::set_logger(logger::ERROR,   logger::holder_by_ref(logger::details::level_printer(logger::ERROR),   logf));
    logger::set_logger(logger::WARNING, logger::holder_by_ref(logger::details::level_printer(logger::WARNING), logf));
    logger::set_logger(logger::DEBUG,   logger::holder_by_ref(logger::details::level_printer(logger::DEBUG),   logf));
    logger::set_logger(logger::TRACE,   logger::holder_by_ref(logger::details::level_printer(logger::TRACE),   logf));
 //   logger::set_logger(logger::TRACE, logger::null_holder());
+
+   util::thread_config_t & threads = util::thread_config_t::instance();
+   threads.set_policy("audio-in", audio);
+   threads.set_policy("audio-out", audio);
+   threads.set_policy("ui", other);
+   threads.set_policy("recorder", other);
+   if(lock_memory)
+      threads.lock_memory();
+   util::configure_thread("ui");
+
    tui ui;
    ui.run();
    return 0;
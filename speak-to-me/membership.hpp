@@ -0,0 +1,498 @@
+#pragma once
+#include "common/logger.hpp"
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+#include <arpa/inet.h>
+#include <algorithm>
+#include <queue>
+#include <random>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+
+#include "common/stuff.hpp"
+
+// SWIM style membership (Das, Gupta, Motivala) over the discovery socket.
+// Each period one member, in shuffled round robin, gets a PING; with no ACK
+// after ack_timeout, INDIRECT others are asked to ping it for us, and with no
+// ACK by the end of the period it becomes SUSPECT, then DEAD unless it refutes
+// that with a higher incarnation in time. State changes ride on the probe
+// traffic, so a member sends and receives O(1) datagrams per period however
+// big the group is. Multicast is only used to announce ourselves on startup
+// and while we know nobody. Time is passed in, in secs, so the owner picks
+// the clock.
+struct swim_t : boost::noncopyable
+{
+   enum state_t
+   {
+      ALIVE,
+      SUSPECT,
+      DEAD,
+   };
+
+   enum type_t
+   {
+      PING = 1,
+      PING_REQ,
+      ACK,
+      ANNOUNCE,
+   };
+
+   enum
+   {
+      MAGIC = 0x5357,
+      INDIRECT = 3,    // members asked to probe for us
+      MAX_UPDATES = 8, // piggybacked per datagram
+      RETRANSMIT = 3,  // times log2(members) every update is piggybacked
+      MAX_PAYLOAD = 512, // owner's bytes after the updates
+   };
+
+#pragma pack(push, 1)
+   struct header_t
+   {
+      uint16_t magic;
+      uint8_t type;
+      uint8_t updates;      // update_t records that follow
+      uint32_t seq;
+      in_addr from;         // the sender, alive at incarnation
+      in_addr target;       // PING_REQ: whom to probe, ACK: who answered
+      uint32_t incarnation;
+      uint64_t hash;        // the sender's user table hash
+   };
+
+   struct update_t
+   {
+      in_addr ip;
+      uint8_t state;
+      uint32_t incarnation;
+   };
+#pragma pack(pop)
+
+   struct options_t
+   {
+      options_t()
+         : period(1)
+         , ack_timeout(.3)
+         , suspect_periods(3)
+         , dead_keep(30)
+         , announce_period(5)
+      {
+      }
+
+      double period;          // secs between probes
+      double ack_timeout;     // before asking others
+      double suspect_periods; // times log2(members) before a suspect is dead
+      double dead_keep;       // secs a tombstone stops the dead coming back through gossip
+      double announce_period;
+   };
+
+   struct callbacks_t
+   {
+      boost::function<void (in_addr const &, const char *, size_t)> send; // to a member or the group
+      boost::function<uint64_t ()> hash;
+      boost::function<void (in_addr const &, uint64_t)> on_heard;         // a member's table hash
+      boost::function<void (in_addr const &, state_t)> on_state;
+      boost::function<size_t (char *, size_t)> fill;                   // owner's payload, returns the size
+      boost::function<void (in_addr const &, const char *, size_t)> on_payload;
+   };
+
+   swim_t(in_addr const & self, in_addr const & group, callbacks_t const & callbacks, options_t const & opts = options_t())
+      : self_(self)
+      , group_(group)
+      , cb_(callbacks)
+      , opts_(opts)
+      , incarnation_(::time(NULL)) // a restarted member outranks its own tombstone
+      , seq_(0)
+      , next_probe_(0)
+      , next_announce_(0)
+      , announced_(false)
+      , live_(0)
+      , order_pos_(0)
+      , random_(self.s_addr ^ incarnation_)
+   {
+      probe_.active = false;
+   }
+
+   static double now() // secs, monotonic
+   {
+      timespec ts;
+      ::clock_gettime(CLOCK_MONOTONIC, &ts);
+      return ts.tv_sec + ts.tv_nsec * 1e-9;
+   }
+
+   // learnt about some other way, e.g. from a user table sync
+   void add(in_addr const & ip, double now)
+   {
+      if(ip == self_ || members_.count(ip))
+         return;
+      update_t u = { ip, ALIVE, 0 };
+      merge(u, now);
+   }
+
+   bool dead(in_addr const & ip) const
+   {
+      auto it = members_.find(ip);
+      return it != members_.end() && it->second.state == DEAD;
+   }
+
+   options_t const & options() const
+   {
+      return opts_;
+   }
+
+   // members not known to be dead, not counting us
+   size_t live() const
+   {
+      return live_;
+   }
+
+   // a discovery datagram, false if it isn't ours
+   bool handle(const char * buf, size_t size, double now)
+   {
+      header_t h;
+      if(size < sizeof(h))
+         return false;
+      memcpy(&h, buf, sizeof(h));
+      if(h.magic != MAGIC)
+         return false;
+      size_t payload = sizeof(h) + h.updates * sizeof(update_t);
+      if(size < payload)
+      {
+         logger::warning() << "swim: malformed datagram from " << inet_ntoa(h.from);
+         return true;
+      }
+      if(h.from == self_)
+         return true;
+
+      update_t sender = { h.from, ALIVE, h.incarnation };
+      merge(sender, now);
+      for(size_t i = 0; i < h.updates; ++i)
+      {
+         update_t u;
+         memcpy(&u, buf + sizeof(h) + i * sizeof(u), sizeof(u));
+         merge(u, now);
+      }
+      if(cb_.on_payload && size > payload)
+         cb_.on_payload(h.from, buf + payload, size - payload);
+      if(cb_.on_heard) // after the payload, which may well explain a hash mismatch
+         cb_.on_heard(h.from, h.hash);
+
+      switch(h.type)
+      {
+      case PING:
+         send(h.from, ACK, h.seq, self_);
+         break;
+      case PING_REQ:
+      {
+         relay_t r = { ++seq_, h.from, h.seq, h.target, now + opts_.period };
+         relays_.push_back(r);
+         send(h.target, PING, r.seq, h.target);
+         break;
+      }
+      case ACK:
+         if(probe_.active && probe_.seq == h.seq && probe_.target == h.target)
+            probe_.acked = true;
+         for(auto it = relays_.begin(); it != relays_.end(); ++it)
+            if(it->seq == h.seq && it->target == h.target)
+            {
+               send(it->requester, ACK, it->requester_seq, it->target);
+               relays_.erase(it);
+               break;
+            }
+         break;
+      }
+      return true;
+   }
+
+   // drives probes and timeouts, call a few times per period
+   void poll(double now)
+   {
+      if(probe_.active && !probe_.acked && !probe_.indirect && now - probe_.sent >= opts_.ack_timeout)
+      {
+         probe_.indirect = true;
+         for(in_addr const & ip : pick(INDIRECT, probe_.target))
+            send(ip, PING_REQ, probe_.seq, probe_.target);
+      }
+      if(now >= next_probe_)
+      {
+         if(probe_.active && !probe_.acked)
+            suspect(probe_.target, now);
+         next_probe_ = now + opts_.period;
+         start_probe(now);
+      }
+
+      // only what is due is touched, however many members there are
+      while(!deadlines_.empty() && deadlines_.top().at <= now)
+      {
+         deadline_t d = deadlines_.top();
+         deadlines_.pop();
+         auto it = members_.find(d.ip);
+         if(it == members_.end() || it->second.epoch != d.epoch)
+            continue; // it changed state since
+         if(it->second.state == SUSPECT)
+         {
+            update_t u = { d.ip, DEAD, it->second.incarnation };
+            merge(u, now);
+         }
+         else if(it->second.state == DEAD)
+            members_.erase(it);
+      }
+
+      relays_.erase(std::remove_if(relays_.begin(), relays_.end(),
+         [now](relay_t const & r) { return r.deadline <= now; }), relays_.end());
+
+      // once on startup whatever we know, members from a peer cache may be
+      // long gone; later only while alone
+      if((!announced_ || live() == 0) && now >= next_announce_)
+      {
+         send(group_, ANNOUNCE, 0, self_);
+         announced_ = true;
+         next_announce_ = now + opts_.announce_period;
+      }
+   }
+
+private:
+   struct member_t
+   {
+      state_t state;
+      uint32_t incarnation;
+      uint32_t epoch; // state changes so far, tells stale deadlines
+   };
+
+   // a suspect to declare dead or a tombstone to drop
+   struct deadline_t
+   {
+      double at;
+      in_addr ip;
+      uint32_t epoch;
+
+      bool operator < (deadline_t const & other) const
+      {
+         return at > other.at; // earliest on top
+      }
+   };
+
+   struct gossip_t
+   {
+      update_t update;
+      size_t left; // transmissions
+   };
+
+   // a PING_REQ we act on
+   struct relay_t
+   {
+      uint32_t seq;
+      in_addr requester;
+      uint32_t requester_seq;
+      in_addr target;
+      double deadline;
+   };
+
+   struct probe_t
+   {
+      bool active;
+      bool acked;
+      bool indirect;
+      uint32_t seq;
+      in_addr target;
+      double sent;
+   };
+
+   // whether u says something newer than what we have
+   static bool overrides(update_t const & u, member_t const & m)
+   {
+      switch(u.state)
+      {
+      case ALIVE:
+         return u.incarnation > m.incarnation;
+      case SUSPECT:
+         return m.state != DEAD && (u.incarnation > m.incarnation || (u.incarnation == m.incarnation && m.state == ALIVE));
+      default:
+         return m.state != DEAD && u.incarnation >= m.incarnation;
+      }
+   }
+
+   void merge(update_t const & u, double now)
+   {
+      if(u.state > DEAD)
+         return;
+      if(u.ip == self_)
+      {
+         if(u.state != ALIVE && u.incarnation >= incarnation_)
+         {
+            incarnation_ = u.incarnation + 1;
+            update_t alive = { self_, ALIVE, incarnation_ };
+            enqueue(alive);
+            logger::debug() << "swim: refuting " << (u.state == DEAD ? "death" : "suspicion") << ", incarnation " << incarnation_;
+         }
+         return;
+      }
+      auto it = members_.find(u.ip);
+      bool fresh = it == members_.end();
+      if(fresh)
+      {
+         if(u.state == DEAD)
+            return; // nothing to bury
+         member_t m = { ALIVE, 0, 0 };
+         it = members_.insert(std::make_pair(u.ip, m)).first;
+         ++live_;
+         // SWIM's round robin takes newcomers at a random place in what's left
+         std::uniform_int_distribution<size_t> at(order_pos_, order_.size());
+         order_.insert(order_.begin() + at(random_), u.ip);
+      }
+      member_t & m = it->second;
+      if(!fresh && !overrides(u, m))
+         return;
+      bool changed = fresh || m.state != u.state;
+      if(m.state == DEAD && u.state != DEAD)
+         ++live_;
+      else if(m.state != DEAD && u.state == DEAD)
+         --live_;
+      m.state = (state_t)u.state;
+      m.incarnation = u.incarnation;
+      if(changed)
+      {
+         ++m.epoch;
+         if(m.state == SUSPECT)
+         {
+            deadline_t d = { now + opts_.suspect_periods * opts_.period * std::max(1., log2(members_.size() + 1.)), u.ip, m.epoch };
+            deadlines_.push(d);
+         }
+         else if(m.state == DEAD)
+         {
+            deadline_t d = { now + opts_.dead_keep, u.ip, m.epoch };
+            deadlines_.push(d);
+         }
+         logger::debug() << "swim: " << inet_ntoa(u.ip) << (u.state == ALIVE ? " alive" : u.state == SUSPECT ? " suspect" : " dead");
+      }
+      enqueue(u);
+      if(changed && cb_.on_state)
+         cb_.on_state(u.ip, m.state);
+   }
+
+   void suspect(in_addr const & ip, double now)
+   {
+      auto it = members_.find(ip);
+      if(it == members_.end() || it->second.state != ALIVE)
+         return;
+      update_t u = { ip, SUSPECT, it->second.incarnation };
+      merge(u, now);
+   }
+
+   void enqueue(update_t const & u)
+   {
+      gossip_t g = { u, (size_t)(RETRANSMIT * ceil(log2(members_.size() + 2.))) };
+      gossip_[u.ip] = g;
+   }
+
+   void start_probe(double now)
+   {
+      probe_.active = false;
+      for(size_t tries = 0; tries < 2 && !probe_.active; ++tries)
+      {
+         if(order_pos_ >= order_.size())
+         {
+            order_.clear();
+            for(auto const & m : members_)
+               if(m.second.state != DEAD)
+                  order_.push_back(m.first);
+            std::shuffle(order_.begin(), order_.end(), random_);
+            order_pos_ = 0;
+         }
+         while(order_pos_ < order_.size())
+         {
+            in_addr ip = order_[order_pos_++];
+            auto it = members_.find(ip);
+            if(it == members_.end() || it->second.state == DEAD)
+               continue;
+            probe_.active = true;
+            probe_.acked = false;
+            probe_.indirect = false;
+            probe_.seq = ++seq_;
+            probe_.target = ip;
+            probe_.sent = now;
+            send(ip, PING, probe_.seq, ip);
+            break;
+         }
+      }
+   }
+
+   std::vector<in_addr> pick(size_t k, in_addr const & except)
+   {
+      std::vector<in_addr> res;
+      for(auto const & m : members_)
+         if(m.second.state == ALIVE && !(m.first == except))
+            res.push_back(m.first);
+      std::shuffle(res.begin(), res.end(), random_);
+      if(res.size() > k)
+         res.resize(k);
+      return res;
+   }
+
+   void send(in_addr const & to, type_t type, uint32_t seq, in_addr const & target)
+   {
+      // the least spread updates first
+      std::vector<gossip_t*> pending;
+      for(auto & g : gossip_)
+         pending.push_back(&g.second);
+      size_t n = std::min(pending.size(), (size_t)MAX_UPDATES);
+      std::partial_sort(pending.begin(), pending.begin() + n, pending.end(),
+         [](gossip_t const * a, gossip_t const * b) { return a->left > b->left; });
+
+      header_t h;
+      h.magic = MAGIC;
+      h.type = type;
+      h.updates = n;
+      h.seq = seq;
+      h.from = self_;
+      h.target = target;
+      h.incarnation = incarnation_;
+      h.hash = cb_.hash ? cb_.hash() : 0;
+
+      buf_.resize(sizeof(h) + n * sizeof(update_t));
+      memcpy(&buf_[0], &h, sizeof(h));
+      for(size_t i = 0; i < n; ++i)
+      {
+         memcpy(&buf_[sizeof(h) + i * sizeof(update_t)], &pending[i]->update, sizeof(update_t));
+         --pending[i]->left;
+      }
+      for(auto it = gossip_.begin(); it != gossip_.end(); )
+         if(it->second.left == 0)
+            it = gossip_.erase(it);
+         else
+            ++it;
+      if(cb_.fill)
+      {
+         size_t used = buf_.size();
+         buf_.resize(used + MAX_PAYLOAD);
+         buf_.resize(used + cb_.fill(&buf_[used], MAX_PAYLOAD));
+      }
+      cb_.send(to, &buf_[0], buf_.size());
+   }
+
+private:
+   in_addr self_;
+   in_addr group_;
+   callbacks_t cb_;
+   options_t opts_;
+   uint32_t incarnation_;
+   uint32_t seq_;
+   double next_probe_;
+   double next_announce_;
+   bool announced_;
+   std::unordered_map<in_addr, member_t, util::hasher<in_addr>> members_;
+   size_t live_;
+   std::priority_queue<deadline_t> deadlines_;
+   std::unordered_map<in_addr, gossip_t, util::hasher<in_addr>> gossip_;
+   std::vector<in_addr> order_;
+   size_t order_pos_;
+   std::vector<relay_t> relays_;
+   probe_t probe_;
+   std::minstd_rand random_;
+   std::vector<char> buf_;
+};
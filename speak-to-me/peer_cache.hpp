@@ -0,0 +1,117 @@
+#pragma once
+#include "common/logger.hpp"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include <boost/noncopyable.hpp>
+
+// The user table as of the last run, kept as a peer_list LIST so loading is
+// mapping the file and handing it to peer_list::view_t. Ages in it are as of
+// mtime. It is only a hint: a missing or broken file just means starting
+// empty, and writes go through a temp file so a crash never leaves half a one.
+struct peer_cache_t : boost::noncopyable
+{
+   // maps path if it is there
+   explicit peer_cache_t(std::string const & path)
+      : data_(NULL)
+      , size_(0)
+      , saved_(0)
+   {
+      int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+      if(fd == -1)
+      {
+         if(errno != ENOENT)
+            logger::warning() << "peer_cache: can't open " << path << ": " << strerror(errno);
+         return;
+      }
+      struct stat st;
+      if(::fstat(fd, &st) == -1 || st.st_size == 0)
+      {
+         ::close(fd);
+         return;
+      }
+      void * p = ::mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      ::close(fd);
+      if(p == MAP_FAILED)
+      {
+         logger::warning() << "peer_cache: can't map " << path << ": " << strerror(errno);
+         return;
+      }
+      data_ = static_cast<const char*>(p);
+      size_ = st.st_size;
+      saved_ = st.st_mtime;
+   }
+
+   ~peer_cache_t()
+   {
+      if(data_ != NULL)
+         ::munmap(const_cast<char*>(data_), size_);
+   }
+
+   bool empty() const
+   {
+      return data_ == NULL;
+   }
+
+   const char * data() const
+   {
+      return data_;
+   }
+
+   size_t size() const
+   {
+      return size_;
+   }
+
+   // when the ages in it were taken
+   uint32_t saved() const
+   {
+      return saved_;
+   }
+
+   static bool save(std::string const & path, std::vector<char> const & data)
+   {
+      std::string tmp = path + ".tmp";
+      int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+      if(fd == -1)
+      {
+         logger::warning() << "peer_cache: can't create " << tmp << ": " << strerror(errno);
+         return false;
+      }
+      for(size_t done = 0; done < data.size(); )
+      {
+         ssize_t res = ::write(fd, &data[done], data.size() - done);
+         if(res == -1 && errno == EINTR)
+            continue;
+         if(res == -1)
+         {
+            logger::warning() << "peer_cache: can't write " << tmp << ": " << strerror(errno);
+            ::close(fd);
+            ::unlink(tmp.c_str());
+            return false;
+         }
+         done += res;
+      }
+      ::close(fd);
+      if(::rename(tmp.c_str(), path.c_str()) == -1)
+      {
+         logger::warning() << "peer_cache: can't replace " << path << ": " << strerror(errno);
+         ::unlink(tmp.c_str());
+         return false;
+      }
+      return true;
+   }
+
+private:
+   const char * data_;
+   size_t size_;
+   uint32_t saved_;
+};
@@ -0,0 +1,261 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "common/lz.hpp"
+
+// What sync sessions exchange: a header, then entries that each start with
+// their own size. Fields are only ever appended to an entry, so a reader takes
+// what it knows and skips the rest; a new VERSION is for changes old readers
+// must refuse. Everything is read through memcpy, nothing assumes alignment,
+// and view_t checks the whole buffer once and then hands out entries that
+// point into it. A payload may travel compressed, see pack().
+namespace peer_list
+{
+   enum
+   {
+      MAGIC = 0x4c32,
+      VERSION = 1,
+      PACKED_MAGIC = 0x5a4c, // util::lz block follows
+      MAX_UNPACKED = 64 << 20,
+   };
+
+   // a digest entry may carry them after the version, the sender's own does
+   enum flags_t
+   {
+      CAN_UNPACK = 1, // the sender takes packed lists
+   };
+
+   enum kind_t
+   {
+      DIGEST = 1, // ip, version
+      LIST,       // whole user entries
+   };
+
+   struct error : std::runtime_error
+   {
+      error(std::string const & what)
+         : std::runtime_error(what)
+      {
+      }
+   };
+
+#pragma pack(push, 1)
+   struct header_t
+   {
+      uint16_t magic;
+      uint8_t version;
+      uint8_t kind;
+      uint32_t count;
+   };
+
+   struct packed_header_t
+   {
+      uint16_t magic;
+      uint32_t size; // unpacked
+   };
+#pragma pack(pop)
+
+   template<class T>
+   T load(const char * p)
+   {
+      T res;
+      memcpy(&res, p, sizeof(T));
+      return res;
+   }
+
+   template<class T>
+   char * store(char * p, T const & x)
+   {
+      memcpy(p, &x, sizeof(T));
+      return p + sizeof(T);
+   }
+
+   // bytes before the nick, by kind, counting the entry's own size field
+   inline size_t fixed_size(kind_t kind)
+   {
+      return kind == DIGEST ? 2 + 4 + 4 : 2 + 4 + 4 + 4 + 4 + 2 + 2;
+   }
+
+   struct entry_t
+   {
+      in_addr ip;
+      uint32_t version;
+      // DIGEST only, 0 unless the entry has them
+      uint32_t flags;
+      // LIST only
+      int32_t age;        // secs since last heard of, by the sender's clock
+      in_addr room_address;
+      uint16_t room_port;
+      const char * nick;  // into the buffer, not terminated
+      uint16_t nick_len;
+   };
+
+   struct writer_t
+   {
+      writer_t(std::vector<char> & data, kind_t kind)
+         : data_(data)
+         , start_(data.size())
+         , count_(0)
+      {
+         header_t h;
+         h.magic = MAGIC;
+         h.version = VERSION;
+         h.kind = kind;
+         h.count = 0;
+         data_.resize(start_ + sizeof(h));
+         store(&data_[start_], h);
+      }
+
+      void digest(in_addr const & ip, uint32_t version, uint32_t flags = 0)
+      {
+         uint16_t size = fixed_size(DIGEST) + (flags ? sizeof(flags) : 0);
+         char * p = grow(size);
+         p = store(p, size);
+         p = store(p, ip);
+         p = store(p, version);
+         if(flags)
+            store(p, flags);
+      }
+
+      void user(in_addr const & ip, uint32_t version, int32_t age, in_addr const & room_address, uint16_t room_port, std::string const & nick)
+      {
+         uint16_t nick_len = std::min(nick.size(), (size_t)UINT16_MAX - fixed_size(LIST));
+         uint16_t size = fixed_size(LIST) + nick_len;
+         char * p = grow(size);
+         p = store(p, size);
+         p = store(p, ip);
+         p = store(p, version);
+         p = store(p, age);
+         p = store(p, room_address);
+         p = store(p, room_port);
+         p = store(p, nick_len);
+         memcpy(p, nick.data(), nick_len);
+      }
+
+      size_t count() const
+      {
+         return count_;
+      }
+
+   private:
+      char * grow(size_t size)
+      {
+         size_t at = data_.size();
+         data_.resize(at + size);
+         ++count_;
+         store(&data_[start_] + offsetof(header_t, count), count_);
+         return &data_[at];
+      }
+
+   private:
+      std::vector<char> & data_;
+      size_t start_;
+      uint32_t count_;
+   };
+
+   struct view_t
+   {
+      // throws error unless the whole buffer is a well formed list of that kind
+      view_t(const char * data, size_t size, kind_t kind)
+         : kind_(kind)
+         , pos_(data + sizeof(header_t))
+         , left_(0)
+      {
+         if(size < sizeof(header_t))
+            throw error("peer list: truncated header");
+         header_t h = load<header_t>(data);
+         if(h.magic != MAGIC)
+            throw error("peer list: unknown format");
+         if(h.version == 0 || h.version > VERSION)
+            throw error("peer list: unsupported version");
+         if(h.kind != kind)
+            throw error("peer list: unexpected kind");
+         const char * p = pos_;
+         const char * end = data + size;
+         for(uint32_t i = 0; i < h.count; ++i)
+         {
+            if(end - p < 2)
+               throw error("peer list: truncated entry");
+            uint16_t entry = load<uint16_t>(p);
+            if(entry < fixed_size(kind) || end - p < entry)
+               throw error("peer list: bad entry size");
+            if(kind == LIST && fixed_size(LIST) + load<uint16_t>(p + fixed_size(LIST) - 2) > entry)
+               throw error("peer list: bad nick size");
+            p += entry;
+         }
+         if(p != end)
+            throw error("peer list: trailing bytes");
+         left_ = h.count;
+      }
+
+      size_t size() const
+      {
+         return left_;
+      }
+
+      bool next(entry_t & e)
+      {
+         if(left_ == 0)
+            return false;
+         --left_;
+         const char * p = pos_;
+         uint16_t size = load<uint16_t>(p);
+         pos_ += size;
+         p += 2;
+         e.ip = load<in_addr>(p);
+         e.version = load<uint32_t>(p + 4);
+         if(kind_ == DIGEST)
+         {
+            e.flags = size >= fixed_size(DIGEST) + sizeof(e.flags) ? load<uint32_t>(p + 8) : 0;
+            return true;
+         }
+         e.age = load<int32_t>(p + 8);
+         e.room_address = load<in_addr>(p + 12);
+         e.room_port = load<uint16_t>(p + 16);
+         e.nick_len = load<uint16_t>(p + 18);
+         e.nick = p + 20;
+         return true;
+      }
+
+   private:
+      kind_t kind_;
+      const char * pos_;
+      uint32_t left_;
+   };
+
+   // replaces data with its packed form when that is smaller
+   inline void pack(std::vector<char> & data)
+   {
+      std::vector<char> res(sizeof(packed_header_t));
+      packed_header_t h;
+      h.magic = PACKED_MAGIC;
+      h.size = data.size();
+      store(&res[0], h);
+      util::lz::compress(&data[0], data.size(), res);
+      if(res.size() < data.size())
+         data.swap(res);
+   }
+
+   // a packed payload is unpacked into scratch, which the result then points to
+   inline std::pair<const char *, size_t> unpack(std::vector<char> const & data, std::vector<char> & scratch)
+   {
+      if(data.size() < sizeof(packed_header_t) || load<uint16_t>(&data[0]) != PACKED_MAGIC)
+         return std::make_pair(data.empty() ? NULL : &data[0], data.size());
+      packed_header_t h = load<packed_header_t>(&data[0]);
+      if(h.size > MAX_UNPACKED)
+         throw error("peer list: packed payload too big");
+      scratch.resize(h.size);
+      if(!util::lz::decompress(&data[sizeof(h)], data.size() - sizeof(h), scratch.empty() ? NULL : &scratch[0], h.size))
+         throw error("peer list: bad packed payload");
+      return std::make_pair(scratch.empty() ? NULL : &scratch[0], scratch.size());
+   }
+}
@@ -0,0 +1,140 @@
+#pragma once
+#include "codec.hpp"
+#include "rtp.hpp"
+
+#include <boost/noncopyable.hpp>
+
+// Sender side congestion control over a ladder of encodings. Receiver reports
+// (loss, RTT growth over the path's floor) and our own send backlog step the
+// sender down, at most once per HOLD_DOWN; a quiet UP_HOLD steps it back up.
+// A step up that is punished right away doubles the wait before the next one,
+// so a link at its limit settles instead of oscillating. Runs on the input
+// thread, so it doesn't log: every call tells whether the level changed, and
+// reason() why.
+struct rate_control_t : boost::noncopyable
+{
+   enum
+   {
+      LEVELS = 4,
+      LOSS_HIGH = 10, // %, step down
+      HOLD_DOWN = 2,  // s between steps down
+      UP_HOLD = 15,   // s without congestion before a step up
+      MAX_UP_HOLD = 240,
+   };
+
+   enum reason_t
+   {
+      LOSS,
+      RTT,
+      BACKLOG,
+      QUIET, // up_hold() without congestion
+   };
+
+   rate_control_t()
+      : level_(0)
+      , last_change_(0)
+      , last_raise_(0)
+      , last_congestion_(0)
+      , up_hold_(UP_HOLD)
+      , min_rtt_(0)
+      , reason_(QUIET)
+   {
+   }
+
+   codec::encoding_t encoding() const
+   {
+      static const codec::encoding_t ladder[LEVELS] =
+      {
+         {1, 8, 1}, // as without adaptation, ~50 kbit/s
+         {2, 8, 1},
+         {2, 4, 2}, // half the packet rate
+         {4, 4, 2}, // ~6 kbit/s
+      };
+      return ladder[level_];
+   }
+
+   size_t level() const
+   {
+      return level_;
+   }
+
+   // of the last change
+   reason_t reason() const
+   {
+      return reason_;
+   }
+
+   double up_hold() const
+   {
+      return up_hold_;
+   }
+
+   static const char * name(reason_t reason)
+   {
+      static const char * names[] = {"loss", "rtt", "backlog", "quiet"};
+      return names[reason];
+   }
+
+   // a receiver's report about us; true if the level changed
+   bool on_report(rtp::report_t const & report, double now)
+   {
+      bool inflated = false;
+      if(report.rtt > 0)
+      {
+         if(min_rtt_ == 0 || report.rtt < min_rtt_)
+            min_rtt_ = report.rtt;
+         inflated = report.rtt > min_rtt_ * 2 + 0.1;
+      }
+      if(report.fraction_lost * 100 > LOSS_HIGH || inflated)
+         return congestion(now, inflated ? RTT : LOSS);
+      return false;
+   }
+
+   // frames piling up in front of the socket
+   bool on_backlog(double now)
+   {
+      return congestion(now, BACKLOG);
+   }
+
+   // steps up after a quiet period
+   bool tick(double now)
+   {
+      if(level_ == 0 || now - last_congestion_ < up_hold_ || now - last_change_ < up_hold_)
+         return false;
+      change(level_ - 1, now, QUIET);
+      return true;
+   }
+
+private:
+   bool congestion(double now, reason_t why)
+   {
+      // punished right after probing up: wait longer next time
+      if(now - last_change_ < up_hold_ && last_raise_ == last_change_ && last_change_ != 0)
+         up_hold_ = std::min(up_hold_ * 2, (double)MAX_UP_HOLD);
+      else if(now - last_congestion_ > MAX_UP_HOLD)
+         up_hold_ = UP_HOLD;
+      last_congestion_ = now;
+      if(level_ + 1 == LEVELS || now - last_change_ < HOLD_DOWN)
+         return false;
+      change(level_ + 1, now, why);
+      return true;
+   }
+
+   void change(size_t level, double now, reason_t why)
+   {
+      if(level < level_)
+         last_raise_ = now;
+      level_ = level;
+      last_change_ = now;
+      reason_ = why;
+   }
+
+private:
+   size_t level_;
+   double last_change_;
+   double last_raise_;
+   double last_congestion_;
+   double up_hold_;
+   double min_rtt_;
+   reason_t reason_;
+};
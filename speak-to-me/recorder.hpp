@@ -0,0 +1,267 @@
+#pragma once
+#include "frame.hpp"
+#include "common/spsc_queue.hpp"
+#include "common/threads.hpp"
+#include "common/logger.hpp"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <vector>
+
+#include <boost/noncopyable.hpp>
+#include <boost/thread.hpp>
+
+// Room recorder. The output callback hands pooled frames over a wait-free
+// queue; a background thread batches them into WAV or raw segment files.
+struct recorder_t : boost::noncopyable
+{
+   enum format_t
+   {
+      WAV,
+      RAW, // signed 8-bit PCM, as on the wire
+   };
+
+   struct options_t
+   {
+      options_t()
+         : prefix("record")
+         , format(WAV)
+         , segment_secs(600)
+         , per_source(false)
+         , sample_rate(0)
+      {
+      }
+
+      std::string prefix;
+      format_t format;
+      size_t segment_secs;
+      bool per_source;    // a track per sender next to the mix
+      size_t sample_rate; // filled in by streamer_t
+   };
+
+   static const size_t QUEUE_SIZE = 128; // frames
+   static const size_t WRITE_BATCH = 32;
+   static const useconds_t IDLE_SLEEP = 20000;
+   static const size_t WAV_HEADER_SIZE = 44;
+
+   explicit recorder_t(options_t const & opts)
+      : opts_(opts)
+      , queue_(QUEUE_SIZE)
+      , dropped_(0)
+      , stop_(false)
+   {
+      assert(opts_.sample_rate != 0);
+      time_t now = ::time(NULL);
+      char stamp[32];
+      strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", localtime(&now));
+      stamp_ = stamp;
+      thread_ = boost::thread(&recorder_t::run, this);
+   }
+
+   ~recorder_t()
+   {
+      stop_ = true;
+      thread_.join();
+   }
+
+   bool per_source() const
+   {
+      return opts_.per_source;
+   }
+
+   // realtime side: never blocks; false if the writer is behind and the frame is dropped
+   bool push(frame_ptr const & frame, in_addr const * source = NULL)
+   {
+      entry_t e;
+      e.frame = frame;
+      e.mixed = (source == NULL);
+      if(source)
+         e.source = *source;
+      if(queue_.push(std::move(e)))
+         return true;
+      ++dropped_;
+      return false;
+   }
+
+private:
+   struct entry_t
+   {
+      frame_ptr frame;
+      in_addr source;
+      bool mixed;
+   };
+
+   struct track_t
+   {
+      track_t()
+         : fd(-1)
+         , written(0)
+         , index(0)
+      {
+      }
+
+      std::string name;
+      int fd;
+      size_t written; // payload bytes in the current segment
+      size_t index;
+      std::vector<char> staging;
+   };
+
+   size_t segment_bytes() const
+   {
+      return opts_.segment_secs * opts_.sample_rate;
+   }
+
+   void open_segment(track_t & t)
+   {
+      std::stringstream ss;
+      ss << opts_.prefix << "-" << stamp_ << "-" << t.name << "-" << t.index << (opts_.format == WAV ? ".wav" : ".raw");
+      t.fd = ::open(ss.str().c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      if(t.fd == -1)
+      {
+         logger::error() << "recorder::open_segment: " << ss.str() << ": " << strerror(errno);
+         return;
+      }
+      size_t header = opts_.format == WAV ? WAV_HEADER_SIZE : 0;
+      // reserve extents up front so appends don't fragment or stall on allocation
+      if(::fallocate(t.fd, FALLOC_FL_KEEP_SIZE, 0, header + segment_bytes()) == -1)
+         logger::debug() << "recorder::open_segment: no preallocation: " << strerror(errno);
+      if(opts_.format == WAV)
+      {
+         write_wav_header(t.fd, 0);
+         ::lseek(t.fd, WAV_HEADER_SIZE, SEEK_SET);
+      }
+      t.written = 0;
+      logger::debug() << "recorder::open_segment: " << ss.str();
+   }
+
+   void close_segment(track_t & t)
+   {
+      if(t.fd == -1)
+         return;
+      if(opts_.format == WAV)
+         write_wav_header(t.fd, t.written);
+      ::close(t.fd);
+      t.fd = -1;
+      ++t.index;
+   }
+
+   void write_wav_header(int fd, uint32_t data_size)
+   {
+      char h[WAV_HEADER_SIZE];
+      uint32_t riff_size = 36 + data_size;
+      uint32_t fmt_size = 16;
+      uint16_t pcm = 1, channels = 1, align = 1, bits = 8;
+      uint32_t rate = opts_.sample_rate;
+      memcpy(h, "RIFF", 4);
+      memcpy(h + 4, &riff_size, 4);
+      memcpy(h + 8, "WAVEfmt ", 8);
+      memcpy(h + 16, &fmt_size, 4);
+      memcpy(h + 20, &pcm, 2);
+      memcpy(h + 22, &channels, 2);
+      memcpy(h + 24, &rate, 4);
+      memcpy(h + 28, &rate, 4); // byte rate
+      memcpy(h + 32, &align, 2);
+      memcpy(h + 34, &bits, 2);
+      memcpy(h + 36, "data", 4);
+      memcpy(h + 40, &data_size, 4);
+      if(::pwrite(fd, h, sizeof(h), 0) != (ssize_t)sizeof(h))
+         logger::error() << "recorder::write_wav_header: " << strerror(errno);
+   }
+
+   void append(track_t & t, frame_t const & frame)
+   {
+      size_t offset = t.staging.size();
+      t.staging.resize(offset + frame_t::DATA_SIZE);
+      if(opts_.format == WAV)
+         for(size_t i = 0; i < frame_t::DATA_SIZE; ++i)
+            t.staging[offset + i] = frame.data[i] ^ 0x80; // 8-bit WAV is unsigned
+      else
+         memcpy(&t.staging[offset], frame.data, frame_t::DATA_SIZE);
+   }
+
+   void flush(track_t & t)
+   {
+      size_t offset = 0;
+      while(offset < t.staging.size())
+      {
+         if(t.fd != -1 && t.written == segment_bytes())
+            close_segment(t);
+         if(t.fd == -1)
+         {
+            open_segment(t);
+            if(t.fd == -1)
+               break;
+         }
+         size_t cnt = std::min(t.staging.size() - offset, segment_bytes() - t.written);
+         ssize_t res = ::write(t.fd, &t.staging[offset], cnt);
+         if(res == -1)
+         {
+            logger::error() << "recorder::flush: " << strerror(errno);
+            break;
+         }
+         offset += res;
+         t.written += res;
+      }
+      t.staging.clear();
+   }
+
+   track_t & track(entry_t const & e)
+   {
+      uint32_t key = e.mixed ? 0 : e.source.s_addr;
+      track_t & t = tracks_[key];
+      if(t.name.empty())
+         t.name = e.mixed ? std::string("mix") : std::string(inet_ntoa(e.source));
+      return t;
+   }
+
+   void run()
+   {
+      util::configure_thread("recorder");
+      std::vector<track_t*> touched;
+      size_t reported = 0;
+      while(true)
+      {
+         touched.clear();
+         entry_t e;
+         for(size_t i = 0; i < WRITE_BATCH && queue_.pop(e); ++i)
+         {
+            track_t & t = track(e);
+            if(t.staging.empty())
+               touched.push_back(&t);
+            append(t, *e.frame);
+            e.frame.reset();
+         }
+         for(track_t * t : touched)
+            flush(*t);
+
+         if(dropped_ != reported)
+         {
+            reported = dropped_;
+            logger::warning() << "recorder::run: dropped frames: " << reported;
+         }
+         if(touched.empty())
+         {
+            if(stop_)
+               break;
+            usleep(IDLE_SLEEP);
+         }
+      }
+      for(auto & t : tracks_)
+         close_segment(t.second);
+   }
+
+private:
+   options_t opts_;
+   std::string stamp_;
+   util::spsc_queue_t<entry_t> queue_;
+   std::map<uint32_t, track_t> tracks_; // writer thread only, 0 is the mix
+   std::atomic<size_t> dropped_;
+   std::atomic<bool> stop_;
+   boost::thread thread_;
+};
@@ -0,0 +1,60 @@
+#pragma once
+#include <stdint.h>
+#include <netinet/in.h>
+
+// Wire format between speak-to-me clients and the relay daemon.
+// Every datagram to the relay starts with header_t; DATA payloads are
+// forwarded to the other members of the room behind forward_t instead, which
+// tells them who the payload came from.
+namespace s2m
+{
+namespace relay_proto
+{
+   uint16_t DEFAULT_PORT = 12122;
+
+   uint32_t KEEPALIVE_PERIOD = 2;   // secs between JOINs from a member
+   uint32_t SUBSCRIBER_TIMEOUT = 8; // relay forgets members silent for N secs
+
+   enum
+   {
+      MAGIC = 0x72326d73, // "s2mr"
+      MAX_DATAGRAM = 2048,
+   };
+
+   enum command_t
+   {
+      JOIN = 1,
+      LEAVE,
+      DATA,
+   };
+
+#pragma pack(push, 1)
+   struct header_t
+   {
+      uint32_t magic;
+      uint8_t cmd;
+      in_addr room_address;
+      uint16_t room_port; // network order
+   };
+
+   struct forward_t
+   {
+      in_addr source;       // the member that sent it, as the relay saw it
+      uint16_t source_port; // network order
+   };
+#pragma pack(pop)
+
+   inline void make_header(header_t & h, command_t cmd, in_addr const & room_address, uint16_t room_port)
+   {
+      h.magic = htonl(MAGIC);
+      h.cmd = cmd;
+      h.room_address = room_address;
+      h.room_port = htons(room_port);
+   }
+
+   inline bool check_header(header_t const & h)
+   {
+      return ntohl(h.magic) == MAGIC && h.cmd >= JOIN && h.cmd <= DATA;
+   }
+}
+}
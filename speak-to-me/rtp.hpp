@@ -0,0 +1,348 @@
+#pragma once
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <endian.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+
+#include <vector>
+
+// RTP/RTCP (RFC 3550) helpers for streamer_t's optional RTP framing.
+namespace rtp
+{
+   enum
+   {
+      VERSION = 2,
+      PAYLOAD_TYPE = 96, // dynamic: 8-bit signed PCM, mono
+      PACKED_PAYLOAD_TYPE = 97, // codec::rtp_header_t, then reduced frames
+
+      RTCP_SR = 200,
+      RTCP_RR = 201,
+
+      MAX_REPORT_BLOCKS = 31,
+
+      TIMING_PROFILE = 0x5332, // header extension carrying frame_t::timing_t
+   };
+
+#pragma pack(push, 1)
+   struct header_t
+   {
+      uint8_t  vpxcc;   // version(2) padding(1) extension(1) csrc count(4)
+      uint8_t  mpt;     // marker(1) payload type(7)
+      uint16_t seq;
+      uint32_t ts;
+      uint32_t ssrc;
+   };
+
+   // RFC 3550 5.3.1 header extension
+   struct timing_ext_t
+   {
+      uint16_t profile;
+      uint16_t length;  // in 32-bit words, without this word
+      uint64_t capture; // us, sender's wall clock
+      uint64_t sent;
+   };
+
+   struct rtcp_header_t
+   {
+      uint8_t  vprc;    // version(2) padding(1) report count(5)
+      uint8_t  pt;
+      uint16_t length;  // in 32-bit words minus one
+      uint32_t ssrc;
+   };
+
+   struct sender_info_t
+   {
+      uint32_t ntp_sec;
+      uint32_t ntp_frac;
+      uint32_t rtp_ts;
+      uint32_t packets;
+      uint32_t octets;
+   };
+
+   struct report_block_t
+   {
+      uint32_t ssrc;
+      uint32_t lost;    // fraction lost(8) cumulative lost(24)
+      uint32_t ext_seq;
+      uint32_t jitter;
+      uint32_t lsr;
+      uint32_t dlsr;
+   };
+#pragma pack(pop)
+
+   struct ntp_time_t
+   {
+      uint32_t sec;
+      uint32_t frac;
+
+      uint32_t middle() const
+      {
+         return (sec << 16) | (frac >> 16);
+      }
+   };
+
+   inline ntp_time_t ntp_now()
+   {
+      timeval tv;
+      ::gettimeofday(&tv, NULL);
+      ntp_time_t res;
+      res.sec = tv.tv_sec + 2208988800u;
+      res.frac = (uint32_t)(((uint64_t)tv.tv_usec << 32) / 1000000);
+      return res;
+   }
+
+   inline uint64_t ntp_to_unix_us(ntp_time_t const & t)
+   {
+      return (uint64_t)(t.sec - 2208988800u) * 1000000 + (((uint64_t)t.frac * 1000000) >> 32);
+   }
+
+   // in seconds, for arrival times and report intervals
+   inline double monotonic_now()
+   {
+      timespec ts;
+      ::clock_gettime(CLOCK_MONOTONIC, &ts);
+      return ts.tv_sec + ts.tv_nsec * 1e-9;
+   }
+
+   inline void make_header(header_t & h, uint16_t seq, uint32_t ts, uint32_t ssrc, bool extension = false,
+                           uint8_t payload_type = PAYLOAD_TYPE)
+   {
+      h.vpxcc = VERSION << 6 | (extension ? 0x10 : 0);
+      h.mpt = payload_type;
+      h.seq = htons(seq);
+      h.ts = htonl(ts);
+      h.ssrc = htonl(ssrc);
+   }
+
+   inline bool check_header(header_t const & h)
+   {
+      return (h.vpxcc >> 6) == VERSION && ((h.mpt & 0x7f) == PAYLOAD_TYPE || (h.mpt & 0x7f) == PACKED_PAYLOAD_TYPE);
+   }
+
+   inline bool packed(header_t const & h)
+   {
+      return (h.mpt & 0x7f) == PACKED_PAYLOAD_TYPE;
+   }
+
+   inline bool has_extension(header_t const & h)
+   {
+      return (h.vpxcc & 0x10) != 0;
+   }
+
+   inline void make_timing_ext(timing_ext_t & ext, uint64_t capture, uint64_t sent)
+   {
+      ext.profile = htons(TIMING_PROFILE);
+      ext.length = htons((sizeof(ext) - 4) / 4);
+      ext.capture = htobe64(capture);
+      ext.sent = htobe64(sent);
+   }
+
+   // false for extensions we don't know
+   inline bool parse_timing_ext(timing_ext_t const & ext, uint64_t & capture, uint64_t & sent)
+   {
+      if(ntohs(ext.profile) != TIMING_PROFILE || ntohs(ext.length) != (sizeof(ext) - 4) / 4)
+         return false;
+      capture = be64toh(ext.capture);
+      sent = be64toh(ext.sent);
+      return true;
+   }
+
+   // per remote sender reception state, RFC 3550 A.1, A.3, A.8
+   struct source_stats_t
+   {
+      enum
+      {
+         MAX_DROPOUT = 3000,
+         MAX_MISORDER = 100,
+         MIN_SEQUENTIAL = 2,
+         SEQ_MOD = 1 << 16,
+      };
+
+      source_stats_t()
+         : max_seq(0), cycles(0), base_seq(0), bad_seq(SEQ_MOD + 1)
+         , probation(MIN_SEQUENTIAL), received(0)
+         , expected_prior(0), received_prior(0)
+         , transit(0), jitter(0), lsr(0), last_sr_time(0)
+         , last_rtp(0), last_heard(0)
+      {
+      }
+
+      void init_seq(uint16_t seq)
+      {
+         base_seq = seq;
+         max_seq = seq;
+         bad_seq = SEQ_MOD + 1;
+         cycles = 0;
+         received = 0;
+         received_prior = 0;
+         expected_prior = 0;
+      }
+
+      // returns false if the packet should be treated as invalid
+      bool update_seq(uint16_t seq)
+      {
+         uint16_t udelta = seq - max_seq;
+
+         if(probation)
+         {
+            if(seq == (uint16_t)(max_seq + 1))
+            {
+               --probation;
+               max_seq = seq;
+               if(probation == 0)
+               {
+                  init_seq(seq);
+                  ++received;
+                  return true;
+               }
+            }
+            else
+            {
+               probation = MIN_SEQUENTIAL - 1;
+               max_seq = seq;
+            }
+            return false;
+         }
+         else if(udelta < MAX_DROPOUT)
+         {
+            if(seq < max_seq)
+               cycles += SEQ_MOD;
+            max_seq = seq;
+         }
+         else if(udelta <= SEQ_MOD - MAX_MISORDER)
+         {
+            if(seq == bad_seq)
+               init_seq(seq); // other side restarted
+            else
+            {
+               bad_seq = (seq + 1) & (SEQ_MOD - 1);
+               return false;
+            }
+         }
+         ++received;
+         return true;
+      }
+
+      // arrival and ts in the same timestamp units
+      void update_jitter(uint32_t arrival, uint32_t ts)
+      {
+         int32_t t = arrival - ts;
+         int32_t d = t - transit;
+         transit = t;
+         if(d < 0)
+            d = -d;
+         jitter += (1./16.) * ((double)d - jitter);
+      }
+
+      void on_sender_report(ntp_time_t const & ntp)
+      {
+         lsr = ntp.middle();
+         last_sr_time = monotonic_now();
+      }
+
+      uint32_t extended_max() const
+      {
+         return cycles + max_seq;
+      }
+
+      void make_report(report_block_t & rb, uint32_t ssrc)
+      {
+         uint32_t expected = extended_max() - base_seq + 1;
+         int32_t lost = expected - received;
+         if(lost > 0x7fffff)
+            lost = 0x7fffff;
+         else if(lost < -0x800000)
+            lost = -0x800000;
+
+         uint32_t expected_interval = expected - expected_prior;
+         expected_prior = expected;
+         uint32_t received_interval = received - received_prior;
+         received_prior = received;
+         int32_t lost_interval = expected_interval - received_interval;
+         uint8_t fraction = 0;
+         if(expected_interval != 0 && lost_interval > 0)
+            fraction = (lost_interval << 8) / expected_interval;
+
+         uint32_t dlsr = 0;
+         if(lsr != 0)
+            dlsr = (uint32_t)((monotonic_now() - last_sr_time) * 65536);
+
+         rb.ssrc = htonl(ssrc);
+         rb.lost = htonl(((uint32_t)fraction << 24) | (lost & 0xffffff));
+         rb.ext_seq = htonl(extended_max());
+         rb.jitter = htonl((uint32_t)jitter);
+         rb.lsr = htonl(lsr);
+         rb.dlsr = htonl(dlsr);
+      }
+
+      uint16_t max_seq;
+      uint32_t cycles;
+      uint32_t base_seq;
+      uint32_t bad_seq;
+      uint32_t probation;
+      uint32_t received;
+      uint32_t expected_prior;
+      uint32_t received_prior;
+      int32_t transit;
+      double jitter;
+      uint32_t lsr;
+      double last_sr_time;
+      double last_rtp;   // monotonic_now() of its last data packet
+      double last_heard; // ... of its last packet of any kind, RFC 3550 6.3.5
+   };
+
+   // what a receiver told us about our stream
+   struct report_t
+   {
+      uint32_t reporter;
+      double fraction_lost;    // 0..1 since the previous report
+      int32_t cumulative_lost;
+      uint32_t ext_seq;
+      double jitter;           // seconds
+      double rtt;              // seconds, 0 if unknown
+   };
+
+   inline void parse_report(report_block_t const & rb, uint32_t reporter, double clock_rate, report_t & res)
+   {
+      uint32_t lost = ntohl(rb.lost);
+      res.reporter = reporter;
+      res.fraction_lost = (lost >> 24) / 256.;
+      res.cumulative_lost = (int32_t)(lost << 8) >> 8;
+      res.ext_seq = ntohl(rb.ext_seq);
+      res.jitter = ntohl(rb.jitter) / clock_rate;
+      res.rtt = 0;
+      uint32_t lsr = ntohl(rb.lsr);
+      if(lsr != 0)
+      {
+         uint32_t rtt = ntp_now().middle() - lsr - ntohl(rb.dlsr);
+         res.rtt = rtt / 65536.;
+      }
+   }
+
+   // compound SR/RR: sender info is written only if `sender` is set
+   inline size_t make_rtcp(std::vector<char> & buf, uint32_t ssrc, sender_info_t const * sender,
+                           std::vector<report_block_t> const & blocks)
+   {
+      size_t cnt = blocks.size() < MAX_REPORT_BLOCKS ? blocks.size() : MAX_REPORT_BLOCKS;
+      size_t size = sizeof(rtcp_header_t) + (sender ? sizeof(sender_info_t) : 0) + cnt * sizeof(report_block_t);
+      buf.resize(size);
+      rtcp_header_t h;
+      h.vprc = (VERSION << 6) | cnt;
+      h.pt = sender ? RTCP_SR : RTCP_RR;
+      h.length = htons(size / 4 - 1);
+      h.ssrc = htonl(ssrc);
+      size_t offset = 0;
+      memcpy(&buf[offset], &h, sizeof(h));
+      offset += sizeof(h);
+      if(sender)
+      {
+         memcpy(&buf[offset], sender, sizeof(sender_info_t));
+         offset += sizeof(sender_info_t);
+      }
+      if(cnt)
+         memcpy(&buf[offset], &blocks[0], cnt * sizeof(report_block_t));
+      return size;
+   }
+}
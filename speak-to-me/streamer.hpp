@@ -1,11 +1,28 @@
 #pragma once
 #include "common/udp.hpp"
 #include "common/net_stuff.hpp"
-#include <list>
+#include "common/threads.hpp"
+#include "rtp.hpp"
+#include "channel.hpp"
+#include "frame.hpp"
+#include "recorder.hpp"
+#include "watchdog.hpp"
+#include "latency.hpp"
+#include "codec.hpp"
+#include "rate_control.hpp"
+#include "local_link.hpp"
+#include "common/spsc_queue.hpp"
+#include "common/flat_map.hpp"
+#include <memory>
+#include <atomic>
 #include <stk/RtAudio.h>
 #include <boost/optional.hpp>
 #include <boost/utility/in_place_factory.hpp>
+#include <boost/function.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
 #include <unordered_map>
+#include <unistd.h>
 
 struct streamer_t
 {
@@ -21,22 +38,82 @@ struct streamer_t
    static const size_t MAX_QUEUE = 5;
    static const size_t ACCEPTABLE_SYN_DESYNC = 5;
    static const size_t DOWN_SAMPLE = 7;
+   static const size_t RTCP_INTERVAL = 5; // secs
+   static const size_t MAX_DATAGRAM = 1500;
+   static const size_t POOL_SIZE = 512; // frames, shared by all queues, rooms and the recorder
+   static const size_t TRACE_QUEUE = 1024; // records per audio thread between export_stats() calls
+   static const size_t MAX_SOURCES = 64; // RTP senders tracked per room, later ones go unreported
+   static const size_t SENDER_TIMEOUT = 2; // RTCP intervals without data before a source goes unreported
+   static const size_t SOURCE_TIMEOUT = 5; // ... without anything before it's forgotten
+
+   enum framing_t
+   {
+      NATIVE_FRAMING,
+      RTP_FRAMING, // RTP header on data port, RTCP SR/RR on data port + 1
+   };
+
+   typedef
+      boost::function<void(rtp::report_t const &)>
+      report_handler_t;
 
    streamer_t() // dummy
-   {}
+      : pool_(0)
+      , set_(new room_set_t)
+      , reports_(1)
+      , in_traces_(1)
+      , out_traces_(1)
+      , traces_dropped_(0)
+   {
+      init_buffers();
+   }
 
-   streamer_t(in_addr const & host, uint16_t port)
-      : syn_(0)
+   // audio engine without rooms, see join_room
+   explicit streamer_t(framing_t framing)
+      : framing_(framing)
+      , pool_(POOL_SIZE)
+      , set_(new room_set_t)
+      , last_room_id_(0)
       , internal_offset_(0)
+      , sending_to_(0)
+      , out_set_(NULL)
+      , ssrc_(::time(NULL) ^ (::getpid() << 16) ^ (uint32_t)(uintptr_t)this)
+      , rtp_seq_(ssrc_ >> 16)
+      , packets_sent_(0)
+      , octets_sent_(0)
+      , timestamps_(false)
+      , in_latency_(0)
+      , out_latency_(0)
+      , reports_(16)
+      , in_traces_(TRACE_QUEUE)
+      , out_traces_(TRACE_QUEUE)
+      , traces_dropped_(0)
    {
-      data_source_.connect(host, port);
-      data_source_.join_group(true);
-      data_source_.set_echo(true);
-      data_source_.bind();
+      init_buffers();
+   }
 
-      input_frame_.offset = 0;
-      output_frame_.offset = frame_t::DATA_SIZE;
-      //input_frame_.source = local_address_;
+   streamer_t(in_addr const & host, uint16_t port, framing_t framing = NATIVE_FRAMING,
+              boost::optional<sockaddr_in> const & relay = boost::none)
+      : framing_(framing)
+      , pool_(POOL_SIZE)
+      , set_(new room_set_t)
+      , last_room_id_(0)
+      , internal_offset_(0)
+      , sending_to_(0)
+      , out_set_(NULL)
+      , ssrc_(::time(NULL) ^ (::getpid() << 16) ^ (uint32_t)(uintptr_t)this)
+      , rtp_seq_(ssrc_ >> 16)
+      , packets_sent_(0)
+      , octets_sent_(0)
+      , timestamps_(false)
+      , in_latency_(0)
+      , out_latency_(0)
+      , reports_(16)
+      , in_traces_(TRACE_QUEUE)
+      , out_traces_(TRACE_QUEUE)
+      , traces_dropped_(0)
+   {
+      init_buffers();
+      join_room(host, port, true, relay);
    }
 
    ~streamer_t()
@@ -57,6 +134,7 @@ struct streamer_t
          {
             throw error(e.getMessage());
          }
+      delete set_.load();
    }
 
    void init(size_t api = RtAudio::UNSPECIFIED)
@@ -89,6 +167,8 @@ struct streamer_t
          rtaudio_->in.startStream();
          rtaudio_->out.openStream(&outparams, (RtAudio::StreamParameters*)NULL, format, SAMPLE_RATE, &nframes, &streamer_t::callback_out, this, &opts);
          rtaudio_->out.startStream();
+         in_latency_ = rtaudio_->in.getStreamLatency() * 1e6 / SAMPLE_RATE;
+         out_latency_ = rtaudio_->out.getStreamLatency() * 1e6 / SAMPLE_RATE;
       }
       catch(RtError & e)
       {
@@ -138,66 +218,404 @@ struct streamer_t
       return devs;
    }
 
+   framing_t framing() const
+   {
+      return framing_;
+   }
 
-#pragma pack (push, 1)
-   struct frame_t
+   // called from the output callback thread for every report block about our stream
+   void set_report_handler(report_handler_t const & handler)
+   {
+      report_handler_ = handler;
+   }
+
+
+
+   // Rooms share one capture/playout device pair. Every room has its own mix
+   // bus; captured audio goes to the talk room only, if there is one.
+   void join_room(in_addr const & group, uint16_t port, bool talk,
+                  boost::optional<sockaddr_in> const & relay = boost::none)
    {
-      bool operator < (frame_t const & other) const
       {
-         return syn < other.syn;
+         lock_t __(rooms_mutex_);
+         if(find_room(*set_.load(), group, port))
+            throw std::logic_error("Already in room");
+      }
+      std::shared_ptr<room_t> room(new room_t(group, port));
+      if(relay)
+      {
+         room->own_data.reset(new channel_t(group, port, *relay));
+         room->data = room->own_data.get();
+         if(framing_ == RTP_FRAMING)
+         {
+            room->own_control.reset(new channel_t(group, port + 1, *relay));
+            room->control = room->own_control.get();
+         }
+      }
+      else
+      {
+         try
+         {
+            room->local.reset(new local_link_t(group, port));
+         }
+         catch(local_link_t::error & e)
+         {
+            logger::warning() << "streamer::join_room: no same-host link: " << e.what();
+         }
+         room->data = &shared_channel(port);
+         room->data->join(group);
+         if(framing_ == RTP_FRAMING)
+         {
+            room->control = &shared_channel(port + 1);
+            room->control->join(group);
+         }
       }
 
-      enum ftype
+      lock_t __(rooms_mutex_);
+      std::unique_ptr<room_set_t> next(new room_set_t(*set_.load()));
+      if(find_room(*next, group, port))
+         throw std::logic_error("Already in room");
+      if(talk)
       {
-         SOUND,
-      };
-      enum {DATA_SIZE = 1024};
+         if(next->talk)
+            throw std::logic_error("Already talking in other room");
+         next->talk = room.get();
+      }
+      room->id = ++last_room_id_;
+      next->rooms.push_back(room);
+      update_channels(*next);
+      publish(std::move(next));
+      logger::debug() << "streamer::join_room: " << inet_ntoa(group) << ":" << port << (talk ? " talk" : " monitor");
+   }
 
-      ftype type;
-      uint32_t syn;
-      in_addr source;
-      char data[DATA_SIZE];
-   };
-#pragma pack (pop)
+   void leave_room(in_addr const & group, uint16_t port)
+   {
+      lock_t __(rooms_mutex_);
+      std::unique_ptr<room_set_t> next(new room_set_t(*set_.load()));
+      for(auto it = next->rooms.begin(); it != next->rooms.end(); ++it)
+         if((*it)->group == group && (*it)->port == port)
+         {
+            room_t & room = **it;
+            if(!room.own_data)
+               room.data->leave(group);
+            if(room.control && !room.own_control)
+               room.control->leave(group);
+            if(next->talk == &room) // the input thread drops what it queued for it
+            {
+               room.data->set_echo(true);
+               next->talk = NULL;
+            }
+            next->rooms.erase(it);
+            update_channels(*next);
+            publish(std::move(next));
+            release_shared_channels();
+            logger::debug() << "streamer::leave_room: " << inet_ntoa(group) << ":" << port;
+            return;
+         }
+   }
+
+   size_t rooms_count() const
+   {
+      lock_t __(rooms_mutex_);
+      return set_.load()->rooms.size();
+   }
+
+   bool talking() const
+   {
+      lock_t __(rooms_mutex_);
+      return set_.load()->talk != NULL;
+   }
+
+   // records the mix (and optionally every sender) of all rooms
+   void start_recording(recorder_t::options_t opts)
+   {
+      opts.sample_rate = clock_rate();
+      std::shared_ptr<recorder_t> rec(new recorder_t(opts));
+      lock_t __(rooms_mutex_);
+      std::unique_ptr<room_set_t> next(new room_set_t(*set_.load()));
+      next->recorder = rec;
+      publish(std::move(next));
+   }
+
+   void stop_recording()
+   {
+      lock_t __(rooms_mutex_);
+      std::unique_ptr<room_set_t> next(new room_set_t(*set_.load()));
+      next->recorder.reset();
+      // writer drains and closes its files here, off the audio threads
+      publish(std::move(next));
+   }
+
+   bool recording() const
+   {
+      lock_t __(rooms_mutex_);
+      return !!set_.load()->recorder;
+   }
+
+   // stamp outgoing frames with capture/send times, for peers' latency breakdown
+   void set_timestamps(bool on)
+   {
+      timestamps_ = on;
+   }
+
+   bool timestamps() const
+   {
+      return timestamps_;
+   }
+
+   // what the callbacks traced since the last call; callback timing and per
+   // source latency, logged at most every watchdog_t::EXPORT_PERIOD
+   void export_stats()
+   {
+      trace_t t;
+      while(in_traces_.pop(t))
+         log(t);
+      while(out_traces_.pop(t))
+         log(t);
+      if(size_t dropped = traces_dropped_.exchange(0))
+         logger::trace() << "streamer::export_stats: " << dropped << " trace records dropped";
+      if(!watchdog_.export_stats())
+         return;
+      std::vector<latency_t::report_t> reports;
+      {
+         lock_t __(stats_mutex_);
+         latency_.take(reports);
+         // gone as the rooms' RTP sources go, native framing included
+         latency_.expire(latency_t::now() - (uint64_t)SOURCE_TIMEOUT * RTCP_INTERVAL * 1000000);
+      }
+      for(auto const & r : reports)
+         latency_t::log(r);
+   }
 
    struct partial_frame_t
    {
-      frame_t frame;
+      frame_ptr frame;
       size_t offset;
       size_t internal_offset;
    };
 
-   bool send_frame(partial_frame_t & frame)
+   struct room_t
+   {
+      room_t(in_addr const & group, uint16_t port)
+         : group(group)
+         , port(port)
+         , data(NULL)
+         , control(NULL)
+         , id(0)
+         , syn(0)
+         , play_syn(0)
+         , next_rtcp(0)
+         , played_syn(0)
+         , played_at(0)
+      {
+         sources.reserve(MAX_SOURCES); // the output thread never grows it
+      }
+
+      in_addr group;
+      uint16_t port;
+      channel_t * data;                     // shared multicast socket or own_data
+      channel_t * control;                  // RTCP, RTP framing only
+      std::unique_ptr<channel_t> own_data;  // relayed rooms
+      std::unique_ptr<channel_t> own_control;
+      std::unique_ptr<local_link_t> local;  // same-host members, multicast rooms only
+      frame_queue_t playback_queue;         // mix bus
+      uint32_t id;                          // tells a new talk room from a freed one at the same address
+      std::atomic<uint32_t> syn;            // next frame we capture, talk room only
+      uint32_t play_syn;                    // next frame due on the bus, output thread
+      util::flat_map_t<uint32_t, rtp::source_stats_t, util::hasher<uint32_t>> sources; // at most MAX_SOURCES
+      double next_rtcp;
+      uint32_t played_syn; // last frame taken off the bus
+      uint64_t played_at;  // latency_t::now(), 0 before the first one
+   };
+
+   // What the audio threads see of the rooms. The control side copies it,
+   // changes the copy and publishes that whole; a published one never
+   // changes, so the callbacks read it without taking a lock.
+   struct room_set_t
+   {
+      room_set_t()
+         : talk(NULL)
+      {
+      }
+
+      std::vector<std::shared_ptr<room_t>> rooms;
+      room_t * talk;
+      std::vector<channel_t*> data_channels;
+      std::vector<channel_t*> control_channels;
+      std::shared_ptr<recorder_t> recorder;
+   };
+
+   static double clock_rate()
+   {
+      return SAMPLE_RATE / (double)DOWN_SAMPLE;
+   }
+
+   size_t send_rtp(room_t & room, frame_t const & frame)
+   {
+      bool timed = frame.type == frame_t::SOUND_TIMED;
+      rtp::header_t h;
+      rtp::make_header(h, rtp_seq_++, frame.syn * frame_t::DATA_SIZE, ssrc_, timed);
+      rtp::timing_ext_t ext;
+      iovec iov[3];
+      size_t n = 0;
+      iov[n].iov_base = &h;
+      iov[n++].iov_len = sizeof(h);
+      if(timed)
+      {
+         rtp::make_timing_ext(ext, frame.timing.capture, frame.timing.sent);
+         iov[n].iov_base = &ext;
+         iov[n++].iov_len = sizeof(ext);
+      }
+      iov[n].iov_base = const_cast<char*>(frame.data);
+      iov[n++].iov_len = frame_t::DATA_SIZE;
+      size_t cnt = room.data->send(room.group, iov, n);
+      assert(cnt == sizeof(h) + (timed ? sizeof(ext) : 0) + frame_t::DATA_SIZE);
+      packets_sent_ += 1;
+      octets_sent_ += frame_t::DATA_SIZE;
+      return sizeof(frame_t);
+   }
+
+   bool send_frame(room_t & room, partial_frame_t & frame)
    {
       pollfd pfd;
-      pfd.fd = *data_source_;
+      pfd.fd = **room.data;
       pfd.events = POLLOUT;
       if(util::poll<error>(&pfd, 1, 0)) // TODO: use offset and partial writing. assert for now?
       {
-         size_t cnt = data_source_.send(&frame.frame, 1);
-         assert(cnt == sizeof(frame_t));
+         if(frame.frame->type == frame_t::SOUND_TIMED)
+            frame.frame->timing.sent = latency_t::now();
+         if(framing_ == RTP_FRAMING)
+         {
+            frame.offset += send_rtp(room, *frame.frame);
+            trace(INPUT_THREAD, trace_t::SEND_FRAME, 1);
+            return true;
+         }
+         size_t cnt = room.data->send(room.group, &*frame.frame, frame.frame->wire_size());
+         assert(cnt == frame.frame->wire_size());
          frame.offset += cnt;
-         logger::trace() << "streamer::send_frame";
+         trace(INPUT_THREAD, trace_t::SEND_FRAME);
          return true;
       }
       return false;
    }
 
-   void send_frames()
+   // native: packed_header_t, then syn [timing] payload per frame
+   size_t pack_native(codec::encoding_t const & enc, frame_ptr const * batch, size_t n, bool timed)
+   {
+      codec::packed_header_t ph;
+      ph.type = frame_t::SOUND_PACKED;
+      ph.decimation = enc.decimation;
+      ph.bits = enc.bits;
+      ph.frames = n;
+      ph.flags = timed ? codec::TIMED : 0;
+      char * p = &packet_buf_[0];
+      memcpy(p, &ph, sizeof(ph));
+      p += sizeof(ph);
+      for(size_t i = 0; i < n; ++i)
+      {
+         memcpy(p, &batch[i]->syn, sizeof(uint32_t));
+         p += sizeof(uint32_t);
+         if(timed)
+         {
+            memcpy(p, &batch[i]->timing, sizeof(frame_t::timing_t));
+            p += sizeof(frame_t::timing_t);
+         }
+         codec::encode(enc, batch[i]->data, p);
+         p += enc.payload_size();
+      }
+      return p - &packet_buf_[0];
+   }
+
+   // RTP: codec::rtp_header_t, then the payloads of consecutive frames
+   size_t pack_rtp(codec::encoding_t const & enc, frame_ptr const * batch, size_t n)
+   {
+      codec::rtp_header_t ph;
+      ph.decimation = enc.decimation;
+      ph.bits = enc.bits;
+      ph.frames = n;
+      ph.reserved = 0;
+      char * p = &packet_buf_[0];
+      memcpy(p, &ph, sizeof(ph));
+      p += sizeof(ph);
+      for(size_t i = 0; i < n; ++i, p += enc.payload_size())
+         codec::encode(enc, batch[i]->data, p);
+      return p - &packet_buf_[0];
+   }
+
+   // sends up to enc.frames queued frames in one datagram; false if it has to wait
+   bool send_packed(room_t & room, codec::encoding_t const & enc)
    {
+      if(send_queue_.size() < enc.frames)
+         return false;
+      pollfd pfd;
+      pfd.fd = **room.data;
+      pfd.events = POLLOUT;
+      if(!util::poll<error>(&pfd, 1, 0))
+         return false;
+
+      frame_ptr batch[codec::encoding_t::MAX_FRAMES];
+      size_t n = 0;
+      // a datagram only carries consecutive frames of one kind
+      while(n < enc.frames && !send_queue_.empty()
+            && (n == 0 || (send_queue_.front().syn == batch[n - 1]->syn + 1 && send_queue_.front().type == batch[0]->type)))
+         batch[n++] = send_queue_.pop_front();
+      bool timed = batch[0]->type == frame_t::SOUND_TIMED;
+      uint64_t now = timed ? latency_t::now() : 0;
+      for(size_t i = 0; i < n; ++i)
+         batch[i]->timing.sent = now;
+
+      size_t payload;
+      if(framing_ == RTP_FRAMING)
+      {
+         payload = pack_rtp(enc, batch, n);
+         rtp::header_t h;
+         rtp::make_header(h, rtp_seq_++, batch[0]->syn * frame_t::DATA_SIZE, ssrc_, timed, rtp::PACKED_PAYLOAD_TYPE);
+         rtp::timing_ext_t ext;
+         iovec iov[3];
+         size_t cnt = 0;
+         iov[cnt].iov_base = &h;
+         iov[cnt++].iov_len = sizeof(h);
+         if(timed)
+         {
+            rtp::make_timing_ext(ext, batch[0]->timing.capture, now);
+            iov[cnt].iov_base = &ext;
+            iov[cnt++].iov_len = sizeof(ext);
+         }
+         iov[cnt].iov_base = &packet_buf_[0];
+         iov[cnt++].iov_len = payload;
+         room.data->send(room.group, iov, cnt);
+      }
+      else
+      {
+         payload = pack_native(enc, batch, n, timed);
+         room.data->send(room.group, &packet_buf_[0], payload);
+      }
+      packets_sent_ += 1;
+      octets_sent_ += payload;
+      trace(INPUT_THREAD, trace_t::SEND_PACKED, n, payload);
+      return true;
+   }
+
+   void send_frames(room_t & talk)
+   {
+      codec::encoding_t enc = rate_control_.encoding();
       while(!send_queue_.empty())
       {
-         if(!send_frame_)
+         if(!send_frame_.frame && !enc.legacy())
          {
-            send_frame_ = boost::in_place();
-            send_frame_->offset = 0;
-            send_frame_->frame = send_queue_.front();
-            send_queue_.pop_front();
+            if(!send_packed(talk, enc))
+               break;
+            continue;
+         }
+         if(!send_frame_.frame)
+         {
+            send_frame_.offset = 0;
+            send_frame_.frame = send_queue_.pop_front();
          }
 
-         if(send_frame(*send_frame_))
+         if(send_frame(talk, send_frame_))
          {
-            send_frame_.reset();
+            send_frame_.frame.reset();
             continue;
          }
          else
@@ -205,107 +623,552 @@ struct streamer_t
       }
    }
 
-   void playback(frame_t const & frame)
+   void playback(room_t & room, frame_ptr const & ptr)
    {
-      if(syn_ > ACCEPTABLE_SYN_DESYNC && frame.syn < syn_ - ACCEPTABLE_SYN_DESYNC) // too late
+      frame_t const & frame = *ptr;
+      uint32_t & syn = room.play_syn;
+      frame_queue_t & queue = room.playback_queue;
+      if(syn > ACCEPTABLE_SYN_DESYNC && frame.syn < syn - ACCEPTABLE_SYN_DESYNC) // too late
       {
-         logger::warning() << "streamer::playback: dropping frame";
+         trace(OUTPUT_THREAD, trace_t::LATE_FRAME, frame.syn);
          return;
       }
-      if(frame.syn > syn_ + ACCEPTABLE_SYN_DESYNC) // i am slowpoke
+      if(frame.syn > syn + ACCEPTABLE_SYN_DESYNC) // i am slowpoke
       {
-         logger::warning() << "streamer::playback: resynchronization";
-         syn_ = frame.syn;
+         watchdog_t::mark(watchdog_t::RESYNC);
+         trace(OUTPUT_THREAD, trace_t::RESYNC, frame.syn);
+         syn = frame.syn;
       }
-      frame_queue_t::iterator it = std::lower_bound(playback_queue_.begin(), playback_queue_.end(), frame);
-      if(it == playback_queue_.end() || it->syn != frame.syn)
+      frame_t * same = queue.find_if([&frame](frame_t const & fr)->bool{return fr.syn == frame.syn;});
+      if(!same)
       {
-         playback_queue_.insert(it, frame);
+         queue.insert_sorted(ptr, std::less<frame_t>());
       }
       else
       {
          for(size_t i = 0; i < frame_t::DATA_SIZE; ++i)
-            it->data[i] = util::bound((int)it->data[i] + (int)frame.data[i], -127, 127);
+            same->data[i] = util::bound((int)same->data[i] + (int)frame.data[i], -127, 127);
+      }
+      if(syn > ACCEPTABLE_SYN_DESYNC)
+      {
+         size_t limit = syn - ACCEPTABLE_SYN_DESYNC;
+         size_t size = queue.size();
+         queue.remove_if([limit](frame_t const & fr)->bool{return fr.syn < limit;});
+         if(queue.size() != size)
+            watchdog_t::mark(watchdog_t::PURGE);
+      }
+   }
+
+   // leaves frame.offset untouched if the packet is not ours. With the timing
+   // extension the payload arrived shifted by it, and its tail landed in `tail`
+   void parse_rtp(room_t & room, rtp::header_t const & h, size_t cnt, in_addr const & sender, partial_frame_t & frame,
+                  rtp::timing_ext_t const & tail, uint64_t arrived)
+   {
+      bool timed = rtp::has_extension(h);
+      size_t header = sizeof(rtp::header_t) + (timed ? sizeof(rtp::timing_ext_t) : 0);
+      if(rtp::packed(h) ? cnt < header + sizeof(codec::rtp_header_t) : cnt != header + frame_t::DATA_SIZE)
+      {
+         trace(OUTPUT_THREAD, trace_t::BAD_SIZE, cnt);
+         return;
+      }
+      if(!rtp::check_header(h))
+      {
+         trace(OUTPUT_THREAD, trace_t::NOT_OUR_PAYLOAD);
+         return;
+      }
+      auto it = room.sources.find(ntohl(h.ssrc));
+      if(it == room.sources.end())
+      {
+         if(room.sources.size() == MAX_SOURCES)
+         {
+            trace(OUTPUT_THREAD, trace_t::TOO_MANY_SOURCES, ntohl(h.ssrc));
+            return;
+         }
+         it = room.sources.insert(std::make_pair(ntohl(h.ssrc), rtp::source_stats_t())).first;
+      }
+      rtp::source_stats_t & src = it->second;
+      double now = rtp::monotonic_now();
+      src.last_rtp = src.last_heard = now;
+      if(!src.update_seq(ntohs(h.seq)))
+      {
+         trace(OUTPUT_THREAD, trace_t::PROBATION);
+         return;
+      }
+      src.update_jitter((uint32_t)(now * clock_rate()), ntohl(h.ts));
+
+      if(rtp::packed(h))
+      {
+         unpack_rtp(room, h, frame.frame->data, cnt - sizeof(rtp::header_t), sender, arrived);
+         return;
+      }
+
+      frame.frame->type = frame_t::SOUND;
+      if(timed)
+      {
+         char * data = frame.frame->data;
+         rtp::timing_ext_t ext;
+         memcpy(&ext, data, sizeof(ext));
+         memmove(data, data + sizeof(ext), frame_t::DATA_SIZE - sizeof(ext));
+         memcpy(data + frame_t::DATA_SIZE - sizeof(ext), &tail, sizeof(ext));
+         if(rtp::parse_timing_ext(ext, frame.frame->timing.capture, frame.frame->timing.sent))
+            frame.frame->type = frame_t::SOUND_TIMED;
+      }
+      frame.frame->syn = ntohl(h.ts) / frame_t::DATA_SIZE;
+      frame.frame->source = sender;
+      frame.offset += sizeof(frame_t);
+   }
+
+   // a packed RTP payload (behind the timing extension, if any), as received in `buf`
+   void unpack_rtp(room_t & room, rtp::header_t const & h, const char * buf, size_t size, in_addr const & sender, uint64_t arrived)
+   {
+      frame_t::timing_t timing;
+      bool timed = false;
+      if(rtp::has_extension(h))
+      {
+         rtp::timing_ext_t ext;
+         memcpy(&ext, buf, sizeof(ext));
+         timed = rtp::parse_timing_ext(ext, timing.capture, timing.sent);
+         buf += sizeof(ext);
+         size -= sizeof(ext);
+      }
+      codec::rtp_header_t ph;
+      memcpy(&ph, buf, sizeof(ph));
+      codec::encoding_t enc = {ph.decimation, ph.bits, ph.frames};
+      if(!enc.valid() || size != sizeof(ph) + enc.frames * enc.payload_size())
+      {
+         trace(OUTPUT_THREAD, trace_t::BAD_PACKED, size);
+         return;
+      }
+      buf += sizeof(ph);
+      uint32_t syn = ntohl(h.ts) / frame_t::DATA_SIZE;
+      uint64_t frame_us = frame_t::DATA_SIZE * 1e6 / clock_rate();
+      for(size_t i = 0; i < enc.frames; ++i, buf += enc.payload_size())
+      {
+         deliver_packed(room, enc, syn + i, buf, timed ? &timing : NULL, sender, ntohl(h.ssrc), arrived);
+         timing.capture += frame_us;
+      }
+   }
+
+   // native packed datagram, see codec::packed_header_t
+   void unpack_native(room_t & room, const char * buf, size_t size, in_addr const & sender, uint64_t arrived)
+   {
+      codec::packed_header_t ph;
+      if(size < sizeof(ph))
+         return;
+      memcpy(&ph, buf, sizeof(ph));
+      codec::encoding_t enc = {ph.decimation, ph.bits, ph.frames};
+      bool timed = (ph.flags & codec::TIMED) != 0;
+      size_t each = sizeof(uint32_t) + (timed ? sizeof(frame_t::timing_t) : 0) + enc.payload_size();
+      if(!enc.valid() || size != sizeof(ph) + enc.frames * each)
+      {
+         trace(OUTPUT_THREAD, trace_t::BAD_PACKED, size);
+         return;
+      }
+      buf += sizeof(ph);
+      for(size_t i = 0; i < enc.frames; ++i)
+      {
+         uint32_t syn;
+         frame_t::timing_t timing;
+         memcpy(&syn, buf, sizeof(syn));
+         buf += sizeof(syn);
+         if(timed)
+         {
+            memcpy(&timing, buf, sizeof(timing));
+            buf += sizeof(timing);
+         }
+         deliver_packed(room, enc, syn, buf, timed ? &timing : NULL, sender, sender.s_addr, arrived);
+         buf += enc.payload_size();
+      }
+   }
+
+   // expands one reduced frame into a pooled one on the room's bus
+   void deliver_packed(room_t & room, codec::encoding_t const & enc, uint32_t syn, const char * payload,
+                       frame_t::timing_t const * timing, in_addr const & sender, uint32_t source, uint64_t arrived)
+   {
+      frame_ptr frame = pool_.acquire();
+      if(!frame)
+      {
+         watchdog_t::mark(watchdog_t::POOL);
+         return;
       }
-      if(syn_ > ACCEPTABLE_SYN_DESYNC)
-         playback_queue_.erase(
-            std::remove_if(playback_queue_.begin(), playback_queue_.end(), [syn_, ACCEPTABLE_SYN_DESYNC](frame_t const & fr)->bool{return fr.syn < syn_ - ACCEPTABLE_SYN_DESYNC;}),
-            playback_queue_.end()
-            );
+      frame->type = timing ? frame_t::SOUND_TIMED : frame_t::SOUND;
+      frame->syn = syn;
+      frame->source = sender;
+      if(timing)
+         frame->timing = *timing;
+      codec::decode(enc, payload, frame->data);
+      deliver(room, frame, source, arrived);
    }
 
-   bool recv_frame(partial_frame_t & frame)
+   // `source` keys the sender's latency: its SSRC under RTP framing, else its address
+   void deliver(room_t & room, frame_ptr const & frame, uint32_t source, uint64_t arrived)
+   {
+      if(frame->type == frame_t::SOUND_TIMED)
+         measure_latency(room, *frame, source, arrived);
+      if(out_set_->recorder && out_set_->recorder->per_source())
+         tap_source(*frame);
+      playback(room, frame);
+   }
+
+   // RFC 3550 6.3.5: a source silent for SOURCE_TIMEOUT intervals has left
+   void expire_sources(room_t & room, double now)
+   {
+      double before = now - (double)SOURCE_TIMEOUT * RTCP_INTERVAL;
+      room.sources.erase_if([before](std::pair<uint32_t, rtp::source_stats_t> const & src)->bool
+      {
+         return src.second.last_heard < before;
+      });
+   }
+
+   // blocks go to sources that sent data lately, so the ones gone quiet can't crowd them out
+   void send_rtcp(room_t & room, double now)
+   {
+      std::vector<rtp::report_block_t> & blocks = report_blocks_;
+      blocks.clear();
+      double before = now - (double)SENDER_TIMEOUT * RTCP_INTERVAL;
+      for(auto & src : room.sources)
+      {
+         if(src.first == ssrc_ || src.second.probation || src.second.last_rtp < before
+            || blocks.size() == rtp::MAX_REPORT_BLOCKS)
+            continue;
+         blocks.push_back(rtp::report_block_t());
+         src.second.make_report(blocks.back(), src.first);
+      }
+
+      rtp::sender_info_t si;
+      bool sender = &room == out_set_->talk && packets_sent_ != 0;
+      if(sender)
+      {
+         rtp::ntp_time_t ntp = rtp::ntp_now();
+         si.ntp_sec = htonl(ntp.sec);
+         si.ntp_frac = htonl(ntp.frac);
+         si.rtp_ts = htonl(room.syn.load() * frame_t::DATA_SIZE);
+         si.packets = htonl(packets_sent_);
+         si.octets = htonl(octets_sent_);
+      }
+      size_t size = rtp::make_rtcp(rtcp_buf_, ssrc_, sender ? &si : NULL, blocks);
+      room.control->send(room.group, &rtcp_buf_[0], size);
+      trace(OUTPUT_THREAD, trace_t::SEND_RTCP, blocks.size(), sender);
+   }
+
+   void handle_rtcp(room_t & room, const char * buf, size_t size)
+   {
+      rtp::rtcp_header_t h;
+      if(size < sizeof(h))
+         return;
+      memcpy(&h, buf, sizeof(h));
+      if((h.vprc >> 6) != rtp::VERSION || (h.pt != rtp::RTCP_SR && h.pt != rtp::RTCP_RR))
+         return;
+      uint32_t reporter = ntohl(h.ssrc);
+      if(reporter == ssrc_)
+         return; // our own echo
+      auto src = room.sources.find(reporter);
+      if(src != room.sources.end())
+         src->second.last_heard = rtp::monotonic_now();
+      size_t offset = sizeof(h);
+      if(h.pt == rtp::RTCP_SR)
+      {
+         rtp::sender_info_t si;
+         if(offset + sizeof(si) > size)
+            return;
+         memcpy(&si, buf + offset, sizeof(si));
+         offset += sizeof(si);
+         rtp::ntp_time_t ntp = {ntohl(si.ntp_sec), ntohl(si.ntp_frac)};
+         if(src != room.sources.end())
+            src->second.on_sender_report(ntp);
+         stats_lock_t stats(stats_mutex_, boost::try_to_lock);
+         if(stats)
+            latency_.on_sender_report(reporter, rtp::ntp_to_unix_us(ntp), latency_t::now());
+      }
+      for(size_t i = 0; i < (size_t)(h.vprc & 0x1f) && offset + sizeof(rtp::report_block_t) <= size; ++i)
+      {
+         rtp::report_block_t rb;
+         memcpy(&rb, buf + offset, sizeof(rb));
+         offset += sizeof(rb);
+         if(ntohl(rb.ssrc) != ssrc_)
+            continue;
+         rtp::report_t report;
+         rtp::parse_report(rb, reporter, clock_rate(), report);
+         trace(OUTPUT_THREAD, trace_t::RTCP_REPORT, reporter, report.fraction_lost, report.rtt, report.jitter);
+         if(report.rtt > 0)
+         {
+            stats_lock_t stats(stats_mutex_, boost::try_to_lock);
+            if(stats)
+               latency_.on_rtt(reporter, report.rtt);
+         }
+         if(&room == out_set_->talk && !reports_.push(report))
+            trace(OUTPUT_THREAD, trace_t::REPORTS_FULL);
+         if(report_handler_)
+            report_handler_(report);
+      }
+   }
+
+   void process_rtcp()
+   {
+      char buf[MAX_DATAGRAM];
+      for(channel_t * chan : out_set_->control_channels)
+      {
+         chan->keepalive();
+         pollfd pfd;
+         pfd.fd = **chan;
+         pfd.events = POLLIN;
+         while(util::poll<error>(&pfd, 1, 0))
+         {
+            in_addr sender, group;
+            size_t cnt = chan->recv(buf, sizeof(buf), &sender, group);
+            if(room_t * room = find_room(*out_set_, group, chan->port() - 1))
+            {
+               watchdog_t::mark(watchdog_t::RTCP);
+               handle_rtcp(*room, buf, cnt);
+            }
+         }
+      }
+
+      double now = rtp::monotonic_now();
+      for(auto & room : out_set_->rooms)
+         if(room->control && now >= room->next_rtcp)
+         {
+            watchdog_t::mark(watchdog_t::RTCP);
+            expire_sources(*room, now);
+            send_rtcp(*room, now);
+            room->next_rtcp = now + RTCP_INTERVAL;
+         }
+   }
+
+   // demultiplexes everything pending on `chan` into the rooms' mix buses
+   void recv_frames(channel_t & chan)
    {
       pollfd pfd;
-      pfd.fd = *data_source_;
+      pfd.fd = *chan;
       pfd.events = POLLIN;
-      if(util::poll<error>(&pfd, 1, 0)) // TODO: use offset and partial reading. assert for now?
+      while(util::poll<error>(&pfd, 1, 0)) // TODO: use offset and partial reading. assert for now?
       {
-         size_t cnt = data_source_.recv(&frame.frame, 1);
-         assert(cnt == sizeof(frame_t));
-         frame.offset += cnt;
-         logger::trace() << "streamer::recv_frame";
-         return true;
+         // datagrams land straight in a pooled frame
+         if(!recv_frame_.frame)
+            recv_frame_.frame = pool_.acquire();
+         frame_t & frame = recv_frame_.frame ? *recv_frame_.frame : overflow_frame_;
+         if(!recv_frame_.frame)
+         {
+            watchdog_t::mark(watchdog_t::POOL);
+            trace(OUTPUT_THREAD, trace_t::RECV_POOL_EXHAUSTED);
+         }
+
+         in_addr sender, group;
+         rtp::header_t h;
+         rtp::timing_ext_t tail;
+         iovec iov[3];
+         size_t cnt;
+         recv_frame_.offset = 0;
+         if(framing_ == RTP_FRAMING)
+         {
+            iov[0].iov_base = &h;
+            iov[0].iov_len = sizeof(h);
+            iov[1].iov_base = frame.data;
+            iov[1].iov_len = frame_t::DATA_SIZE;
+            iov[2].iov_base = &tail;
+            iov[2].iov_len = sizeof(tail);
+            cnt = chan.recv(iov, 3, &sender, group);
+         }
+         else
+            cnt = chan.recv(&frame, sizeof(frame_t), &sender, group);
+         if(!recv_frame_.frame)
+            continue;
+         uint64_t arrived = latency_t::now();
+
+         room_t * room = find_room(*out_set_, group, chan.port());
+         if(!room)
+         {
+            trace(OUTPUT_THREAD, trace_t::NOT_OUR_ROOM, group.s_addr);
+            continue;
+         }
+         if(framing_ == RTP_FRAMING)
+            parse_rtp(*room, h, cnt, sender, recv_frame_, tail, arrived);
+         else if(frame.type == frame_t::SOUND_PACKED)
+            unpack_native(*room, reinterpret_cast<const char*>(&frame), cnt, sender, arrived); // frame stays ours for the next datagram
+         else if(cnt == frame.wire_size())
+         {
+            frame.source = sender;
+            recv_frame_.offset = cnt;
+         }
+         trace(OUTPUT_THREAD, trace_t::RECV_FRAME);
+         if(recv_frame_.offset != 0)
+         {
+            deliver(*room, recv_frame_.frame, framing_ == RTP_FRAMING ? ntohl(h.ssrc) : sender.s_addr, arrived);
+            recv_frame_.frame.reset();
+         }
       }
-      return false;
    }
 
    void recv_frames()
    {
+      for(channel_t * chan : out_set_->data_channels)
+      {
+         chan->keepalive();
+         recv_frames(*chan);
+      }
+      for(auto & room : out_set_->rooms)
+         if(room->local)
+            recv_local(*room);
+      // same-host peers hear us through shared memory, the loopback copy would double us up
+      if(room_t * talk = out_set_->talk)
+         talk->data->set_echo(!talk->local || talk->local->peers() == 0);
+   }
+
+   void recv_local(room_t & room)
+   {
+      room.local->keepalive();
+      uint64_t arrived = latency_t::now();
+      size_t member;
       while(true)
       {
-         if(!recv_frame_)
+         frame_ptr frame = pool_.acquire();
+         if(!frame)
          {
-            recv_frame_ = boost::in_place();
-            recv_frame_->offset = 0;
+            watchdog_t::mark(watchdog_t::POOL);
+            return;
          }
+         if(!room.local->recv(*frame, member))
+            return;
+         frame->source = local_link_t::source(member);
+         deliver(room, frame, frame->source.s_addr, arrived);
+      }
+   }
+
+   // playout time of the frame is extrapolated from the last one taken off the room's bus
+   void measure_latency(room_t const & room, frame_t const & frame, uint32_t source, uint64_t arrived)
+   {
+      if(room.played_at == 0)
+         return;
+      int64_t frame_us = frame_t::DATA_SIZE * 1e6 / clock_rate();
+      int64_t playout = room.played_at + ((int64_t)frame.syn - (int64_t)room.played_syn) * frame_us;
+      stats_lock_t stats(stats_mutex_, boost::try_to_lock);
+      if(stats)
+         latency_.on_frame(source, frame.source, frame.timing, arrived, playout - (int64_t)arrived, out_latency_);
+   }
 
-         if(recv_frame(*recv_frame_))
+   // bus frames get mixed into in place, so the recorder gets its own pooled copy
+   void tap_source(frame_t const & frame)
+   {
+      watchdog_t::mark(watchdog_t::RECORD);
+      frame_ptr copy = pool_.acquire();
+      if(!copy)
+         return;
+      *copy = frame;
+      out_set_->recorder->push(copy, &copy->source);
+   }
+
+   // takes the next frame of every room's bus, mixing the others into the first one
+   bool mix_next(frame_ptr & res)
+   {
+      res.reset();
+      for(auto & room : out_set_->rooms)
+      {
+         frame_queue_t & queue = room->playback_queue;
+         if(queue.empty())
          {
-            playback(recv_frame_->frame);
-            recv_frame_.reset();
+            // the bus clock runs on through gaps, playback() judges lateness by it
+            if(room->play_syn != 0)
+               ++room->play_syn;
             continue;
          }
+         room->played_syn = queue.front().syn;
+         room->play_syn = room->played_syn + 1;
+         room->played_at = latency_t::now();
+         if(!res)
+            res = queue.pop_front();
          else
-            break;
+         {
+            frame_ptr other = queue.pop_front();
+            for(size_t i = 0; i < frame_t::DATA_SIZE; ++i)
+               res->data[i] = util::bound((int)res->data[i] + (int)other->data[i], -127, 127);
+         }
       }
+      return !!res;
    }
 
    int in_ready(void *in_buf, size_t nframes, double stream_time, RtAudioStreamStatus status)
    {
+      util::configure_thread("audio-in");
+      watchdog_t::scope_t timing(watchdog_, watchdog_t::INPUT, nframes, SAMPLE_RATE);
       char* input  = reinterpret_cast<char*>(in_buf);
       double energy = util::energy(input, nframes);
       if(status == RTAUDIO_INPUT_OVERFLOW)
-         logger::warning() << "RTAUDIO_INPUT_OVERFLOW";
-      logger::trace() << "streamer::in_ready " << stream_time << " " << nframes << " energy: " << energy << std::string(int(energy*40), '*');
+         trace(INPUT_THREAD, trace_t::IN_OVERFLOW);
+      trace(INPUT_THREAD, trace_t::IN_READY, nframes, energy, stream_time);
+
+      room_set_ref_t set(*this, INPUT_THREAD);
+      room_t * talk = set->talk;
+      if((talk ? talk->id : 0) != sending_to_)
+      {
+         // left or changed the talk room, what was captured for the old one goes
+         send_queue_.clear();
+         send_frame_.frame.reset();
+         input_frame_.frame.reset();
+         sending_to_ = talk ? talk->id : 0;
+      }
+      rtp::report_t report;
+      while(reports_.pop(report))
+         if(rate_control_.on_report(report, rtp::monotonic_now()))
+            trace_rate();
+      if(!talk)
+         return 0;
 
       size_t offset = 0;
       while(offset + DOWN_SAMPLE <= nframes)
       {
+         if(!input_frame_.frame)
+         {
+            // capture writes straight into a pooled frame
+            input_frame_.frame = pool_.acquire();
+            if(!input_frame_.frame)
+            {
+               watchdog_t::mark(watchdog_t::POOL);
+               trace(INPUT_THREAD, trace_t::IN_POOL_EXHAUSTED);
+               break;
+            }
+            input_frame_.offset = 0;
+            input_frame_.frame->type = frame_t::SOUND;
+            if(timestamps_)
+            {
+               // the callback runs once the whole buffer is in, a stream latency after the ADC
+               input_frame_.frame->type = frame_t::SOUND_TIMED;
+               input_frame_.frame->timing.capture = latency_t::now() - in_latency_ - (nframes - offset) * 1000000ull / SAMPLE_RATE;
+            }
+            input_frame_.frame->syn = talk->syn++;
+         }
 //         size_t cnt = util::min(frame_t::DATA_SIZE - input_frame_.offset, nframes - offset);
 //         std::copy(input + offset, input + offset + cnt, input_frame_.frame.data + input_frame_.offset);
 //         input_frame_.offset += cnt;
          size_t cnt = util::min((frame_t::DATA_SIZE - input_frame_.offset), (nframes - offset)/DOWN_SAMPLE);
          for(size_t i = 0; i < cnt; ++i)
-            input_frame_.frame.data[input_frame_.offset + i] = input[offset + DOWN_SAMPLE*i];
+            input_frame_.frame->data[input_frame_.offset + i] = input[offset + DOWN_SAMPLE*i];
          input_frame_.offset += cnt;
          offset += DOWN_SAMPLE*cnt;
          if(input_frame_.offset == frame_t::DATA_SIZE)
          {
-            send_queue_.push_back(input_frame_.frame);
-            input_frame_.offset = 0;
-            input_frame_.frame.type = frame_t::SOUND;
-            input_frame_.frame.syn = syn_;
-            syn_ += 1;
+            if(talk->local)
+            {
+               input_frame_.frame->timing.sent = latency_t::now();
+               talk->local->send(*input_frame_.frame);
+            }
+            send_queue_.push_back(std::move(input_frame_.frame));
             if(send_queue_.size() > MAX_QUEUE)
-               while(send_queue_.size() > MAX_QUEUE/2)
-                  send_queue_.pop_front();
+            {
+               // shed a single frame and let the rate controller back off
+               watchdog_t::mark(watchdog_t::PURGE);
+               send_queue_.pop_front();
+               if(rate_control_.on_backlog(rtp::monotonic_now()))
+                  trace_rate();
+            }
          }
       }
 
-      logger::trace() << "streamer::in_ready: queue size: " << send_queue_.size();
+      trace(INPUT_THREAD, trace_t::IN_QUEUE, send_queue_.size());
 
-      send_frames();
+      if(rate_control_.tick(rtp::monotonic_now()))
+         trace_rate();
+
+      send_frames(*talk);
 
       return 0;
    }
@@ -318,25 +1181,33 @@ struct streamer_t
 
    int out_ready(void *out_buf, size_t nframes, double stream_time, RtAudioStreamStatus status)
    {
+      util::configure_thread("audio-out");
+      watchdog_t::scope_t timing(watchdog_, watchdog_t::OUTPUT, nframes, SAMPLE_RATE);
       char* output = reinterpret_cast<char*>(out_buf);
       if(status == RTAUDIO_OUTPUT_UNDERFLOW)
-         logger::warning() << "streamer::out_ready RTAUDIO_OUTPUT_UNDERFLOW";
-      logger::trace() << "streamer::out_ready " << stream_time << " " << nframes << "sps: " << rtaudio_->out.getStreamSampleRate();
+         trace(OUTPUT_THREAD, trace_t::OUT_UNDERFLOW);
+      trace(OUTPUT_THREAD, trace_t::OUT_READY, nframes, rtaudio_->out.getStreamSampleRate(), stream_time);
 
+      room_set_ref_t set(*this, OUTPUT_THREAD);
+      out_set_ = &*set;
       recv_frames();
+      process_rtcp();
       size_t offset = 0;
       while(offset < nframes)
       {
          if(output_frame_.offset == frame_t::DATA_SIZE)
          {
-            if(playback_queue_.empty())
+            if(!mix_next(output_frame_.frame))
             {
-               logger::warning() << "streamer::out_ready no frames";
+               watchdog_t::mark(watchdog_t::STARVED);
                return 0;
             }
-            output_frame_.frame = playback_queue_.front();
-            logger::trace() << "streamer::out_ready frame energy: " << util::energy(output_frame_.frame.data, frame_t::DATA_SIZE);
-            playback_queue_.pop_front();
+            trace(OUTPUT_THREAD, trace_t::OUT_FRAME, 0, util::energy(output_frame_.frame->data, frame_t::DATA_SIZE));
+            if(set->recorder)
+            {
+               watchdog_t::mark(watchdog_t::RECORD);
+               set->recorder->push(output_frame_.frame);
+            }
             output_frame_.offset = 0;
          }
 //         size_t cnt = util::min(frame_t::DATA_SIZE - output_frame_.offset, nframes - offset);
@@ -347,7 +1218,7 @@ struct streamer_t
          {
             interpolate(&output[offset],
                         played_,
-                        output_frame_.frame.data[output_frame_.offset],
+                        output_frame_.frame->data[output_frame_.offset],
                         internal_offset_, nframes - offset - internal_offset_
                         );
             offset = nframes;
@@ -357,18 +1228,18 @@ struct streamer_t
          {
             interpolate(&output[offset],
                         played_,
-                        output_frame_.frame.data[output_frame_.offset],
+                        output_frame_.frame->data[output_frame_.offset],
                         internal_offset_, DOWN_SAMPLE - internal_offset_
                         );
-            played_ = output_frame_.frame.data[output_frame_.offset];
+            played_ = output_frame_.frame->data[output_frame_.offset];
             for(size_t i = 1; i < cnt; ++i)
             {
                interpolate(&output[offset - internal_offset_ + i*DOWN_SAMPLE],
-                           output_frame_.frame.data[output_frame_.offset + i - 1],
-                           output_frame_.frame.data[output_frame_.offset + i],
+                           output_frame_.frame->data[output_frame_.offset + i - 1],
+                           output_frame_.frame->data[output_frame_.offset + i],
                            0, DOWN_SAMPLE
                            );
-               played_ = output_frame_.frame.data[output_frame_.offset + i];
+               played_ = output_frame_.frame->data[output_frame_.offset + i];
             }
          }
          output_frame_.offset += cnt;
@@ -410,19 +1281,302 @@ private:
    };
 
    typedef
-      std::list<frame_t> frame_queue_t;
+      boost::unique_lock<boost::mutex>
+      lock_t;
+
+   typedef
+      boost::unique_lock<boost::mutex>
+      stats_lock_t; // the output thread only ever tries it
+
+   enum audio_thread_t
+   {
+      INPUT_THREAD,
+      OUTPUT_THREAD,
+      AUDIO_THREADS,
+   };
+
+   // One trace, warning or debug line from a callback, kept as numbers so
+   // the callbacks never allocate for it; export_stats() turns them into text.
+   struct trace_t
+   {
+      enum event_t
+      {
+         IN_READY,     // count: frames, value: energy
+         IN_QUEUE,     // count: send queue size
+         SEND_FRAME,   // count: 1 for RTP
+         SEND_PACKED,  // count: frames, value: bytes
+         OUT_READY,    // count: frames, value: sample rate
+         OUT_FRAME,    // value: energy of the mix
+         RECV_FRAME,
+         NOT_OUR_ROOM, // count: group
+         PROBATION,
+         IN_OVERFLOW,
+         IN_POOL_EXHAUSTED,
+         OUT_UNDERFLOW,
+         RECV_POOL_EXHAUSTED,
+         LATE_FRAME,       // count: syn
+         RESYNC,           // count: syn
+         BAD_SIZE,         // count: bytes
+         NOT_OUR_PAYLOAD,
+         BAD_PACKED,       // count: bytes
+         TOO_MANY_SOURCES, // count: ssrc
+         SEND_RTCP,        // count: report blocks, value: 1 for SR
+         RTCP_REPORT,      // count: reporter, value: fraction lost, time: rtt, extra: jitter
+         REPORTS_FULL,
+         RATE_LEVEL,       // count: level, value: rate_control_t::reason_t, extra: up hold
+      };
+
+      event_t event;
+      uint32_t count;
+      double value;
+      double time;  // stream time, unless the event says otherwise
+      double extra;
+   };
+
+   void trace(audio_thread_t thread, trace_t::event_t event, uint32_t count = 0, double value = 0, double time = 0,
+              double extra = 0)
+   {
+      trace_t t = {event, count, value, time, extra};
+      if(!(thread == INPUT_THREAD ? in_traces_ : out_traces_).push(t))
+         traces_dropped_.fetch_add(1, std::memory_order_relaxed);
+   }
+
+   void trace_rate()
+   {
+      trace(INPUT_THREAD, trace_t::RATE_LEVEL, rate_control_.level(), rate_control_.reason(), 0, rate_control_.up_hold());
+   }
+
+   static void log(trace_t const & t)
+   {
+      switch(t.event)
+      {
+      case trace_t::IN_READY:
+         logger::trace() << "streamer::in_ready " << t.time << " " << t.count << " energy: " << t.value
+                         << std::string(int(t.value*40), '*');
+         break;
+      case trace_t::IN_QUEUE:
+         logger::trace() << "streamer::in_ready: queue size: " << t.count;
+         break;
+      case trace_t::SEND_FRAME:
+         logger::trace() << "streamer::send_frame" << (t.count ? ": rtp" : "");
+         break;
+      case trace_t::SEND_PACKED:
+         logger::trace() << "streamer::send_packed: " << t.count << " frames, " << t.value << " bytes";
+         break;
+      case trace_t::OUT_READY:
+         logger::trace() << "streamer::out_ready " << t.time << " " << t.count << " sps: " << t.value;
+         break;
+      case trace_t::OUT_FRAME:
+         logger::trace() << "streamer::out_ready frame energy: " << t.value;
+         break;
+      case trace_t::RECV_FRAME:
+         logger::trace() << "streamer::recv_frame";
+         break;
+      case trace_t::NOT_OUR_ROOM:
+      {
+         in_addr group;
+         group.s_addr = t.count;
+         logger::trace() << "streamer::recv_frames: not our room " << inet_ntoa(group);
+         break;
+      }
+      case trace_t::PROBATION:
+         logger::trace() << "streamer::parse_rtp: source on probation";
+         break;
+      case trace_t::IN_OVERFLOW:
+         logger::warning() << "RTAUDIO_INPUT_OVERFLOW";
+         break;
+      case trace_t::IN_POOL_EXHAUSTED:
+         logger::warning() << "streamer::in_ready: frame pool exhausted, dropping";
+         break;
+      case trace_t::OUT_UNDERFLOW:
+         logger::warning() << "streamer::out_ready RTAUDIO_OUTPUT_UNDERFLOW";
+         break;
+      case trace_t::RECV_POOL_EXHAUSTED:
+         logger::warning() << "streamer::recv_frames: frame pool exhausted, dropping";
+         break;
+      case trace_t::LATE_FRAME:
+         logger::warning() << "streamer::playback: dropping frame " << t.count;
+         break;
+      case trace_t::RESYNC:
+         logger::warning() << "streamer::playback: resynchronization to " << t.count;
+         break;
+      case trace_t::BAD_SIZE:
+         logger::warning() << "streamer::parse_rtp: bad packet size " << t.count;
+         break;
+      case trace_t::NOT_OUR_PAYLOAD:
+         logger::warning() << "streamer::parse_rtp: not our payload";
+         break;
+      case trace_t::BAD_PACKED:
+         logger::warning() << "streamer: bad packed datagram of " << t.count << " bytes";
+         break;
+      case trace_t::TOO_MANY_SOURCES:
+         logger::warning() << "streamer::parse_rtp: source table full, ignoring " << t.count;
+         break;
+      case trace_t::SEND_RTCP:
+         logger::debug() << "streamer::send_rtcp: " << (t.value ? "SR" : "RR") << " blocks: " << t.count;
+         break;
+      case trace_t::RTCP_REPORT:
+         logger::debug() << "streamer::handle_rtcp: report from " << t.count
+                         << " lost: " << t.value << " jitter: " << t.extra << " rtt: " << t.time;
+         break;
+      case trace_t::REPORTS_FULL:
+         logger::warning() << "streamer::handle_rtcp: report queue full";
+         break;
+      case trace_t::RATE_LEVEL:
+         if(t.value == rate_control_t::QUIET)
+            logger::debug() << "rate_control: level " << t.count << " after " << t.extra << "s quiet";
+         else
+            logger::debug() << "rate_control: level " << t.count << " on " << rate_control_t::name((rate_control_t::reason_t)t.value);
+         break;
+      }
+   }
+
+   // The published room set for the length of a callback. The thread's
+   // hazard pointer tells publish() the set is still in use; rechecking
+   // after setting it means the set can't have been retired unseen.
+   struct room_set_ref_t : boost::noncopyable
+   {
+      room_set_ref_t(streamer_t & streamer, audio_thread_t thread)
+         : hazard_(streamer.using_[thread])
+      {
+         do
+         {
+            set_ = streamer.set_.load();
+            hazard_.store(set_);
+         } while(set_ != streamer.set_.load());
+      }
+
+      ~room_set_ref_t()
+      {
+         hazard_.store(NULL);
+      }
+
+      room_set_t const & operator*() const
+      {
+         return *set_;
+      }
+
+      room_set_t const * operator->() const
+      {
+         return set_;
+      }
+
+   private:
+      std::atomic<room_set_t const *> & hazard_;
+      room_set_t const * set_;
+   };
+
+   // under rooms_mutex_. The old set, and any room or recorder only it
+   // held, is freed here once neither callback is inside it, so that never
+   // happens on an audio thread.
+   void publish(std::unique_ptr<room_set_t> next)
+   {
+      room_set_t const * old = set_.exchange(next.release());
+      for(size_t i = 0; i < AUDIO_THREADS; ++i)
+         while(using_[i].load() == old)
+            ::usleep(1000);
+      delete old;
+   }
+
+   void init_buffers()
+   {
+      for(size_t i = 0; i < AUDIO_THREADS; ++i)
+         using_[i] = NULL;
+      report_blocks_.reserve(rtp::MAX_REPORT_BLOCKS);
+      packet_buf_.resize(MAX_DATAGRAM);
+      input_frame_.offset = 0;
+      output_frame_.offset = frame_t::DATA_SIZE;
+      //input_frame_.source = local_address_;
+   }
+
+   static room_t * find_room(room_set_t const & set, in_addr const & group, uint16_t port)
+   {
+      for(auto & room : set.rooms)
+         if(room->group == group && room->port == port)
+            return room.get();
+      return NULL;
+   }
+
+   channel_t & shared_channel(uint16_t port)
+   {
+      lock_t __(rooms_mutex_);
+      std::unique_ptr<channel_t> & chan = shared_[port];
+      if(!chan)
+         chan.reset(new channel_t(port));
+      return *chan;
+   }
+
+   // drops multicast sockets no room uses anymore, under rooms_mutex_ and
+   // after publish(), so no callback can still reach them
+   void release_shared_channels()
+   {
+      for(auto it = shared_.begin(); it != shared_.end(); )
+      {
+         bool used = false;
+         for(auto const & room : set_.load()->rooms)
+            used = used || room->data == it->second.get() || room->control == it->second.get();
+         if(used)
+            ++it;
+         else
+            it = shared_.erase(it);
+      }
+   }
+
+   void update_channels(room_set_t & set)
+   {
+      set.data_channels.clear();
+      set.control_channels.clear();
+      for(auto const & room : set.rooms)
+      {
+         if(std::find(set.data_channels.begin(), set.data_channels.end(), room->data) == set.data_channels.end())
+            set.data_channels.push_back(room->data);
+         if(room->control && std::find(set.control_channels.begin(), set.control_channels.end(), room->control) == set.control_channels.end())
+            set.control_channels.push_back(room->control);
+      }
+   }
+
 private:
-   udp::socket_t data_source_;
+   framing_t framing_;
+   frame_pool_t pool_; // outlives every queue below
    in_addr local_address_;
    boost::optional<io_control> rtaudio_;
 
+   mutable boost::mutex rooms_mutex_; // control side only, the callbacks never take it
+   std::atomic<room_set_t const *> set_; // changed under rooms_mutex_ through publish()
+   std::atomic<room_set_t const *> using_[AUDIO_THREADS]; // hazard pointers, see room_set_ref_t
+   uint32_t last_room_id_; // under rooms_mutex_
+   std::unordered_map<uint16_t, std::unique_ptr<channel_t>> shared_; // multicast sockets by port, under rooms_mutex_
+
    frame_queue_t send_queue_;
-   frame_queue_t playback_queue_;
    partial_frame_t input_frame_;
    partial_frame_t output_frame_;
-   boost::optional<partial_frame_t> send_frame_;
-   boost::optional<partial_frame_t> recv_frame_;
-   size_t syn_;
+   partial_frame_t send_frame_;
+   partial_frame_t recv_frame_;
+   frame_t overflow_frame_; // drains the socket when the pool is exhausted
    char played_;
    size_t internal_offset_;
+   uint32_t sending_to_;           // input thread, id of the talk room send_queue_ is for
+   room_set_t const * out_set_;    // output thread, what its callback holds
+
+   uint32_t ssrc_;
+   // input thread; one per datagram whatever it carries, so receivers count
+   // only network loss, frames we drop or pack never show up as gaps
+   uint16_t rtp_seq_;
+   std::atomic<uint32_t> packets_sent_;
+   std::atomic<uint32_t> octets_sent_;
+   std::vector<char> rtcp_buf_; // output thread
+   std::vector<rtp::report_block_t> report_blocks_; // output thread
+   report_handler_t report_handler_;
+   watchdog_t watchdog_;
+   std::atomic<bool> timestamps_;
+   boost::mutex stats_mutex_; // export_stats() holds it briefly, the output thread only tries it
+   latency_t latency_; // output thread, export_stats() under stats_mutex_
+   uint64_t in_latency_;  // us, from RtAudio
+   uint64_t out_latency_;
+   rate_control_t rate_control_; // input thread
+   util::spsc_queue_t<rtp::report_t> reports_; // about us, output thread to rate_control_
+   util::spsc_queue_t<trace_t> in_traces_;  // input thread to export_stats()
+   util::spsc_queue_t<trace_t> out_traces_; // output thread to export_stats()
+   std::atomic<size_t> traces_dropped_;
+   std::vector<char> packet_buf_; // input thread
 };
@@ -0,0 +1,336 @@
+#pragma once
+#include "frame.hpp"
+#include "channel.hpp"
+#include "rtp.hpp"
+#include "common/logger.hpp"
+
+#include <math.h>
+#include <time.h>
+#include <sys/time.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fstream>
+#include <iterator>
+#include <vector>
+#include <memory>
+
+#include <boost/noncopyable.hpp>
+
+// Synthetic speakers for room load tests: generated or file backed audio,
+// packetized like streamer_t and paced on the monotonic clock.
+namespace synth
+{
+   struct error : std::runtime_error
+   {
+      error(std::string const & what)
+         : std::runtime_error(what)
+      {
+      }
+   };
+
+   // produces signed 8-bit mono samples at a fixed rate
+   struct source_t
+   {
+      enum kind_t
+      {
+         TONE,
+         NOISE,
+         WAV_FILE,
+      };
+
+      source_t(kind_t kind, double rate, double freq = 440, double amplitude = 0.5)
+         : kind_(kind)
+         , rate_(rate)
+         , freq_(freq)
+         , amplitude_(amplitude)
+         , phase_(0)
+         , seed_(0x9e3779b9)
+         , pos_(0)
+      {
+      }
+
+      // WAV_FILE: 8/16-bit PCM, any channel count, resampled to `rate`
+      static source_t from_wav(std::string const & path, double rate)
+      {
+         source_t res(WAV_FILE, rate);
+         res.load_wav(path);
+         return res;
+      }
+
+      // different phase/seed/offset per speaker, so streams don't cancel or coincide
+      void offset(size_t n)
+      {
+         phase_ = n * 0.37;
+         seed_ = 0x9e3779b9 ^ (n * 0x85ebca6b + 1);
+         if(!samples_.empty())
+            pos_ = (n * 7919.) * step();
+      }
+
+      void fill(char * out, size_t n)
+      {
+         switch(kind_)
+         {
+         case TONE:
+            for(size_t i = 0; i < n; ++i)
+            {
+               out[i] = (char)(127 * amplitude_ * sin(phase_));
+               phase_ += 2 * M_PI * freq_ / rate_;
+            }
+            phase_ = fmod(phase_, 2 * M_PI);
+            break;
+         case NOISE:
+            for(size_t i = 0; i < n; ++i)
+            {
+               seed_ ^= seed_ << 13;
+               seed_ ^= seed_ >> 17;
+               seed_ ^= seed_ << 5;
+               out[i] = (char)((int8_t)(seed_ & 0xff) * amplitude_);
+            }
+            break;
+         case WAV_FILE:
+            for(size_t i = 0; i < n; ++i)
+            {
+               out[i] = samples_[(size_t)pos_];
+               pos_ += step();
+               if(pos_ >= samples_.size())
+                  pos_ -= samples_.size();
+            }
+            break;
+         }
+      }
+
+   private:
+      double step() const
+      {
+         return file_rate_ / rate_;
+      }
+
+      void load_wav(std::string const & path)
+      {
+         std::ifstream in(path.c_str(), std::ios::binary);
+         if(!in)
+            throw error("Can't open " + path);
+         std::vector<char> data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+         if(data.size() < 12 || memcmp(&data[0], "RIFF", 4) != 0 || memcmp(&data[8], "WAVE", 4) != 0)
+            throw error(path + ": not a WAV file");
+
+         uint16_t format = 0, channels = 0, bits = 0;
+         uint32_t rate = 0;
+         size_t offset = 12;
+         while(offset + 8 <= data.size())
+         {
+            uint32_t size;
+            memcpy(&size, &data[offset + 4], 4);
+            size_t body = offset + 8;
+            if(body + size > data.size())
+               size = data.size() - body;
+            if(memcmp(&data[offset], "fmt ", 4) == 0 && size >= 16)
+            {
+               memcpy(&format, &data[body], 2);
+               memcpy(&channels, &data[body + 2], 2);
+               memcpy(&rate, &data[body + 4], 4);
+               memcpy(&bits, &data[body + 14], 2);
+            }
+            else if(memcmp(&data[offset], "data", 4) == 0)
+            {
+               if(format != 1 || channels == 0 || (bits != 8 && bits != 16))
+                  throw error(path + ": only 8/16-bit PCM is supported");
+               size_t frame = channels * bits / 8;
+               for(size_t i = body; i + frame <= body + size; i += frame)
+                  if(bits == 8)
+                     samples_.push_back((char)((uint8_t)data[i] ^ 0x80));
+                  else
+                  {
+                     int16_t s;
+                     memcpy(&s, &data[i], 2);
+                     samples_.push_back((char)(s >> 8));
+                  }
+            }
+            offset = body + size + (size & 1);
+         }
+         if(samples_.empty())
+            throw error(path + ": no samples");
+         file_rate_ = rate;
+      }
+
+   private:
+      kind_t kind_;
+      double rate_;
+      double freq_;
+      double amplitude_;
+      double phase_;
+      uint32_t seed_;
+      std::vector<char> samples_;
+      double file_rate_;
+      double pos_;
+   };
+
+   inline void add_ns(timespec & ts, uint64_t ns)
+   {
+      ts.tv_nsec += ns;
+      while(ts.tv_nsec >= 1000000000)
+      {
+         ts.tv_nsec -= 1000000000;
+         ++ts.tv_sec;
+      }
+   }
+
+   // N speakers sending to one room from one process over a single socket
+   struct speakers_t : boost::noncopyable
+   {
+      struct options_t
+      {
+         options_t()
+            : speakers(1)
+            , rate(44100. / 7) // streamer_t::clock_rate()
+            , rtp(false)
+            , stagger(true)
+            , timestamps(false)
+         {
+         }
+
+         size_t speakers;
+         double rate;  // samples per second per speaker
+         bool rtp;
+         bool stagger; // spread speakers over the frame interval instead of bursting
+         bool timestamps; // frame_t::SOUND_TIMED, captured at send time
+         boost::optional<sockaddr_in> relay;
+      };
+
+      speakers_t(in_addr const & group, uint16_t port, source_t const & source, options_t const & opts)
+         : group_(group)
+         , opts_(opts)
+         , sent_(0)
+         , late_(0)
+      {
+         if(opts_.relay)
+            chan_.reset(new channel_t(group, port, *opts_.relay));
+         else
+         {
+            chan_.reset(new channel_t(port));
+            chan_->join(group);
+         }
+         uint32_t base = ::time(NULL) ^ (::getpid() << 16);
+         for(size_t i = 0; i < opts_.speakers; ++i)
+         {
+            speaker_t s(source);
+            s.source.offset(i);
+            s.syn = 0;
+            s.ssrc = base + i;
+            speakers_.push_back(s);
+         }
+      }
+
+      // seconds == 0 runs forever
+      void run(double seconds)
+      {
+         assert(opts_.rate > 0 && !speakers_.empty());
+         uint64_t interval = frame_t::DATA_SIZE * 1e9 / opts_.rate;
+         uint64_t slot = opts_.stagger ? interval / speakers_.size() : 0;
+         timespec start;
+         ::clock_gettime(CLOCK_MONOTONIC, &start);
+         timespec next = start;
+         size_t frames = seconds > 0 ? (size_t)(seconds * opts_.rate / frame_t::DATA_SIZE) : 0;
+         time_t next_stats = ::time(NULL) + 5;
+
+         for(size_t f = 0; frames == 0 || f < frames; ++f)
+         {
+            timespec tick = next;
+            for(size_t i = 0; i < speakers_.size(); ++i)
+            {
+               wait(tick);
+               send(speakers_[i]);
+               add_ns(tick, slot);
+            }
+            add_ns(next, interval);
+
+            if(::time(NULL) >= next_stats)
+            {
+               logger::debug() << "synth::speakers: sent " << sent_ << " frames, late ticks " << late_;
+               next_stats = ::time(NULL) + 5;
+            }
+         }
+      }
+
+      size_t sent() const
+      {
+         return sent_;
+      }
+
+      size_t late() const
+      {
+         return late_;
+      }
+
+   private:
+      struct speaker_t
+      {
+         speaker_t(source_t const & source)
+            : source(source)
+         {
+         }
+
+         source_t source;
+         uint32_t syn;
+         uint32_t ssrc;
+      };
+
+      void wait(timespec const & deadline)
+      {
+         timespec now;
+         ::clock_gettime(CLOCK_MONOTONIC, &now);
+         if(now.tv_sec > deadline.tv_sec || (now.tv_sec == deadline.tv_sec && now.tv_nsec > deadline.tv_nsec + 1000000))
+            ++late_;
+         while(::clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR)
+            ;
+      }
+
+      void send(speaker_t & s)
+      {
+         frame_.type = opts_.timestamps ? frame_t::SOUND_TIMED : frame_t::SOUND;
+         frame_.syn = s.syn++;
+         frame_.source.s_addr = htonl(s.ssrc);
+         s.source.fill(frame_.data, frame_t::DATA_SIZE);
+         if(opts_.timestamps)
+         {
+            timeval tv;
+            ::gettimeofday(&tv, NULL);
+            frame_.timing.capture = frame_.timing.sent = tv.tv_sec * 1000000ull + tv.tv_usec;
+         }
+         if(opts_.rtp)
+         {
+            rtp::header_t h;
+            rtp::make_header(h, frame_.syn, frame_.syn * frame_t::DATA_SIZE, s.ssrc, opts_.timestamps);
+            rtp::timing_ext_t ext;
+            rtp::make_timing_ext(ext, frame_.timing.capture, frame_.timing.sent);
+            iovec iov[3];
+            size_t n = 0;
+            iov[n].iov_base = &h;
+            iov[n++].iov_len = sizeof(h);
+            if(opts_.timestamps)
+            {
+               iov[n].iov_base = &ext;
+               iov[n++].iov_len = sizeof(ext);
+            }
+            iov[n].iov_base = frame_.data;
+            iov[n++].iov_len = frame_t::DATA_SIZE;
+            chan_->send(group_, iov, n);
+         }
+         else
+            chan_->send(group_, &frame_, frame_.wire_size());
+         chan_->keepalive();
+         ++sent_;
+      }
+
+   private:
+      in_addr group_;
+      options_t opts_;
+      std::unique_ptr<channel_t> chan_;
+      std::vector<speaker_t> speakers_;
+      frame_t frame_;
+      size_t sent_;
+      size_t late_;
+   };
+}
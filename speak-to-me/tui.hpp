@@ -5,6 +5,8 @@
 
 struct tui
 {
+   enum { UPDATE_PERIOD = 1 }; // secs, redraws the user list between keys
+
    struct help_box
    {
       help_box(std::shared_ptr<s2m::client_t> & client)
@@ -29,11 +31,19 @@ struct tui
          wclear(wnd_);
 
          mvwprintw(wnd_, 0, 0, "Help box:\n");
-         if(client_->has_room())
-            wprintw(wnd_, "d - disconnect chat room\n");
-         else
+         if(!client_->talking())
             wprintw(wnd_, "c - connect to chat room\n");
+         wprintw(wnd_, "m - monitor chat room\n");
+         if(client_->has_room())
+            wprintw(wnd_, "d - disconnect chat rooms\n");
          wprintw(wnd_, "n - set nick\n");
+         if(client_->recording())
+            wprintw(wnd_, "w - stop recording\n");
+         else if(client_->has_room())
+            wprintw(wnd_, "w/W - record mix/+senders\n");
+         if(!client_->has_room())
+            wprintw(wnd_, "r - use %s\n", client_->framing() == streamer_t::RTP_FRAMING ? "native frames" : "RTP/RTCP");
+         wprintw(wnd_, "t - %s timestamps\n", client_->timestamps() ? "stop" : "send");
 
          wrefresh(wnd_);
       }
@@ -65,6 +75,8 @@ struct tui
          ss << user.nick << " [" <<  inet_ntoa(user.ip) << "]";
          if(user.room_port != 0)
             ss << " -> " << inet_ntoa(user.room_address) << ":" << user.room_port;
+         if(user.stale)
+            ss << " ?";
          return ss.str();
       }
 
@@ -87,18 +99,17 @@ struct tui
       {
          wclear(wnd_);
 
-         std::vector<s2m::client_t::user_t> users;
-         client_->get_users(users);
-         if(pos_ + height_ - 1 > (int)users.size())
-            pos_ = users.size() - height_;
+         s2m::client_t::snapshot_t users = client_->users();
+         if(pos_ + height_ - 1 > (int)users->size())
+            pos_ = users->size() - height_;
          if(pos_ < 0)
             pos_ = 0;
          mvwprintw(wnd_, 0, 0, "users:");
          for(int i = 0; i < height_; ++i)
          {
-            if(i+pos_ >= (int)users.size())
+            if(i+pos_ >= (int)users->size())
                break;
-            mvwprintw(wnd_, i+1, 0, format_user_info(users[i+pos_]).c_str());
+            mvwprintw(wnd_, i+1, 0, format_user_info((*users)[i+pos_]).c_str());
          }
 
          wrefresh(wnd_);
@@ -136,7 +147,10 @@ struct tui
    {
       ulist_->update();
       hbox_->update();
-      ::refresh();
+      if(prompt_)
+         draw_prompt(); // leaves the cursor on it
+      else
+         ::refresh();
    }
 
    void print_err(std::string const & err)
@@ -148,6 +162,7 @@ struct tui
       ::printw(err.c_str());
    }
 
+   // blocks reading a line, only for setup before the loop runs
    bool query(std::string const & pref, std::string & res)
    {
       int rows, cols;
@@ -258,76 +273,212 @@ struct tui
       client_->set_devices(api_, inp_dev_, outp_dev_);
    }
 
+   typedef
+      boost::function<void (std::string const &)>
+      answer_t;
+
+   // a line typed at the bottom while the loop runs on, keys go to it until
+   // enter hands it to answer or escape drops it
+   struct prompt_t
+   {
+      std::string text;
+      std::string line;
+      answer_t answer;
+   };
+
+   void ask(std::string const & text, answer_t const & answer)
+   {
+      prompt_t p = { text, std::string(), answer };
+      prompt_ = p;
+      draw_prompt();
+   }
+
+   void draw_prompt()
+   {
+      int rows = getmaxy(stdscr);
+      ::move(rows - 1, 0);
+      ::clrtoeol();
+      ::printw("%s%s", prompt_->text.c_str(), prompt_->line.c_str());
+      ::refresh();
+   }
+
+   // false if no prompt is open
+   bool prompt_key(int ch)
+   {
+      if(!prompt_)
+         return false;
+      switch(ch)
+      {
+      case '\n':
+      case '\r':
+      case KEY_ENTER:
+      {
+         prompt_t p = *prompt_;
+         prompt_ = boost::none;
+         print_err("");
+         p.answer(p.line); // may well ask again
+         return true;
+      }
+      case 27: // escape
+         prompt_ = boost::none;
+         print_err("");
+         return true;
+      case KEY_BACKSPACE:
+      case 127:
+      case '\b':
+         if(!prompt_->line.empty())
+            prompt_->line.erase(prompt_->line.size() - 1);
+         break;
+      default:
+         if(ch < 256 && isprint(ch) && prompt_->line.size() < MAX_LINE)
+            prompt_->line += (char)ch;
+         break;
+      }
+      draw_prompt();
+      return true;
+   }
+
    void change_nick()
    {
-      std::string nick;
-      if(query("New nick: ", nick))
-         client_->set_nick(nick);
+      ask("New nick: ", [this](std::string const & nick) { client_->set_nick(nick); });
+   }
+
+   // room ip, port and relay, one prompt after another, then join
+   void query_room(bool talk)
+   {
+      ask("Chat room IP: ", [this, talk](std::string const & ip)
+      {
+         in_addr addr;
+         if(inet_aton(ip.c_str(), &addr) == 0)
+         {
+            print_err("Error: invalid IP");
+            return;
+         }
+         ask("Chat room port: ", [this, talk, addr](std::string const & sport)
+         {
+            uint16_t port;
+            std::stringstream ss(sport);
+            if(!(ss >> port))
+            {
+               print_err("Error: invalid port");
+               return;
+            }
+            ask("Relay IP (empty for multicast): ", [this, talk, addr, port](std::string const & relay)
+            {
+               if(set_relay(relay))
+                  join(addr, port, talk);
+            });
+         });
+      });
    }
 
-   void connect()
+   bool set_relay(std::string const & relay)
    {
-      std::string ip, sport;
-      if(!query("Chat room IP: ", ip))
-         return;
-      in_addr addr;
-      if(inet_aton(ip.c_str(), &addr) == 0)
+      if(relay.empty())
       {
-         print_err("Error: invalid IP");
-         return;
+         client_->set_relay(boost::none);
+         return true;
       }
-      if(!query("Chat room port: ", sport))
-         return;
-      std::stringstream ss(sport);
-      uint16_t port;
-      if(!(ss >> port))
+      sockaddr_in sa;
+      util::nullize(sa);
+      sa.sin_family = AF_INET;
+      sa.sin_port = htons(s2m::relay_proto::DEFAULT_PORT);
+      if(inet_aton(relay.c_str(), &sa.sin_addr) == 0)
       {
-         print_err("Error: invalid port");
-         return;
+         print_err("Error: invalid relay IP");
+         return false;
+      }
+      client_->set_relay(sa);
+      return true;
+   }
+
+   void join(in_addr const & addr, uint16_t port, bool talk)
+   {
+      try
+      {
+         if(talk)
+            client_->set_room(addr, port);
+         else
+            client_->monitor_room(addr, port);
+      }
+      catch(std::exception & e)
+      {
+         print_err(std::string("Error: ") + e.what());
       }
-      client_->set_room(addr, port);
    }
 
    void run()
    {
       configure_api();
 
-      update();
-      while(true)
+      // from here on nothing may block the loop, prompts included
+      ::noecho();
+      ::keypad(wnd_, true);
+      ::nodelay(wnd_, true);
+
+      util::event_loop_t loop;
+      client_->attach(loop);
+      loop.add(STDIN_FILENO, EPOLLIN, [this](uint32_t)
       {
-         client_->do_stuff();
+         int ch;
+         while((ch = ::getch()) != ERR) // curses may buffer more than one
+            if(!prompt_key(ch))
+               handle_key(ch);
          update();
-         sleep(s2m::PROCESS_PERIOD);
+      });
+      loop.add_timer(UPDATE_PERIOD, [this]() { update(); });
 
-         ::nodelay(wnd_, true);
-         int ch = ::getch();
-         ::nodelay(wnd_, false);
-         switch(ch)
-         {
-         case KEY_UP:
-            ulist_->chpos(-1);
-            break;
-         case KEY_DOWN:
-            ulist_->chpos(1);
-            break;
-         case 'n':
-            change_nick();
-            break;
-         case 'c':
-            if(!client_->has_room())
-               connect();
-            break;
-         case 'd':
-            if(client_->has_room())
-               client_->disconnect();
-            break;
-         }
+      update();
+      loop.run();
+   }
+
+   void handle_key(int ch)
+   {
+      switch(ch)
+      {
+      case KEY_UP:
+         ulist_->chpos(-1);
+         break;
+      case KEY_DOWN:
+         ulist_->chpos(1);
+         break;
+      case 'n':
+         change_nick();
+         break;
+      case 'c':
+         if(!client_->talking())
+            query_room(true);
+         break;
+      case 'm':
+         query_room(false);
+         break;
+      case 'd':
+         if(client_->has_room())
+            client_->disconnect();
+         break;
+      case 'w':
+      case 'W':
+         if(client_->recording())
+            client_->stop_recording();
+         else
+            client_->start_recording(ch == 'W');
+         break;
+      case 'r':
+         if(!client_->has_room())
+            client_->set_framing(client_->framing() == streamer_t::RTP_FRAMING ? streamer_t::NATIVE_FRAMING : streamer_t::RTP_FRAMING);
+         break;
+      case 't':
+         client_->set_timestamps(!client_->timestamps());
+         break;
       }
    }
 
 private:
+   enum { MAX_LINE = 126 };
+
    boost::optional<user_list> ulist_;
    boost::optional<help_box> hbox_;
+   boost::optional<prompt_t> prompt_;
    std::shared_ptr<s2m::client_t> client_;
    WINDOW * wnd_;
    int api_, inp_dev_, outp_dev_;
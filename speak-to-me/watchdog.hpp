@@ -0,0 +1,169 @@
+#pragma once
+#include "common/histogram.hpp"
+#include "common/logger.hpp"
+
+#include <time.h>
+#include <stdint.h>
+#include <atomic>
+
+#include <boost/noncopyable.hpp>
+
+// Deadline accounting for the audio callbacks. Every callback is timed against
+// the period it was handed (nframes / sample rate); code paths worth blaming
+// for a glitch mark themselves, and overruns are attributed to the marked ones.
+struct watchdog_t : boost::noncopyable
+{
+   enum callback_t
+   {
+      INPUT,
+      OUTPUT,
+      CALLBACKS,
+   };
+
+   enum section_t
+   {
+      PURGE,   // queue trimming
+      RESYNC,
+      POOL,    // frame pool exhausted
+      STARVED, // mix bus ran dry, the device got silence
+      RTCP,
+      RECORD,
+      SECTIONS,
+   };
+
+   static const time_t EXPORT_PERIOD = 10; // seconds
+
+   watchdog_t()
+      : next_export_(0)
+   {
+   }
+
+private:
+   struct stats_t
+   {
+      stats_t()
+         : last_start(0)
+         , deadline(0)
+         , overruns(0)
+      {
+         for(size_t s = 0; s < SECTIONS; ++s)
+         {
+            hits[s] = 0;
+            blamed[s] = 0;
+         }
+      }
+
+      util::histogram_t exec;     // us
+      util::histogram_t interval; // us between callback starts
+      std::atomic<uint64_t> last_start;
+      std::atomic<uint64_t> deadline;
+      std::atomic<uint64_t> overruns;
+      std::atomic<uint64_t> hits[SECTIONS];   // callbacks that went through the section
+      std::atomic<uint64_t> blamed[SECTIONS]; // ... and overran
+   };
+
+public:
+   // times one callback invocation
+   struct scope_t : boost::noncopyable
+   {
+      scope_t(watchdog_t & owner, callback_t cb, size_t nframes, double sample_rate)
+         : stats_(owner.stats_[cb])
+         , start_(now())
+         , deadline_(nframes * 1e6 / sample_rate)
+         , sections_(0)
+         , outer_(current())
+      {
+         uint64_t last = stats_.last_start.exchange(start_, std::memory_order_relaxed);
+         if(last != 0)
+            stats_.interval.record(start_ - last);
+         stats_.deadline.store(deadline_, std::memory_order_relaxed);
+         current() = &sections_;
+      }
+
+      ~scope_t()
+      {
+         current() = outer_;
+         uint64_t exec = now() - start_;
+         stats_.exec.record(exec);
+         for(size_t s = 0; s < SECTIONS; ++s)
+            if(sections_ & (1u << s))
+            {
+               stats_.hits[s].fetch_add(1, std::memory_order_relaxed);
+               if(exec > deadline_)
+                  stats_.blamed[s].fetch_add(1, std::memory_order_relaxed);
+            }
+         if(exec > deadline_)
+            stats_.overruns.fetch_add(1, std::memory_order_relaxed);
+      }
+
+   private:
+      stats_t & stats_;
+      uint64_t start_;
+      uint64_t deadline_;
+      uint32_t sections_;
+      uint32_t * outer_;
+   };
+
+   // no-op outside a timed callback
+   static void mark(section_t s)
+   {
+      if(current())
+         *current() |= 1u << s;
+   }
+
+   // logs and resets the window, at most once per EXPORT_PERIOD; false if not due yet
+   bool export_stats()
+   {
+      time_t t = ::time(NULL);
+      if(t < next_export_)
+         return false;
+      next_export_ = t + EXPORT_PERIOD;
+      for(size_t cb = 0; cb < CALLBACKS; ++cb)
+         export_stats(cb == INPUT ? "in" : "out", stats_[cb]);
+      return true;
+   }
+
+private:
+   static const char * section_name(size_t s)
+   {
+      static const char * names[SECTIONS] = {"purge", "resync", "pool", "starved", "rtcp", "record"};
+      return names[s];
+   }
+
+   static uint64_t now() // us
+   {
+      timespec ts;
+      ::clock_gettime(CLOCK_MONOTONIC, &ts);
+      return ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+   }
+
+   static uint32_t *& current()
+   {
+      static thread_local uint32_t * sections = NULL;
+      return sections;
+   }
+
+   static void export_stats(const char * name, stats_t & stats)
+   {
+      util::histogram_t::snapshot_t exec = stats.exec.take();
+      util::histogram_t::snapshot_t interval = stats.interval.take();
+      if(exec.count == 0)
+         return;
+      uint64_t overruns = stats.overruns.exchange(0, std::memory_order_relaxed);
+      logger::debug() << "watchdog: " << name << " calls " << exec.count
+                      << " deadline " << stats.deadline.load(std::memory_order_relaxed) << "us"
+                      << " overruns " << overruns
+                      << " exec p50<" << exec.quantile(.5) << " p99<" << exec.quantile(.99) << " max " << exec.max << "us"
+                      << " interval p50<" << interval.quantile(.5) << " p99<" << interval.quantile(.99) << " max " << interval.max << "us";
+      for(size_t s = 0; s < SECTIONS; ++s)
+      {
+         uint64_t hits = stats.hits[s].exchange(0, std::memory_order_relaxed);
+         uint64_t blamed = stats.blamed[s].exchange(0, std::memory_order_relaxed);
+         if(hits != 0)
+            logger::debug() << "watchdog: " << name << " " << section_name(s) << " in " << hits << " calls, " << blamed << " overran";
+      }
+   }
+
+   stats_t stats_[CALLBACKS];
+   time_t next_export_;
+};
@@ -0,0 +1,156 @@
+#include <malloc.h>
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <new>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <boost/lexical_cast.hpp>
+
+#include "speak-to-me/directory.hpp"
+
+// The directory's user table against the node based map it replaced: lookups,
+// a full scan like the digest, list and snapshot walks, and heap bytes per
+// user, nicks included.
+namespace
+{
+   size_t heap_bytes = 0; // live, as malloc sizes them
+}
+
+void * operator new(size_t size)
+{
+   void * p = malloc(size);
+   if(!p)
+      throw std::bad_alloc();
+   heap_bytes += malloc_usable_size(p);
+   return p;
+}
+
+void operator delete(void * p) noexcept
+{
+   if(p)
+      heap_bytes -= malloc_usable_size(p);
+   free(p);
+}
+
+namespace
+{
+   typedef
+      std::chrono::steady_clock
+      steady_t;
+
+   typedef
+      s2m::directory_t::user_t
+      user_t;
+
+   typedef
+      std::unordered_map<in_addr, user_t, util::hasher<in_addr>>
+      node_map_t;
+
+   template<class F>
+   double ns_per_op(size_t ops_per_call, F const & f)
+   {
+      size_t calls = 0;
+      steady_t::time_point start = steady_t::now();
+      double secs = 0;
+      do
+      {
+         f();
+         ++calls;
+         secs = std::chrono::duration<double>(steady_t::now() - start).count();
+      } while(secs < .3);
+      return secs / calls / ops_per_call * 1e9;
+   }
+
+   template<class Map>
+   void bench(const char * name, std::vector<user_t> const & users, std::vector<in_addr> const & hits,
+              std::vector<in_addr> const & misses)
+   {
+      size_t before = heap_bytes;
+      {
+         Map map;
+         for(auto const & u : users)
+            map[u.ip] = u;
+         size_t bytes = heap_bytes - before;
+
+         size_t sink = 0;
+         double hit = ns_per_op(hits.size(), [&]()
+         {
+            for(auto const & ip : hits)
+               sink += map.find(ip)->second.version;
+         });
+         double miss = ns_per_op(misses.size(), [&]()
+         {
+            for(auto const & ip : misses)
+               sink += map.count(ip);
+         });
+         double scan = ns_per_op(map.size(), [&]()
+         {
+            for(auto const & u : map)
+               sink += u.second.version + u.second.nick.size();
+         });
+         std::cout << "   " << name << ": lookup " << hit << " ns, miss " << miss << " ns, scan " << scan
+                   << " ns/user, " << bytes / users.size() << " bytes/user (" << (sink & 1) << ")" << std::endl;
+      }
+   }
+
+   void run(size_t n, size_t nick_len)
+   {
+      std::mt19937 random(1);
+      std::vector<user_t> users;
+      std::vector<in_addr> hits, misses;
+      for(size_t i = 0; i < n; ++i)
+      {
+         in_addr ip;
+         ip.s_addr = htonl(0x0a000000 + i * 3);
+         std::string nick = "user-" + boost::lexical_cast<std::string>(i);
+         nick.resize(std::max(nick_len, nick.size()), 'x');
+         users.push_back(user_t(ip, nick));
+         users.back().version = i;
+         hits.push_back(ip);
+         ip.s_addr = htonl(0x0a000001 + i * 3);
+         misses.push_back(ip);
+      }
+      std::shuffle(hits.begin(), hits.end(), random);
+      std::shuffle(misses.begin(), misses.end(), random);
+
+      std::cout << n << " users, nicks of " << users.back().nick.size() << " bytes, user_t " << sizeof(user_t) << " bytes" << std::endl;
+      bench<s2m::directory_t::users_map_t>("users_map_t      ", users, hits, misses);
+      bench<node_map_t>("std::unordered_map", users, hits, misses);
+   }
+
+   void usage(const char * name)
+   {
+      std::cerr << "usage: " << name << " [-l <nick bytes>] [users...]   (10, 10000 100000)\n";
+   }
+}
+
+int main(int argc, char** argv)
+{
+   size_t nick_len = 10;
+   std::vector<size_t> sizes;
+   try
+   {
+      for(int i = 1; i < argc; ++i)
+      {
+         std::string arg = argv[i];
+         if(arg == "-l" && i + 1 < argc)
+            nick_len = boost::lexical_cast<size_t>(argv[++i]);
+         else
+            sizes.push_back(boost::lexical_cast<size_t>(arg));
+      }
+   }
+   catch(boost::bad_lexical_cast &)
+   {
+      usage(argv[0]);
+      return 1;
+   }
+   if(sizes.empty())
+      sizes = {10000, 100000};
+   for(size_t n : sizes)
+      if(n != 0)
+         run(n, nick_len);
+   return 0;
+}